@@ -0,0 +1,446 @@
+#ifndef FRACTAL_KERNELS_H
+#define FRACTAL_KERNELS_H
+
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "perf_counters.h"
+
+/**
+ * Escape-time kernels of the Multibrot (z^d + c, z0 = 0) and Julia
+ * (z^d + c with fixed c, z0 = pixel) families.
+ *
+ * A row of a tile (or a list of pixels) is computed FRACTAL_LANES pixels
+ * at a time with the lanes advanced together (escaped lanes are frozen),
+ * so the inner loop is vectorized. The power d is unrolled in multiplications: the
+ * kernels for d = 2..FRACTAL_MAX_SPECIALIZED are generated at compile
+ * time with a constant d, the others use a loop on d.
+ *
+ * DATA_TYPE (the iteration counter) has to be defined before including
+ * this header. With PERF_COUNTERS the calls of fractal_tile_strided and
+ * fractal_pixels are counted per iteration, see perf_counters.h.
+ */
+
+#define FRACTAL_LANES 8
+#define FRACTAL_MAX_SPECIALIZED 8
+
+/* the smooth count follows the orbit up to this radius (at most FRACTAL_SMOOTH_STEPS more iterations) */
+#define FRACTAL_SMOOTH_RADIUS 256.0
+#define FRACTAL_SMOOTH_STEPS 64
+
+#define FRACTAL_INLINE static inline __attribute__((always_inline))
+
+enum fractal_family
+{
+    FRACTAL_MANDELBROT = 0,     /* Multibrot, z0 = 0 and c = pixel */
+    FRACTAL_JULIA = 1           /* z0 = pixel and c fixed */
+};
+
+typedef struct fractal_params_s
+{
+    int family;
+    int power;          /* d of z^d + c, d >= 2 */
+    double c_re;        /* Julia constant */
+    double c_im;
+    double x_min;       /* view of the image in the complex plane */
+    double y_min;
+    double span_x;
+    double span_y;
+} fractal_params;
+
+/**
+ * Default fractal, the Mandelbrot set of the original renderer
+ */
+fractal_params fractal_default(void)
+{
+    fractal_params f = {FRACTAL_MANDELBROT, 2, 0.0, 0.0, -2.5, -1.0, 3.5, 2.0};
+    return f;
+}
+
+/**
+ * Parse the fractal: mandelbrot, multibrot:d, julia:re,im or julia:re,im,d
+ * @return  1 on success, 0 otherwise
+ */
+int fractal_parse(const char *arg, fractal_params *f)
+{
+    char name[32];
+    double p1 = 0.0, p2 = 0.0;
+    int power = 2;
+    int ok = sscanf(arg, "%31[a-z]:", name);
+
+    if (ok != 1) return 0;
+
+    *f = fractal_default();
+
+    if (strcmp(name, "mandelbrot") == 0) {
+        return 1;
+    }
+    else if (strcmp(name, "multibrot") == 0) {
+        if (sscanf(arg, "%*[a-z]:%d", &power) != 1) return 0;
+    }
+    else if (strcmp(name, "julia") == 0) {
+        ok = sscanf(arg, "%*[a-z]:%lf,%lf,%d", &p1, &p2, &power);
+        if (ok < 2) return 0;
+        f->family = FRACTAL_JULIA;
+        f->c_re = p1;
+        f->c_im = p2;
+    }
+    else return 0;
+
+    if (power < 2) return 0;
+
+    // sets other than the Mandelbrot one are centered in the origin
+    f->power = power;
+    f->x_min = -1.75;
+    return 1;
+}
+
+/**
+ * z^d with d - 1 complex multiplications (unrolled when d is a constant)
+ */
+FRACTAL_INLINE void fractal_power(double x, double y, int d, double *rx, double *ry)
+{
+    double px = x,
+           py = y;
+    int k;
+
+    for (k = 1; k < d; ++k)
+    {
+        const double tmp = px * x - py * y;
+        py = px * y + py * x;
+        px = tmp;
+    }
+
+    *rx = px;
+    *ry = py;
+}
+
+/**
+ * Iterate FRACTAL_LANES orbits together until all of them escape or
+ * max_iterations is reached
+ */
+FRACTAL_INLINE void fractal_lanes(int d, double *x, double *y, const double *cx, const double *cy,
+                                  DATA_TYPE *iterations, unsigned int max_iterations)
+{
+    unsigned int it, l, num_active = FRACTAL_LANES;
+
+    for (it = 0; it != max_iterations && num_active != 0; ++it)
+    {
+        num_active = 0;
+
+        #pragma omp simd reduction(+:num_active)
+        for (l = 0; l < FRACTAL_LANES; ++l)
+        {
+            const unsigned int alive = (x[l] * x[l] + y[l] * y[l]) < 2*2;
+            double zx, zy;
+
+            fractal_power(x[l], y[l], d, &zx, &zy);
+
+            x[l] = alive ? zx + cx[l] : x[l];
+            y[l] = alive ? zy + cy[l] : y[l];
+            iterations[l] += alive;
+            num_active += alive;
+        }
+    }
+}
+
+/**
+ * Start the orbit of the pixel (x0, y0) of the plane
+ */
+FRACTAL_INLINE void fractal_lane_init(const fractal_params *f, double x0, double y0,
+                                      double *x, double *y, double *cx, double *cy)
+{
+    if (f->family == FRACTAL_JULIA)
+    {
+        *x = x0;
+        *y = y0;
+        *cx = f->c_re;
+        *cy = f->c_im;
+    }
+    else
+    {
+        *x = 0.0;
+        *y = 0.0;
+        *cx = x0;
+        *cy = y0;
+    }
+}
+
+/**
+ * Compute a tile of the image, rows of point_list are row_stride apart
+ */
+FRACTAL_INLINE void fractal_tile_run(const fractal_params *f, int d, DATA_TYPE *point_list,
+                                     unsigned int row_stride,
+                                     const unsigned int start_x, const unsigned int start_y,
+                                     const unsigned int max_iterations,
+                                     unsigned int size_x, unsigned int size_y,
+                                     unsigned int img_size_x, unsigned int img_size_y)
+{
+    double x[FRACTAL_LANES], y[FRACTAL_LANES],
+           cx[FRACTAL_LANES], cy[FRACTAL_LANES];
+    DATA_TYPE iterations[FRACTAL_LANES];
+    unsigned int Px = 0,
+                 Py = 0,
+                 l = 0;
+
+    for (Py = start_y; Py != start_y + size_y; ++Py)
+    {
+        const double y0 = ((double) Py * f->span_y / (double) img_size_y) + f->y_min;
+
+        for (Px = start_x; Px < start_x + size_x; Px += FRACTAL_LANES)
+        {
+            const unsigned int num_lanes = (start_x + size_x - Px < FRACTAL_LANES) ? start_x + size_x - Px : FRACTAL_LANES;
+
+            for (l = 0; l != FRACTAL_LANES; ++l)
+            {
+                // lanes past the end of the row repeat the last pixel
+                const unsigned int px = Px + ((l < num_lanes) ? l : num_lanes - 1);
+                const double x0 = ((double) px * f->span_x / (double) img_size_x) + f->x_min;
+
+                fractal_lane_init(f, x0, y0, x + l, y + l, cx + l, cy + l);
+                iterations[l] = 0;
+            }
+
+            fractal_lanes(d, x, y, cx, cy, iterations, max_iterations);
+
+            memcpy(point_list + (Px - start_x) + (Py - start_y) * row_stride, iterations, sizeof(DATA_TYPE) * num_lanes);
+        }
+    }
+}
+
+/**
+ * Compute the pixels (px[i], py[i]) of the image in point_list[i]
+ */
+FRACTAL_INLINE void fractal_pixels_run(const fractal_params *f, int d, DATA_TYPE *point_list,
+                                       const unsigned int *px, const unsigned int *py, unsigned int num_points,
+                                       const unsigned int max_iterations,
+                                       unsigned int img_size_x, unsigned int img_size_y)
+{
+    double x[FRACTAL_LANES], y[FRACTAL_LANES],
+           cx[FRACTAL_LANES], cy[FRACTAL_LANES];
+    DATA_TYPE iterations[FRACTAL_LANES];
+    unsigned int i = 0,
+                 l = 0;
+
+    for (i = 0; i < num_points; i += FRACTAL_LANES)
+    {
+        const unsigned int num_lanes = (num_points - i < FRACTAL_LANES) ? num_points - i : FRACTAL_LANES;
+
+        for (l = 0; l != FRACTAL_LANES; ++l)
+        {
+            // lanes past the end of the list repeat the last pixel
+            const unsigned int p = i + ((l < num_lanes) ? l : num_lanes - 1);
+            const double x0 = ((double) px[p] * f->span_x / (double) img_size_x) + f->x_min,
+                         y0 = ((double) py[p] * f->span_y / (double) img_size_y) + f->y_min;
+
+            fractal_lane_init(f, x0, y0, x + l, y + l, cx + l, cy + l);
+            iterations[l] = 0;
+        }
+
+        fractal_lanes(d, x, y, cx, cy, iterations, max_iterations);
+
+        memcpy(point_list + i, iterations, sizeof(DATA_TYPE) * num_lanes);
+    }
+}
+
+/*----- Kernels specialized on the power -----*/
+
+#define DEFINE_FRACTAL_KERNEL(D) \
+void fractal_tile_d##D(const fractal_params *f, DATA_TYPE *point_list, unsigned int row_stride, \
+                       const unsigned int start_x, const unsigned int start_y, \
+                       const unsigned int max_iterations, unsigned int size_x, unsigned int size_y, \
+                       unsigned int img_size_x, unsigned int img_size_y) \
+{ \
+    fractal_tile_run(f, D, point_list, row_stride, start_x, start_y, max_iterations, \
+                     size_x, size_y, img_size_x, img_size_y); \
+} \
+void fractal_pixels_d##D(const fractal_params *f, DATA_TYPE *point_list, \
+                         const unsigned int *px, const unsigned int *py, unsigned int num_points, \
+                         const unsigned int max_iterations, unsigned int img_size_x, unsigned int img_size_y) \
+{ \
+    fractal_pixels_run(f, D, point_list, px, py, num_points, max_iterations, img_size_x, img_size_y); \
+}
+
+DEFINE_FRACTAL_KERNEL(2)
+DEFINE_FRACTAL_KERNEL(3)
+DEFINE_FRACTAL_KERNEL(4)
+DEFINE_FRACTAL_KERNEL(5)
+DEFINE_FRACTAL_KERNEL(6)
+DEFINE_FRACTAL_KERNEL(7)
+DEFINE_FRACTAL_KERNEL(8)
+
+/**
+ * Sum of the iterations of a tile, the units of PERF_UNITS
+ */
+FRACTAL_INLINE unsigned long long fractal_iterations(const DATA_TYPE *point_list, unsigned int row_stride,
+                                                     unsigned int size_x, unsigned int size_y)
+{
+    unsigned long long sum = 0;
+    unsigned int i, j;
+
+    for (j = 0; j != size_y; ++j)
+        for (i = 0; i != size_x; ++i) sum += point_list[(size_t) j * row_stride + i];
+
+    return sum;
+}
+
+/**
+ * Compute a tile with the kernel of f->power, the rows of the tile are
+ * row_stride elements apart in point_list (the width of the image to
+ * write the tile in place)
+ * @param  f               fractal family, power and view
+ * @param  point_list      output, first element of the tile
+ * @param  row_stride      distance between two rows of point_list
+ * @param  start_x         first column of the tile
+ * @param  start_y         first row of the tile
+ * @param  max_iterations  iteration limit
+ * @param  size_x          columns of the tile
+ * @param  size_y          rows of the tile
+ * @param  img_size_x      width of the image
+ * @param  img_size_y      height of the image
+ */
+void fractal_tile_strided(const fractal_params *f, DATA_TYPE *point_list, unsigned int row_stride,
+                          const unsigned int start_x, const unsigned int start_y,
+                          const unsigned int max_iterations, unsigned int size_x, unsigned int size_y,
+                          unsigned int img_size_x, unsigned int img_size_y)
+{
+    PERF_BEGIN(perf);
+
+    switch (f->power) {
+        case 2 :
+            fractal_tile_d2(f, point_list, row_stride, start_x, start_y, max_iterations, size_x, size_y, img_size_x, img_size_y);
+            break;
+        case 3 :
+            fractal_tile_d3(f, point_list, row_stride, start_x, start_y, max_iterations, size_x, size_y, img_size_x, img_size_y);
+            break;
+        case 4 :
+            fractal_tile_d4(f, point_list, row_stride, start_x, start_y, max_iterations, size_x, size_y, img_size_x, img_size_y);
+            break;
+        case 5 :
+            fractal_tile_d5(f, point_list, row_stride, start_x, start_y, max_iterations, size_x, size_y, img_size_x, img_size_y);
+            break;
+        case 6 :
+            fractal_tile_d6(f, point_list, row_stride, start_x, start_y, max_iterations, size_x, size_y, img_size_x, img_size_y);
+            break;
+        case 7 :
+            fractal_tile_d7(f, point_list, row_stride, start_x, start_y, max_iterations, size_x, size_y, img_size_x, img_size_y);
+            break;
+        case 8 :
+            fractal_tile_d8(f, point_list, row_stride, start_x, start_y, max_iterations, size_x, size_y, img_size_x, img_size_y);
+            break;
+        default :
+            fractal_tile_run(f, f->power, point_list, row_stride, start_x, start_y, max_iterations,
+                             size_x, size_y, img_size_x, img_size_y);
+    }
+
+    PERF_UNITS(fractal_iterations(point_list, row_stride, size_x, size_y));
+    PERF_END(perf, PERF_KERNEL_ESCAPE);
+}
+
+/**
+ * Compute a tile, point_list is size_x * size_y row-major
+ */
+void fractal_tile(const fractal_params *f, DATA_TYPE *point_list,
+                  const unsigned int start_x, const unsigned int start_y,
+                  const unsigned int max_iterations, unsigned int size_x, unsigned int size_y,
+                  unsigned int img_size_x, unsigned int img_size_y)
+{
+    fractal_tile_strided(f, point_list, size_x, start_x, start_y, max_iterations,
+                         size_x, size_y, img_size_x, img_size_y);
+}
+
+/**
+ * Compute a list of pixels of the image with the kernel of f->power,
+ * the lanes are filled whatever the position of the pixels (e.g. the
+ * border of a block or the pixels missing in a sparse tile)
+ * @param  f               fractal family, power and view
+ * @param  point_list      output, num_points iterations
+ * @param  px              columns of the pixels
+ * @param  py              rows of the pixels
+ * @param  num_points      number of pixels
+ * @param  max_iterations  iteration limit
+ * @param  img_size_x      width of the image
+ * @param  img_size_y      height of the image
+ */
+void fractal_pixels(const fractal_params *f, DATA_TYPE *point_list,
+                    const unsigned int *px, const unsigned int *py, unsigned int num_points,
+                    const unsigned int max_iterations, unsigned int img_size_x, unsigned int img_size_y)
+{
+    PERF_BEGIN(perf);
+
+    switch (f->power) {
+        case 2 :
+            fractal_pixels_d2(f, point_list, px, py, num_points, max_iterations, img_size_x, img_size_y);
+            break;
+        case 3 :
+            fractal_pixels_d3(f, point_list, px, py, num_points, max_iterations, img_size_x, img_size_y);
+            break;
+        case 4 :
+            fractal_pixels_d4(f, point_list, px, py, num_points, max_iterations, img_size_x, img_size_y);
+            break;
+        case 5 :
+            fractal_pixels_d5(f, point_list, px, py, num_points, max_iterations, img_size_x, img_size_y);
+            break;
+        case 6 :
+            fractal_pixels_d6(f, point_list, px, py, num_points, max_iterations, img_size_x, img_size_y);
+            break;
+        case 7 :
+            fractal_pixels_d7(f, point_list, px, py, num_points, max_iterations, img_size_x, img_size_y);
+            break;
+        case 8 :
+            fractal_pixels_d8(f, point_list, px, py, num_points, max_iterations, img_size_x, img_size_y);
+            break;
+        default :
+            fractal_pixels_run(f, f->power, point_list, px, py, num_points, max_iterations, img_size_x, img_size_y);
+    }
+
+    PERF_UNITS(fractal_iterations(point_list, num_points, num_points, 1));
+    PERF_END(perf, PERF_KERNEL_ESCAPE);
+}
+
+/**
+ * Normalized iteration count of a pixel, mu = n + 1 - log_d(log|z_n|),
+ * continuous where the integer counts make bands. The orbit is followed
+ * past the escape radius 2 of the kernels up to FRACTAL_SMOOTH_RADIUS so
+ * that the log-log term is accurate, n counts those iterations too.
+ * @param  f               fractal family, power and view
+ * @param  px              column of the pixel
+ * @param  py              row of the pixel
+ * @param  max_iterations  iteration limit
+ * @param  img_size_x      width of the image
+ * @param  img_size_y      height of the image
+ * @return                 mu >= 0, -1.0 for the points that do not escape
+ */
+double fractal_smooth_iterations(const fractal_params *f, unsigned int px, unsigned int py,
+                                 unsigned int max_iterations, unsigned int img_size_x, unsigned int img_size_y)
+{
+    const double x0 = ((double) px * f->span_x / (double) img_size_x) + f->x_min,
+                 y0 = ((double) py * f->span_y / (double) img_size_y) + f->y_min;
+    double x, y, cx, cy, zx, zy, mu;
+    unsigned int n = 0,
+                 extra = 0;
+
+    fractal_lane_init(f, x0, y0, &x, &y, &cx, &cy);
+
+    for (n = 0; n != max_iterations && x * x + y * y < 2*2; ++n)
+    {
+        fractal_power(x, y, f->power, &zx, &zy);
+        x = zx + cx;
+        y = zy + cy;
+    }
+
+    if (x * x + y * y < 2*2) return -1.0;
+
+    for (extra = 0; extra != FRACTAL_SMOOTH_STEPS && x * x + y * y < FRACTAL_SMOOTH_RADIUS * FRACTAL_SMOOTH_RADIUS; ++extra)
+    {
+        fractal_power(x, y, f->power, &zx, &zy);
+        x = zx + cx;
+        y = zy + cy;
+    }
+
+    mu = (double) (n + extra) + 1.0 - log(0.5 * log(x * x + y * y)) / log((double) f->power);
+    return (mu > 0.0) ? mu : 0.0;
+}
+
+#endif
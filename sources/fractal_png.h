@@ -0,0 +1,393 @@
+#ifndef FRACTAL_PNG_H
+#define FRACTAL_PNG_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <zlib.h>
+
+/**
+ * Post-processing of an iteration matrix: colorization and PNG encoding.
+ *
+ * 1. the histogram of the iterations is computed with a parallel
+ *    reduction and turned in a color table with one entry per iteration
+ *    (histogram equalization or gray ramp); the smooth coloring has no
+ *    table, it recomputes the orbit of every escaped pixel to get its
+ *    normalized (fractional) iteration count
+ * 2. the image is split in bands of PNG_BAND_ROWS rows, every thread
+ *    colors, filters and deflates its bands (raw deflate ended with a
+ *    sync flush, so the bands can be concatenated)
+ * 3. the bands are written in order as soon as they are ready, each one
+ *    in its own IDAT chunk; the adler32 of the whole stream is combined
+ *    from the ones of the bands.
+ *
+ * DATA_TYPE (the iteration counter) has to be defined and fractal_kernels.h
+ * included before this header, link with -lz (and -fopenmp for the threads).
+ */
+
+#define PNG_BAND_ROWS 32
+#define PNG_COMPRESSION_LEVEL 6
+#define PALETTE_SIZE 1024
+
+enum color_mode
+{
+    COLOR_HISTOGRAM = 0,    /* histogram equalization */
+    COLOR_SMOOTH = 1,       /* normalized iteration count n + 1 - log_d(log|z_n|), continuous */
+    COLOR_GRAY = 2          /* linear gray ramp, for densities */
+};
+
+/**
+ * Parse the coloring: histogram, smooth or gray
+ * @return  1 on success, 0 otherwise
+ */
+int color_parse(const char *arg, int *mode)
+{
+    if (strcmp(arg, "histogram") == 0) *mode = COLOR_HISTOGRAM;
+    else if (strcmp(arg, "smooth") == 0) *mode = COLOR_SMOOTH;
+    else if (strcmp(arg, "gray") == 0) *mode = COLOR_GRAY;
+    else return 0;
+
+    return 1;
+}
+
+/*----- Colors -----*/
+
+/**
+ * Palette of PALETTE_SIZE RGB colors, linear gradient between key colors
+ */
+void palette_build(unsigned char *palette)
+{
+    static const double keys[][4] = {
+        /* position, r, g, b */
+        {0.0,     0.0,   7.0, 100.0},
+        {0.16,   32.0, 107.0, 203.0},
+        {0.42,  237.0, 255.0, 255.0},
+        {0.6425, 255.0, 170.0,  0.0},
+        {0.8575,   0.0,   2.0,  0.0},
+        {1.0,     0.0,   7.0, 100.0}
+    };
+    unsigned int i, k = 0;
+
+    for (i = 0; i != PALETTE_SIZE; ++i)
+    {
+        const double t = (double) i / (PALETTE_SIZE - 1);
+        double w;
+
+        while (t > keys[k + 1][0]) ++k;
+        w = (t - keys[k][0]) / (keys[k + 1][0] - keys[k][0]);
+
+        palette[3 * i + 0] = (unsigned char) (keys[k][1] + w * (keys[k + 1][1] - keys[k][1]) + 0.5);
+        palette[3 * i + 1] = (unsigned char) (keys[k][2] + w * (keys[k + 1][2] - keys[k][2]) + 0.5);
+        palette[3 * i + 2] = (unsigned char) (keys[k][3] + w * (keys[k + 1][3] - keys[k][3]) + 0.5);
+    }
+}
+
+/**
+ * Histogram of the iterations, threads accumulate private copies that
+ * are summed at the end (array reduction)
+ * @param  hist  max_iterations + 1 counters
+ */
+void iteration_histogram(const DATA_TYPE *matrix, size_t num_points, unsigned int max_iterations,
+                         unsigned long *hist)
+{
+    long i;
+
+    memset(hist, 0, sizeof(unsigned long) * (max_iterations + 1));
+
+    #pragma omp parallel for reduction(+:hist[:max_iterations + 1])
+    for (i = 0; i < (long) num_points; ++i)
+    {
+        ++hist[matrix[i]];
+    }
+}
+
+/**
+ * RGB color of every iteration count (histogram or gray), the points of
+ * the set (max_iterations) are black
+ * @param  table  3 * (max_iterations + 1) bytes
+ */
+void color_table(const DATA_TYPE *matrix, size_t num_points, unsigned int max_iterations,
+                 int mode, unsigned char *table)
+{
+    unsigned char palette[3 * PALETTE_SIZE];
+    unsigned int i;
+
+    palette_build(palette);
+
+    if (mode == COLOR_HISTOGRAM)
+    {
+        unsigned long *hist = (unsigned long*) malloc(sizeof(unsigned long) * (max_iterations + 1));
+        unsigned long total = 0,
+                      cumulative = 0;
+
+        iteration_histogram(matrix, num_points, max_iterations, hist);
+
+        for (i = 0; i != max_iterations; ++i) total += hist[i];
+        if (total == 0) total = 1;
+
+        for (i = 0; i != max_iterations; ++i)
+        {
+            const unsigned int index = (unsigned int) ((double) cumulative / total * (PALETTE_SIZE - 1));
+
+            cumulative += hist[i];
+            memcpy(table + 3 * i, palette + 3 * index, 3);
+        }
+
+        free(hist);
+    }
+    else
+    {
+        for (i = 0; i != max_iterations; ++i)
+        {
+            memset(table + 3 * i, (int) (255.0 * i / ((max_iterations > 1) ? max_iterations - 1 : 1)), 3);
+        }
+    }
+
+    memset(table + 3 * max_iterations, 0, 3);
+}
+
+/**
+ * How the bands are colored: through the table, or for COLOR_SMOOTH
+ * through the palette indexed by the normalized iteration count
+ */
+typedef struct
+{
+    const unsigned char *table;     /* 3 * (max_iterations + 1) bytes, NULL for COLOR_SMOOTH */
+    const unsigned char *palette;   /* 3 * PALETTE_SIZE bytes */
+    const fractal_params *fractal;  /* view of the matrix, COLOR_SMOOTH only */
+    unsigned int height;
+    unsigned int max_iterations;
+} png_coloring;
+
+/**
+ * Smooth color of an escaped pixel, logarithmic scale of mu interpolated
+ * between two entries of the palette
+ */
+void color_smooth(const png_coloring *coloring, unsigned int px, unsigned int py, unsigned int width,
+                  unsigned char *rgb)
+{
+    const double mu = fractal_smooth_iterations(coloring->fractal, px, py, coloring->max_iterations,
+                                                width, coloring->height);
+    const double scale = (PALETTE_SIZE - 1) / log((double) coloring->max_iterations + 1.0);
+    double t = (mu < 0.0) ? 0.0 : log(mu + 1.0) * scale,
+           w;
+    unsigned int index, k;
+
+    if (t > PALETTE_SIZE - 1) t = PALETTE_SIZE - 1;
+    index = (unsigned int) t;
+    if (index == PALETTE_SIZE - 1) index = PALETTE_SIZE - 2;
+    w = t - index;
+
+    for (k = 0; k != 3; ++k)
+    {
+        rgb[k] = (unsigned char) ((1.0 - w) * coloring->palette[3 * index + k]
+                                  + w * coloring->palette[3 * (index + 1) + k] + 0.5);
+    }
+}
+
+/*----- PNG -----*/
+
+void png_put_u32(unsigned char *buffer, unsigned long value)
+{
+    buffer[0] = (unsigned char) (value >> 24);
+    buffer[1] = (unsigned char) (value >> 16);
+    buffer[2] = (unsigned char) (value >> 8);
+    buffer[3] = (unsigned char) value;
+}
+
+/**
+ * Write a chunk: length, type, data and crc of type and data
+ */
+int png_write_chunk(FILE *out, const char *type, const unsigned char *data, size_t size)
+{
+    unsigned char header[8], footer[4];
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    png_put_u32(header, (unsigned long) size);
+    memcpy(header + 4, type, 4);
+
+    crc = crc32(crc, header + 4, 4);
+    if (size != 0) crc = crc32(crc, data, (uInt) size);
+    png_put_u32(footer, crc);
+
+    if (fwrite(header, 1, 8, out) != 8) return -1;
+    if (size != 0 && fwrite(data, 1, size, out) != size) return -1;
+    if (fwrite(footer, 1, 4, out) != 4) return -1;
+    return 0;
+}
+
+/**
+ * Color, filter (Sub) and deflate the rows [first_row, last_row) of the image
+ * @param  coloring  color table, or palette and view for COLOR_SMOOTH
+ * @param  raw       (last_row - first_row) * (1 + 3 * width) bytes of work space
+ * @param  out       compressed band, allocated here
+ * @param  out_size  size of the compressed band
+ * @param  adler     adler32 of the uncompressed band
+ * @return           0 on success, -1 otherwise
+ */
+int png_deflate_band(const DATA_TYPE *matrix, unsigned int width, unsigned int first_row, unsigned int last_row,
+                     const png_coloring *coloring, int last_band, unsigned char *raw,
+                     unsigned char **out, size_t *out_size, uLong *adler)
+{
+    const size_t row_size = 1 + 3 * (size_t) width,
+                 raw_size = row_size * (last_row - first_row);
+    unsigned int row, x;
+    z_stream stream;
+    uLong bound;
+    int ok;
+
+    for (row = first_row; row != last_row; ++row)
+    {
+        unsigned char *line = raw + row_size * (row - first_row);
+        const DATA_TYPE *values = matrix + (size_t) row * width;
+        size_t i;
+
+        line[0] = 1;    /* Sub filter */
+        if (coloring->table != NULL)
+        {
+            for (x = 0; x != width; ++x)
+            {
+                memcpy(line + 1 + 3 * x, coloring->table + 3 * values[x], 3);
+            }
+        }
+        else
+        {
+            for (x = 0; x != width; ++x)
+            {
+                if (values[x] >= coloring->max_iterations) memset(line + 1 + 3 * x, 0, 3);
+                else color_smooth(coloring, x, row, width, line + 1 + 3 * x);
+            }
+        }
+        for (i = row_size - 1; i > 3; --i)
+        {
+            line[i] = (unsigned char) (line[i] - line[i - 3]);
+        }
+    }
+
+    *adler = adler32(adler32(0L, Z_NULL, 0), raw, (uInt) raw_size);
+
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, PNG_COMPRESSION_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+
+    // room for the sync flush marker too
+    bound = deflateBound(&stream, raw_size) + 16;
+    *out = (unsigned char*) malloc(bound);
+
+    stream.next_in = raw;
+    stream.avail_in = (uInt) raw_size;
+    stream.next_out = *out;
+    stream.avail_out = (uInt) bound;
+
+    ok = deflate(&stream, last_band ? Z_FINISH : Z_SYNC_FLUSH);
+    *out_size = stream.total_out;
+    deflateEnd(&stream);
+
+    if (last_band ? ok != Z_STREAM_END : (ok != Z_OK || stream.avail_in != 0)) return -1;
+    return 0;
+}
+
+/**
+ * Color the iteration matrix and write it as an RGB PNG
+ * @param  path            output file
+ * @param  matrix          width * height iterations, row-major
+ * @param  width           width of the image
+ * @param  height          height of the image
+ * @param  max_iterations  iteration limit (points of the set)
+ * @param  mode            COLOR_HISTOGRAM, COLOR_SMOOTH or COLOR_GRAY
+ * @param  fractal         view the matrix was computed with, required by COLOR_SMOOTH (NULL otherwise)
+ * @return                 0 on success, -1 otherwise
+ */
+int fractal_write_png(const char *path, const DATA_TYPE *matrix, unsigned int width, unsigned int height,
+                      unsigned int max_iterations, int mode, const fractal_params *fractal)
+{
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    const unsigned char zlib_header[2] = {0x78, 0x9c};
+    const long num_bands = (height + PNG_BAND_ROWS - 1) / PNG_BAND_ROWS;
+    unsigned char ihdr[13], trailer[4];
+    unsigned char palette[3 * PALETTE_SIZE];
+    unsigned char *table = NULL;
+    png_coloring coloring;
+    uLong adler = adler32(0L, Z_NULL, 0);
+    int error = 0;
+    long band;
+    FILE *out;
+
+    if (mode == COLOR_SMOOTH && fractal == NULL) return -1;
+    if (mode != COLOR_SMOOTH)
+    {
+        table = (unsigned char*) malloc(3 * ((size_t) max_iterations + 1));
+        if (table == NULL) return -1;
+    }
+
+    out = fopen(path, "wb");
+    if (out == NULL)
+    {
+        free(table);
+        return -1;
+    }
+
+    palette_build(palette);
+    if (table != NULL) color_table(matrix, (size_t) width * height, max_iterations, mode, table);
+
+    coloring.table = table;
+    coloring.palette = palette;
+    coloring.fractal = fractal;
+    coloring.height = height;
+    coloring.max_iterations = max_iterations;
+
+    /*----- Header -----*/
+    png_put_u32(ihdr, width);
+    png_put_u32(ihdr + 4, height);
+    ihdr[8] = 8;    /* bit depth */
+    ihdr[9] = 2;    /* RGB */
+    ihdr[10] = 0;   /* deflate */
+    ihdr[11] = 0;   /* adaptive filters */
+    ihdr[12] = 0;   /* no interlace */
+
+    if (fwrite(signature, 1, 8, out) != 8
+        || png_write_chunk(out, "IHDR", ihdr, 13) != 0
+        || png_write_chunk(out, "IDAT", zlib_header, 2) != 0) error = 1;
+
+    /*----- Bands, deflated in parallel and written in order -----*/
+    #pragma omp parallel
+    {
+        unsigned char *raw = (unsigned char*) malloc((1 + 3 * (size_t) width) * PNG_BAND_ROWS);
+
+        #pragma omp for ordered schedule(dynamic, 1)
+        for (band = 0; band < num_bands; ++band)
+        {
+            const unsigned int first_row = band * PNG_BAND_ROWS,
+                               last_row = (first_row + PNG_BAND_ROWS < height) ? first_row + PNG_BAND_ROWS : height;
+            unsigned char *compressed = NULL;
+            size_t compressed_size = 0;
+            uLong band_adler = 0;
+            int band_error = png_deflate_band(matrix, width, first_row, last_row, &coloring,
+                                              band == num_bands - 1, raw,
+                                              &compressed, &compressed_size, &band_adler);
+
+            #pragma omp ordered
+            {
+                if (band_error || png_write_chunk(out, "IDAT", compressed, compressed_size) != 0) error = 1;
+                adler = adler32_combine(adler, band_adler, (z_off_t) ((1 + 3 * (size_t) width) * (last_row - first_row)));
+            }
+
+            free(compressed);
+        }
+
+        free(raw);
+    }
+
+    /*----- adler32 of the stream and end -----*/
+    png_put_u32(trailer, adler);
+
+    if (png_write_chunk(out, "IDAT", trailer, 4) != 0
+        || png_write_chunk(out, "IEND", NULL, 0) != 0) error = 1;
+
+    if (fclose(out) != 0) error = 1;
+    free(table);
+
+    return error ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef FRACTAL_PYRAMID_H
+#define FRACTAL_PYRAMID_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+
+/**
+ * Indexed container of a quadtree pyramid of square tiles.
+ *
+ * Level L has 2^L x 2^L tiles of tile_size x tile_size iterations, tile
+ * (L, x, y) has index (4^L - 1) / 3 + y * 2^L + x.
+ *
+ *   pyramid_header
+ *   pyramid_entry index[num_tiles]     offset and size of every tile
+ *   tiles                              zlib streams of the row-major
+ *                                      DATA_TYPE values, in any order
+ *
+ * Everything is in the byte order of the writer. The index is written
+ * by pyramid_close, an entry with size 0 is a missing tile.
+ *
+ * DATA_TYPE (the iteration counter) and fractal_params (fractal_kernels.h)
+ * have to be defined before including this header, link with -lz.
+ */
+
+#define PYRAMID_MAGIC "FRPYRAM1"
+#define PYRAMID_MAX_LEVELS 16
+
+typedef struct pyramid_header_s
+{
+    char magic[8];
+    uint32_t levels;
+    uint32_t tile_size;
+    uint32_t max_iterations;
+    uint32_t data_size;         /* sizeof(DATA_TYPE) */
+    fractal_params fractal;     /* view of the level 0 tile */
+} pyramid_header;
+
+typedef struct pyramid_entry_s
+{
+    uint64_t offset;
+    uint64_t size;
+} pyramid_entry;
+
+typedef struct pyramid_file_s
+{
+    FILE *file;
+    pyramid_header header;
+    pyramid_entry *index;
+    uint64_t num_tiles;
+    uint64_t end;               /* where the next tile is appended */
+    unsigned char *buffer;      /* compressed tile read back */
+    uint64_t buffer_size;
+} pyramid_file;
+
+uint64_t pyramid_num_tiles(unsigned int levels)
+{
+    return (((uint64_t) 1 << (2 * levels)) - 1) / 3;
+}
+
+uint64_t pyramid_tile_index(unsigned int level, unsigned int x, unsigned int y)
+{
+    return pyramid_num_tiles(level) + ((uint64_t) y << level) + x;
+}
+
+/**
+ * Create a pyramid, the index is reserved and written on close
+ * @return  0 on success, -1 otherwise
+ */
+int pyramid_create(pyramid_file *pyramid, const char *path, unsigned int levels, unsigned int tile_size,
+                   unsigned int max_iterations, const fractal_params *fractal)
+{
+    memset(pyramid, 0, sizeof(pyramid_file));
+
+    memcpy(pyramid->header.magic, PYRAMID_MAGIC, 8);
+    pyramid->header.levels = levels;
+    pyramid->header.tile_size = tile_size;
+    pyramid->header.max_iterations = max_iterations;
+    pyramid->header.data_size = sizeof(DATA_TYPE);
+    pyramid->header.fractal = *fractal;
+
+    pyramid->num_tiles = pyramid_num_tiles(levels);
+    pyramid->index = (pyramid_entry*) calloc(pyramid->num_tiles, sizeof(pyramid_entry));
+    pyramid->end = sizeof(pyramid_header) + sizeof(pyramid_entry) * pyramid->num_tiles;
+
+    pyramid->file = fopen(path, "w+b");
+    if (pyramid->file == NULL) return -1;
+
+    if (fwrite(&pyramid->header, sizeof(pyramid_header), 1, pyramid->file) != 1) return -1;
+    return 0;
+}
+
+/**
+ * Open a pyramid for reading
+ * @return  0 on success, -1 otherwise
+ */
+int pyramid_open(pyramid_file *pyramid, const char *path)
+{
+    memset(pyramid, 0, sizeof(pyramid_file));
+
+    pyramid->file = fopen(path, "rb");
+    if (pyramid->file == NULL) return -1;
+
+    if (fread(&pyramid->header, sizeof(pyramid_header), 1, pyramid->file) != 1
+        || memcmp(pyramid->header.magic, PYRAMID_MAGIC, 8) != 0
+        || pyramid->header.data_size != sizeof(DATA_TYPE)
+        || pyramid->header.levels > PYRAMID_MAX_LEVELS) return -1;
+
+    pyramid->num_tiles = pyramid_num_tiles(pyramid->header.levels);
+    pyramid->index = (pyramid_entry*) malloc(sizeof(pyramid_entry) * pyramid->num_tiles);
+
+    if (fread(pyramid->index, sizeof(pyramid_entry), pyramid->num_tiles, pyramid->file) != pyramid->num_tiles)
+        return -1;
+    return 0;
+}
+
+/**
+ * Append a compressed tile and record it in the index
+ * @return  0 on success, -1 otherwise
+ */
+int pyramid_write_tile(pyramid_file *pyramid, unsigned int level, unsigned int x, unsigned int y,
+                       const void *data, size_t size)
+{
+    pyramid_entry *entry = pyramid->index + pyramid_tile_index(level, x, y);
+
+    if (fseek(pyramid->file, (long) pyramid->end, SEEK_SET) != 0
+        || fwrite(data, 1, size, pyramid->file) != size) return -1;
+
+    entry->offset = pyramid->end;
+    entry->size = size;
+    pyramid->end += size;
+    return 0;
+}
+
+/**
+ * Read and uncompress a tile
+ * @param  tile  tile_size * tile_size values
+ * @return       0 on success, -1 otherwise (missing or broken tile)
+ */
+int pyramid_read_tile(pyramid_file *pyramid, unsigned int level, unsigned int x, unsigned int y, DATA_TYPE *tile)
+{
+    const pyramid_entry *entry = pyramid->index + pyramid_tile_index(level, x, y);
+    uLongf tile_size = sizeof(DATA_TYPE) * pyramid->header.tile_size * pyramid->header.tile_size;
+
+    if (entry->size == 0) return -1;
+
+    if (entry->size > pyramid->buffer_size)
+    {
+        pyramid->buffer = (unsigned char*) realloc(pyramid->buffer, entry->size);
+        pyramid->buffer_size = entry->size;
+    }
+
+    if (fseek(pyramid->file, (long) entry->offset, SEEK_SET) != 0
+        || fread(pyramid->buffer, 1, entry->size, pyramid->file) != entry->size) return -1;
+
+    if (uncompress((Bytef*) tile, &tile_size, pyramid->buffer, (uLong) entry->size) != Z_OK) return -1;
+    return 0;
+}
+
+/**
+ * Write the index (when created) and close the file
+ * @return  0 on success, -1 otherwise
+ */
+int pyramid_close(pyramid_file *pyramid, int write_index)
+{
+    int error = 0;
+
+    if (pyramid->file != NULL)
+    {
+        if (write_index
+            && (fseek(pyramid->file, (long) sizeof(pyramid_header), SEEK_SET) != 0
+                || fwrite(pyramid->index, sizeof(pyramid_entry), pyramid->num_tiles, pyramid->file) != pyramid->num_tiles))
+            error = 1;
+        if (fclose(pyramid->file) != 0) error = 1;
+    }
+
+    free(pyramid->index);
+    free(pyramid->buffer);
+    memset(pyramid, 0, sizeof(pyramid_file));
+
+    return error ? -1 : 0;
+}
+
+#endif
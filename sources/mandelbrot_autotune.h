@@ -0,0 +1,596 @@
+#ifndef MANDELBROT_AUTOTUNE_H
+#define MANDELBROT_AUTOTUNE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <mpi.h>
+
+/**
+ * Self-tuning of the SLB and DLB renderers from recorded run profiles.
+ *
+ * A work map (the image rendered at WORK_MAP_SIZE pixels with the same
+ * fractal and iterations) gives the iterations of any rectangle of the
+ * image, so every configuration has two features computed before the
+ * run: the makespan (iterations of the busiest worker, from the blocks
+ * of SLB or a simulation of the DLB farm) and the tiles per worker.
+ * The elapsed time is modeled as
+ *
+ *   T = alpha * makespan + beta * tiles per worker + gamma
+ *
+ * with alpha, beta and gamma fitted by least squares on the profiles of
+ * the past runs of the program, appended to a csv database (PROFILE_PATH,
+ * or the file named by PROFILE_ENV, an empty name disables it). Only
+ * the auto runs, and the manual runs when PROFILE_ENV is set, pay for
+ * the work map and write a profile (profile_enabled). With too
+ * few profiles alpha is the speed of the kernel measured on the work map
+ * and the other terms are 0, short calibration renders can fill the
+ * database first.
+ *
+ * DATA_TYPE and fractal_kernels.h have to come before this header.
+ */
+
+#define PROFILE_PATH "mandelbrot_profiles.csv"
+#define PROFILE_ENV "MANDELBROT_PROFILES"
+#define PROFILE_MAX 1024            /* most recent profiles used by the fit */
+#define PROFILE_MIN_HISTORY 3       /* profiles needed to fit the model */
+#define WORK_MAP_SIZE 128           /* width of the work map */
+#define CALIBRATION_RUNS 3          /* renders at half resolution */
+
+enum autotune_mode
+{
+    AUTOTUNE_OFF = 0,
+    AUTOTUNE_ON = 1,                /* "auto" */
+    AUTOTUNE_CALIBRATE = 2          /* "auto:calibrate", calibration renders without history */
+};
+
+int autotune_parse(const char *arg, int *mode)
+{
+    if (strcmp(arg, "auto") == 0) *mode = AUTOTUNE_ON;
+    else if (strcmp(arg, "auto:calibrate") == 0) *mode = AUTOTUNE_CALIBRATE;
+    else return 0;
+
+    return 1;
+}
+
+/*----- Work map -----*/
+
+typedef struct work_map_s
+{
+    unsigned int width;
+    unsigned int height;
+    double *sum;                    /* summed-area table of the iterations, (width + 1) x (height + 1) */
+    double seconds_per_iteration;   /* speed of the kernel on one rank */
+} work_map;
+
+/**
+ * Render the work map, rows spread over the ranks, collective on comm
+ */
+work_map work_map_build(MPI_Comm comm, const fractal_params *f, unsigned int max_iterations,
+                        unsigned int img_size_x, unsigned int img_size_y)
+{
+    work_map map;
+    DATA_TYPE *row = NULL;
+    double *cells = NULL,
+           stats[2] = {0.0, 0.0};   /* seconds and iterations of the rank */
+    unsigned int x = 0,
+                 y = 0;
+    int rank = -1,
+        size = 0;
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    map.width = (img_size_x < WORK_MAP_SIZE) ? img_size_x : WORK_MAP_SIZE;
+    map.height = (unsigned int) ((double) map.width * img_size_y / img_size_x + 0.5);
+    if (map.height == 0) map.height = 1;
+    if (map.height > img_size_y) map.height = img_size_y;
+
+    cells = (double*) calloc((size_t) map.width * map.height, sizeof(double));
+    row = (DATA_TYPE*) malloc(sizeof(DATA_TYPE) * map.width);
+
+    for (y = rank; y < map.height; y += size)
+    {
+        double start = MPI_Wtime();
+
+        fractal_tile(f, row, 0, y, max_iterations, map.width, 1, map.width, map.height);
+        stats[0] += MPI_Wtime() - start;
+
+        for (x = 0; x != map.width; ++x)
+        {
+            cells[(size_t) y * map.width + x] = row[x];
+            stats[1] += row[x];
+        }
+    }
+
+    MPI_Allreduce(MPI_IN_PLACE, cells, (int) (map.width * map.height), MPI_DOUBLE, MPI_SUM, comm);
+    MPI_Allreduce(MPI_IN_PLACE, stats, 2, MPI_DOUBLE, MPI_SUM, comm);
+
+    map.seconds_per_iteration = (stats[1] > 0.0) ? stats[0] / stats[1] : 0.0;
+
+    map.sum = (double*) calloc((size_t) (map.width + 1) * (map.height + 1), sizeof(double));
+    for (y = 0; y != map.height; ++y)
+        for (x = 0; x != map.width; ++x)
+            map.sum[(size_t) (y + 1) * (map.width + 1) + x + 1] = cells[(size_t) y * map.width + x]
+                + map.sum[(size_t) y * (map.width + 1) + x + 1]
+                + map.sum[(size_t) (y + 1) * (map.width + 1) + x]
+                - map.sum[(size_t) y * (map.width + 1) + x];
+
+    /*----- CLEAN -----*/
+    free(row);
+    free(cells);
+
+    return map;
+}
+
+void work_map_free(work_map *map)
+{
+    free(map->sum);
+    map->sum = NULL;
+}
+
+/**
+ * Iterations of [0, X) x [0, Y) in cells, the table is interpolated
+ * bilinearly, exact for a constant density inside the cells
+ */
+double work_map_area(const work_map *map, double X, double Y)
+{
+    const size_t stride = map->width + 1;
+    unsigned int i = (unsigned int) X,
+                 j = (unsigned int) Y;
+    double fx, fy;
+
+    if (i >= map->width) i = map->width - 1;
+    if (j >= map->height) j = map->height - 1;
+    fx = X - i;
+    fy = Y - j;
+
+    return (1.0 - fx) * (1.0 - fy) * map->sum[j * stride + i] + fx * (1.0 - fy) * map->sum[j * stride + i + 1]
+         + (1.0 - fx) * fy * map->sum[(j + 1) * stride + i] + fx * fy * map->sum[(j + 1) * stride + i + 1];
+}
+
+/**
+ * Iterations of a rectangle of an image of img_size_x x img_size_y pixels
+ */
+double work_map_rect(const work_map *map, unsigned int img_size_x, unsigned int img_size_y,
+                     unsigned int start_x, unsigned int start_y, unsigned int size_x, unsigned int size_y)
+{
+    const double sx = (double) map->width / img_size_x,
+                 sy = (double) map->height / img_size_y;
+    const double x0 = start_x * sx, x1 = (start_x + size_x) * sx,
+                 y0 = start_y * sy, y1 = (start_y + size_y) * sy;
+
+    return (work_map_area(map, x1, y1) - work_map_area(map, x0, y1)
+            - work_map_area(map, x1, y0) + work_map_area(map, x0, y0)) / (sx * sy);
+}
+
+/*----- Farm simulation -----*/
+
+/**
+ * Makespan of the task farm on equally fast workers: tasks are handed
+ * out in order to the first idle worker, then with split != 0 the idle
+ * workers run the halves of the oldest unfinished task and the task ends
+ * with the first of the original and the two halves (task_farm_dispatch_speculative)
+ * @param  cost     work of every task
+ * @param  half     work of the two halves of every task
+ * @param  n        number of tasks
+ * @param  workers  number of workers
+ * @return          work of the busiest worker
+ */
+double farm_simulate(const double *cost, const double (*half)[2], int n, int workers, int split)
+{
+    double *idle = (double*) calloc(workers, sizeof(double)),
+           *end = (double*) malloc(sizeof(double) * n),
+           *half_end = (double*) malloc(sizeof(double) * n),
+           makespan = 0.0;
+    int *owner = (int*) malloc(sizeof(int) * n),
+        *backup = (int*) calloc(n, sizeof(int));   /* halves started */
+    int i = 0,
+        w = 0,
+        best = 0;
+
+    for (i = 0; i != n; ++i)
+    {
+        for (w = 1, best = 0; w < workers; ++w)
+            if (idle[w] < idle[best]) best = w;
+
+        end[i] = idle[best] + cost[i];
+        idle[best] = end[i];
+        owner[i] = best;
+    }
+
+    while (split)
+    {
+        double t;
+        int task = -1;
+
+        for (w = 1, best = 0; w < workers; ++w)
+            if (idle[w] < idle[best]) best = w;
+
+        t = idle[best];
+        if (t == HUGE_VAL) break;
+
+        // the second half of a task, otherwise the oldest task without backup
+        for (i = 0; i != n && task == -1; ++i)
+            if (backup[i] == 1 && end[i] > t) task = i;
+        for (i = 0; i != n && task == -1; ++i)
+            if (backup[i] == 0 && end[i] > t) task = i;
+
+        if (task == -1)
+        {
+            idle[best] = HUGE_VAL;
+            continue;
+        }
+
+        if (backup[task] == 0)
+        {
+            half_end[task] = t + half[task][0];
+            idle[best] = (half_end[task] < end[task]) ? half_end[task] : end[task];
+        }
+        else
+        {
+            double halves_end = t + half[task][1];
+
+            if (half_end[task] > halves_end) halves_end = half_end[task];
+            if (halves_end < end[task])
+            {
+                // the original is cancelled when the halves are done
+                idle[owner[task]] = halves_end;
+                end[task] = halves_end;
+            }
+            idle[best] = end[task];
+        }
+        ++backup[task];
+    }
+
+    for (i = 0; i != n; ++i)
+        if (end[i] > makespan) makespan = end[i];
+
+    /*----- CLEAN -----*/
+    free(backup);
+    free(owner);
+    free(half_end);
+    free(end);
+    free(idle);
+
+    return makespan;
+}
+
+/*----- Profiles -----*/
+
+typedef struct run_profile_s
+{
+    char program[8];                /* SLB or DLB */
+    int ranks;
+    unsigned int width;
+    unsigned int height;
+    unsigned int max_iterations;
+    int grid_x;
+    int grid_y;
+    double k;                       /* 1 for SLB */
+    int speculation;                /* 0 for SLB */
+    double makespan;                /* features of the model */
+    double tasks;
+    double predicted;
+    double elapsed;
+    double busy_max;                /* compute time of the busiest rank */
+    double busy_mean;               /* compute time of the average working rank */
+} run_profile;
+
+const char *profile_path(void)
+{
+    const char *path = getenv(PROFILE_ENV);
+
+    if (path == NULL) return PROFILE_PATH;
+    return (path[0] != '\0') ? path : NULL;
+}
+
+/**
+ * Work map, features and profile of the run: always in auto mode, in
+ * manual mode only when PROFILE_ENV names a database
+ */
+int profile_enabled(int mode)
+{
+    const char *path = getenv(PROFILE_ENV);
+
+    return mode != AUTOTUNE_OFF || (path != NULL && path[0] != '\0');
+}
+
+/**
+ * Load the most recent profiles of a program
+ * @param  profiles  PROFILE_MAX profiles
+ * @return           number of profiles loaded
+ */
+int profile_load(const char *program, run_profile *profiles)
+{
+    const char *path = profile_path();
+    FILE *in = NULL;
+    char line[512];
+    int n = 0;
+
+    if (path == NULL || (in = fopen(path, "r")) == NULL) return 0;
+
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        run_profile p;
+
+        // the header and the lines of the other program do not touch the ring
+        if (sscanf(line, "%7[^,],%d,%u,%u,%u,%d,%d,%lf,%d,%lf,%lf,%lf,%lf,%lf,%lf",
+                   p.program, &p.ranks, &p.width, &p.height, &p.max_iterations,
+                   &p.grid_x, &p.grid_y, &p.k, &p.speculation, &p.makespan, &p.tasks,
+                   &p.predicted, &p.elapsed, &p.busy_max, &p.busy_mean) == 15
+            && strcmp(p.program, program) == 0)
+            profiles[n++ % PROFILE_MAX] = p;
+    }
+    fclose(in);
+
+    return (n < PROFILE_MAX) ? n : PROFILE_MAX;
+}
+
+/**
+ * Append a profile to the database
+ * @return  0 on success (or without database), -1 otherwise
+ */
+int profile_append(const run_profile *p)
+{
+    const char *path = profile_path();
+    FILE *out = NULL;
+    long size = 0;
+
+    if (path == NULL) return 0;
+    if ((out = fopen(path, "a")) == NULL) return -1;
+
+    fseek(out, 0, SEEK_END);
+    size = ftell(out);
+    if (size == 0)
+        fprintf(out, "program,ranks,width,height,iterations,grid_x,grid_y,k,speculation,"
+                     "makespan,tasks,predicted,elapsed,busy_max,busy_mean\n");
+
+    fprintf(out, "%s,%d,%u,%u,%u,%d,%d,%g,%d,%.6e,%.6e,%.6f,%.6f,%.6f,%.6f\n",
+            p->program, p->ranks, p->width, p->height, p->max_iterations, p->grid_x, p->grid_y,
+            p->k, p->speculation, p->makespan, p->tasks, p->predicted, p->elapsed, p->busy_max, p->busy_mean);
+
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+/**
+ * Keep the max candidates with the lowest predicted time, in order
+ */
+void profile_rank(run_profile *best, int max, int *count, const run_profile *candidate)
+{
+    int i = (*count < max) ? (*count)++ : max;
+
+    if (i == max && candidate->predicted >= best[max - 1].predicted) return;
+    if (i == max) --i;
+
+    for (; i > 0 && best[i - 1].predicted > candidate->predicted; --i) best[i] = best[i - 1];
+    best[i] = *candidate;
+}
+
+/**
+ * Send the configuration chosen by rank 0 to every rank
+ */
+void profile_bcast_config(run_profile *p, MPI_Comm comm)
+{
+    int config[3] = {p->grid_x, p->grid_y, p->speculation};
+
+    MPI_Bcast(config, 3, MPI_INT, 0, comm);
+    MPI_Bcast(&p->k, 1, MPI_DOUBLE, 0, comm);
+
+    p->grid_x = config[0];
+    p->grid_y = config[1];
+    p->speculation = config[2];
+}
+
+/*----- Cost model -----*/
+
+typedef struct cost_model_s
+{
+    double alpha;                   /* seconds per iteration of the busiest worker */
+    double beta;                    /* seconds per tile of a worker */
+    double gamma;                   /* fixed cost of a run */
+    int samples;                    /* profiles of the fit, 0 for the work map speed */
+} cost_model;
+
+double cost_model_predict(const cost_model *model, double makespan, double tasks)
+{
+    return model->alpha * makespan + model->beta * tasks + model->gamma;
+}
+
+/**
+ * Solve the normal equations of the first m terms (alpha, gamma, beta)
+ * @return  0 when they are singular, alpha is not positive or gamma or
+ *          beta is negative (a cost cannot save time)
+ */
+int cost_model_solve(const run_profile *profiles, int n, int m, double *coef)
+{
+    double a[3][4];
+    int i = 0, j = 0, r = 0, c = 0;
+
+    memset(a, 0, sizeof(a));
+
+    for (i = 0; i != n; ++i)
+    {
+        const double x[3] = {profiles[i].makespan, 1.0, profiles[i].tasks};
+
+        for (r = 0; r != m; ++r)
+        {
+            for (c = 0; c != m; ++c) a[r][c] += x[r] * x[c];
+            a[r][m] += x[r] * profiles[i].elapsed;
+        }
+    }
+
+    // Gauss-Jordan with partial pivoting
+    for (c = 0; c != m; ++c)
+    {
+        int pivot = c;
+        double scale = 0.0;
+
+        for (r = c + 1; r != m; ++r)
+            if (fabs(a[r][c]) > fabs(a[pivot][c])) pivot = r;
+
+        for (r = 0; r != m; ++r) scale += fabs(a[r][c]);
+        if (fabs(a[pivot][c]) <= 1e-12 * scale) return 0;
+
+        for (j = 0; j <= m; ++j)
+        {
+            double t = a[c][j];
+            a[c][j] = a[pivot][j];
+            a[pivot][j] = t;
+        }
+
+        for (r = 0; r != m; ++r)
+        {
+            double f = a[r][c] / a[c][c];
+            if (r == c) continue;
+            for (j = c; j <= m; ++j) a[r][j] -= f * a[c][j];
+        }
+    }
+
+    for (r = 0; r != m; ++r) coef[r] = a[r][m] / a[r][r];
+
+    if (!(coef[0] > 0.0)) return 0;
+    for (r = 1; r != m; ++r)
+        if (coef[r] < 0.0) return 0;
+    return 1;
+}
+
+/**
+ * Fit the model on the profiles, dropping beta and then gamma when the
+ * profiles cannot tell them apart (e.g. SLB always has 1 tile per worker)
+ * or their fit is negative
+ */
+cost_model cost_model_fit(const run_profile *profiles, int n, const work_map *map)
+{
+    cost_model model = {map->seconds_per_iteration, 0.0, 0.0, 0};
+    double coef[3] = {0.0, 0.0, 0.0};
+    int m = 3;
+
+    if (n < PROFILE_MIN_HISTORY) return model;
+
+    while (m != 0 && !cost_model_solve(profiles, n, m, coef)) --m;
+    if (m == 0) return model;
+
+    model.alpha = coef[0];
+    model.gamma = (m > 1) ? coef[1] : 0.0;
+    model.beta = (m > 2) ? coef[2] : 0.0;
+    model.samples = n;
+    return model;
+}
+
+/*----- Autotune -----*/
+
+/* features (makespan, tasks) and predicted time of the configuration of run */
+typedef void (*autotune_features)(const work_map *map, const cost_model *model, run_profile *run);
+
+/* the max best configurations for the size of base, sorted by predicted time */
+typedef int (*autotune_candidates)(const work_map *map, const cost_model *model, const run_profile *base,
+                                   run_profile *best, int max);
+
+/* render of a configuration, collective on MPI_COMM_WORLD, verbose = 0 for calibration */
+typedef void (*autotune_render)(const void *ctx, run_profile *run, int verbose);
+
+/**
+ * Choose the configuration of run when mode is not AUTOTUNE_OFF, after
+ * the calibration renders at half resolution (the best candidates of
+ * the current model) if requested and without history. Collective on
+ * MPI_COMM_WORLD, rank 0 gets the features and the predicted time.
+ * run->grid_x is 0 on every rank when no configuration fits.
+ * @return  the model, on rank 0
+ */
+cost_model autotune_configure(int mode, const work_map *map, run_profile *run,
+                              autotune_features features, autotune_candidates candidates,
+                              autotune_render render, const void *ctx)
+{
+    cost_model model = {0.0, 0.0, 0.0, 0};
+    run_profile *profiles = NULL;
+    int rank = -1,
+        num_profiles = 0,
+        calibrate = 0,
+        i = 0;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    if (rank == 0)
+    {
+        profiles = (run_profile*) malloc(sizeof(run_profile) * PROFILE_MAX);
+        num_profiles = profile_load(run->program, profiles);
+        model = cost_model_fit(profiles, num_profiles, map);
+        calibrate = (mode == AUTOTUNE_CALIBRATE && num_profiles < PROFILE_MIN_HISTORY);
+    }
+
+    MPI_Bcast(&calibrate, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    /*----- Calibration -----*/
+    if (calibrate)
+    {
+        run_profile best[CALIBRATION_RUNS],
+                    half = *run;
+        int num_best = 0;
+
+        half.width = (run->width > 1) ? run->width / 2 : 1;
+        half.height = (run->height > 1) ? run->height / 2 : 1;
+
+        if (rank == 0) num_best = candidates(map, &model, &half, best, CALIBRATION_RUNS);
+        MPI_Bcast(&num_best, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+        for (i = 0; i != num_best; ++i)
+        {
+            if (rank != 0) best[i] = half;
+            profile_bcast_config(best + i, MPI_COMM_WORLD);
+
+            render(ctx, best + i, 0);
+
+            if (rank == 0)
+            {
+                fprintf(stdout, ">>> Calibration %dx%d (K %g, speculation %d) at %ux%u: predicted %f, elapsed %f\n",
+                        best[i].grid_x, best[i].grid_y, best[i].k, best[i].speculation,
+                        best[i].width, best[i].height, best[i].predicted, best[i].elapsed);
+                profile_append(best + i);
+                if (num_profiles != PROFILE_MAX) profiles[num_profiles++] = best[i];
+            }
+        }
+
+        if (rank == 0) model = cost_model_fit(profiles, num_profiles, map);
+    }
+
+    /*----- Configuration -----*/
+    if (mode != AUTOTUNE_OFF)
+    {
+        if (rank == 0)
+        {
+            const run_profile base = *run;
+            if (candidates(map, &model, &base, run, 1) == 0) run->grid_x = 0;
+        }
+        profile_bcast_config(run, MPI_COMM_WORLD);
+    }
+    else if (rank == 0)
+    {
+        features(map, &model, run);
+    }
+
+    /*----- CLEAN -----*/
+    free(profiles);
+
+    return model;
+}
+
+/*----- Busy time -----*/
+
+/**
+ * Compute time of the busiest rank and of the average working rank,
+ * collective on comm, the result is on rank 0
+ */
+void busy_reduce(MPI_Comm comm, double busy, double *busy_max, double *busy_mean)
+{
+    double in[2] = {busy, busy > 0.0 ? 1.0 : 0.0},
+           sum[2] = {0.0, 0.0};
+
+    MPI_Reduce(&busy, busy_max, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+    MPI_Reduce(in, sum, 2, MPI_DOUBLE, MPI_SUM, 0, comm);
+
+    *busy_mean = (sum[1] > 0.0) ? sum[0] / sum[1] : 0.0;
+}
+
+#endif
@@ -0,0 +1,77 @@
+import socket
+import sys
+from array import array
+
+SOCKET_PATH = "/tmp/mandelbrot_server.sock"
+
+
+class RenderClient(object):
+    """Client of project_mandelbrot_server."""
+
+    def __init__(self, path=SOCKET_PATH):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+        self.stream = self.sock.makefile("rb")
+        self.next_id = 0
+
+    def request(self, width, height, iterations, fractal="mandelbrot", view=None):
+        """Send a render request, a pending one is cancelled by the server."""
+        self.next_id += 1
+        line = "RENDER {} {}x{} {} {}".format(
+            self.next_id, width, height, iterations, fractal)
+        if view is not None:
+            line += " {},{},{},{}".format(*view)
+        self.sock.sendall((line + "\n").encode())
+        return self.next_id
+
+    def replies(self):
+        """Yield the replies: (kind, id, level, width, height, data)."""
+        while True:
+            line = self.stream.readline().decode().split()
+            if not line:
+                return
+            if line[0] == "FRAME":
+                width, height = (int(v) for v in line[3].split("x"))
+                data = array("H")
+                data.frombytes(self.stream.read(int(line[4])))
+                yield ("FRAME", int(line[1]), int(line[2]), width, height, data)
+            elif line[0] in ("DONE", "CANCELLED"):
+                yield (line[0], int(line[1]), None, None, None, None)
+            else:
+                yield (line[0], None, None, None, None, None)
+
+    def render(self, width, height, iterations, fractal="mandelbrot", view=None):
+        """Render and yield the frames of the request, coarse one first."""
+        job = self.request(width, height, iterations, fractal, view)
+        for kind, rid, level, f_width, f_height, data in self.replies():
+            if kind == "FRAME" and rid == job:
+                yield level, f_width, f_height, data
+            elif kind in ("DONE", "CANCELLED", "ERROR") and rid in (job, None):
+                return
+
+    def close(self, shutdown=False):
+        """Close the connection, optionally stopping the server."""
+        self.sock.sendall(b"SHUTDOWN\n" if shutdown else b"QUIT\n")
+        self.stream.close()
+        self.sock.close()
+
+
+def main():
+    """Render the default view and show the frames as they arrive."""
+    from matplotlib import pyplot as plt
+
+    path = sys.argv[1] if len(sys.argv) > 1 else SOCKET_PATH
+    client = RenderClient(path)
+
+    for level, width, height, data in client.render(1280, 720, 1000):
+        print("level {}: {}x{}".format(level, width, height))
+        plt.imshow([data[row * width:(row + 1) * width]
+                    for row in range(height)], cmap="magma")
+        plt.pause(0.1)
+
+    client.close()
+    plt.show()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,101 @@
+#ifndef MPI_SHARED_IMAGE_H
+#define MPI_SHARED_IMAGE_H
+
+#include <stdlib.h>
+#include <mpi.h>
+
+/**
+ * Image allocated by the root in an MPI shared memory window.
+ *
+ * The ranks on the same node of the root get a pointer to the image and
+ * write their pixels in place, then they only have to tell the root that
+ * the tile is done (a zero-length message); the ranks on other nodes get
+ * NULL and keep sending their tiles.
+ *
+ * The window is locked for the whole life of the image (passive target),
+ * a writer calls shared_image_sync after its writes and before the
+ * message, the root calls it after the message and before reading.
+ */
+
+typedef struct shared_image_s
+{
+    MPI_Comm node_comm;     /* ranks on the node of the root, MPI_COMM_NULL elsewhere */
+    MPI_Win win;
+    void *base;             /* the image, NULL on the ranks of other nodes */
+} shared_image;
+
+/**
+ * Allocate the image, collective on comm
+ * @param  comm  communicator of root and writers
+ * @param  root  rank (in comm) that owns the image
+ * @param  size  size of the image in bytes
+ */
+shared_image shared_image_alloc(MPI_Comm comm, int root, size_t size)
+{
+    shared_image image;
+    MPI_Comm shared_comm;
+    int rank = -1,
+        node_rank = -1,
+        has_root = 0,
+        root_node_rank = 0;
+
+    image.node_comm = MPI_COMM_NULL;
+    image.win = MPI_WIN_NULL;
+    image.base = NULL;
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &shared_comm);
+    MPI_Comm_rank(shared_comm, &node_rank);
+
+    has_root = (rank == root);
+    MPI_Allreduce(MPI_IN_PLACE, &has_root, 1, MPI_INT, MPI_MAX, shared_comm);
+
+    if (!has_root)
+    {
+        MPI_Comm_free(&shared_comm);
+        return image;
+    }
+
+    image.node_comm = shared_comm;
+
+    root_node_rank = (rank == root) ? node_rank : 0;
+    MPI_Allreduce(MPI_IN_PLACE, &root_node_rank, 1, MPI_INT, MPI_MAX, image.node_comm);
+
+    MPI_Win_allocate_shared((rank == root) ? (MPI_Aint) size : 0, 1, MPI_INFO_NULL,
+                            image.node_comm, &image.base, &image.win);
+
+    if (rank != root)
+    {
+        MPI_Aint root_size = 0;
+        int disp_unit = 0;
+
+        MPI_Win_shared_query(image.win, root_node_rank, &root_size, &disp_unit, &image.base);
+    }
+
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, image.win);
+    return image;
+}
+
+/**
+ * Memory barrier on the window (no-op on the ranks of other nodes)
+ */
+void shared_image_sync(const shared_image *image)
+{
+    if (image->win != MPI_WIN_NULL) MPI_Win_sync(image->win);
+}
+
+/**
+ * Free the image, collective on the node of the root
+ */
+void shared_image_free(shared_image *image)
+{
+    if (image->win != MPI_WIN_NULL)
+    {
+        MPI_Win_unlock_all(image->win);
+        MPI_Win_free(&image->win);
+    }
+    if (image->node_comm != MPI_COMM_NULL) MPI_Comm_free(&image->node_comm);
+    image->base = NULL;
+}
+
+#endif
@@ -0,0 +1,918 @@
+#ifndef MPI_TASK_FARM_H
+#define MPI_TASK_FARM_H
+
+#include <stdlib.h>  // required by malloc
+#include <string.h>
+#include <stddef.h>  // required by offsetof
+#include <mpi.h>
+
+/**
+ * Master/worker task farm.
+ *
+ * The master (rank 0 of the communicator) asks a scheduler for tasks and
+ * sends them to the workers (ranks 1..num_workers), every worker sends
+ * back a result and receives a new task until the scheduler is empty.
+ * At the end every worker receives an empty message with FARM_TAG_EXIT.
+ *
+ * Tasks are a single element of task_type, results are a variable
+ * number of elements of result_type.
+ *
+ * With many nodes the master can run the hierarchical version: on every
+ * shared memory node a sub-master receives batches of tasks from the
+ * master, hands them out to the ranks of its node and sends back the
+ * results of the whole batch, so the master only talks with one rank
+ * per node.
+ *
+ * The speculative version of the flat farm mitigates the tail: once the
+ * scheduler is empty the idle workers receive a copy (or the two halves)
+ * of the oldest unfinished task, the first complete result wins and the
+ * other workers of the task receive FARM_TAG_CANCEL.
+ */
+
+#define FARM_MASTER 0
+
+#define FARM_TAG_TASK 1
+#define FARM_TAG_RESULT 2
+#define FARM_TAG_EXIT 3
+#define FARM_TAG_COUNTS 4
+#define FARM_TAG_CANCEL 5
+#define FARM_TAG_CANCELLED 6
+
+typedef struct task_farm_s
+{
+    MPI_Comm comm;
+    int num_workers;            /* workers are the ranks 1..num_workers */
+    MPI_Datatype task_type;     /* MPI type of one task */
+    size_t task_size;           /* sizeof of one task */
+    MPI_Datatype result_type;   /* MPI type of one result element */
+    size_t result_size;         /* sizeof of one result element */
+} task_farm;
+
+/**
+ * Pluggable scheduler: next_task fills task with the next job for the
+ * given worker and returns 0 when there are no more tasks.
+ */
+typedef struct task_scheduler_s
+{
+    int (*next_task)(void *state, void *task, int worker);
+    void *state;
+} task_scheduler;
+
+/**
+ * Called by the master for every result
+ * @param  ctx     user context
+ * @param  task    the task of the result
+ * @param  result  count elements of result_type
+ * @param  count   number of elements
+ * @param  worker  rank of the worker
+ */
+typedef void (*farm_result_handler)(void *ctx, const void *task, const void *result, int count, int worker);
+
+/**
+ * Called by the workers for every task
+ * @param  ctx     user context
+ * @param  task    the task to compute
+ * @param  result  set to the result buffer (owned by the handler)
+ * @return         number of elements of result_type in the result,
+ *                 -1 when the task was cancelled (see task_farm_cancelled)
+ */
+typedef int (*farm_task_handler)(void *ctx, const void *task, void **result);
+
+/*----- Range scheduler -----*/
+
+typedef struct farm_range_s
+{
+    unsigned long first;
+    unsigned long count;
+} farm_range;
+
+/**
+ * Split [0, total) in chunks. With guided != 0 the chunk is the
+ * remaining work divided by twice the number of workers (never smaller
+ * than chunk), so the last chunks are small and the tail is balanced.
+ */
+typedef struct range_scheduler_s
+{
+    unsigned long total;
+    unsigned long next;
+    unsigned long chunk;
+    int guided;
+    int num_workers;
+} range_scheduler;
+
+int range_next_task(void *state, void *task, int worker)
+{
+    range_scheduler *sched = (range_scheduler*) state;
+    farm_range *range = (farm_range*) task;
+    unsigned long remaining = sched->total - sched->next,
+                  count = sched->chunk;
+
+    (void) worker;
+
+    if (remaining == 0) return 0;
+
+    if (sched->guided)
+    {
+        unsigned long guided_count = remaining / (2 * sched->num_workers);
+        if (guided_count > count) count = guided_count;
+    }
+    if (count > remaining) count = remaining;
+    if (count == 0) count = 1;
+
+    range->first = sched->next;
+    range->count = count;
+    sched->next += count;
+
+    return 1;
+}
+
+task_scheduler range_scheduler_init(range_scheduler *sched, unsigned long total,
+                                    unsigned long chunk, int guided, int num_workers)
+{
+    task_scheduler scheduler;
+
+    sched->total = total;
+    sched->next = 0;
+    sched->chunk = chunk;
+    sched->guided = guided;
+    sched->num_workers = num_workers;
+
+    scheduler.next_task = range_next_task;
+    scheduler.state = sched;
+    return scheduler;
+}
+
+/**
+ * MPI type of farm_range (free it with MPI_Type_free)
+ */
+MPI_Datatype farm_range_type(void)
+{
+    int blocklengths[2] = {1, 1};
+    MPI_Datatype types[2] = {MPI_UNSIGNED_LONG, MPI_UNSIGNED_LONG};
+    MPI_Aint offsets[2];
+    MPI_Datatype mpi_farm_range;
+
+    offsets[0] = offsetof(farm_range, first);
+    offsets[1] = offsetof(farm_range, count);
+
+    MPI_Type_create_struct(2, blocklengths, offsets, types, &mpi_farm_range);
+    MPI_Type_commit(&mpi_farm_range);
+    return mpi_farm_range;
+}
+
+/*----- Farm -----*/
+
+task_farm task_farm_init(MPI_Comm comm, int num_workers,
+                         MPI_Datatype task_type, size_t task_size,
+                         MPI_Datatype result_type, size_t result_size)
+{
+    task_farm farm;
+
+    farm.comm = comm;
+    farm.num_workers = num_workers;
+    farm.task_type = task_type;
+    farm.task_size = task_size;
+    farm.result_type = result_type;
+    farm.result_size = result_size;
+    return farm;
+}
+
+/**
+ * Hand out the tasks of the scheduler until it is empty and every
+ * result has been received, the workers are left running.
+ */
+void task_farm_dispatch(const task_farm *farm, task_scheduler *scheduler,
+                        farm_result_handler on_result, void *ctx)
+{
+    /* task in progress on every worker (indexed by rank) */
+    char *tasks = (char*) malloc(farm->task_size * (farm->num_workers + 1));
+    char *buffer = NULL;
+    int buffer_size = 0,
+        num_busy = 0,
+        has_tasks = 1,
+        worker = 0;
+    MPI_Status status;
+
+    /*----- First round, a task for every worker -----*/
+    for (worker = 1; worker <= farm->num_workers; ++worker)
+    {
+        if (has_tasks && scheduler->next_task(scheduler->state, tasks + worker * farm->task_size, worker))
+        {
+            MPI_Send(tasks + worker * farm->task_size, 1, farm->task_type, worker, FARM_TAG_TASK, farm->comm);
+            ++num_busy;
+        }
+        else has_tasks = 0;
+    }
+
+    /*----- Results and new tasks -----*/
+    while (num_busy != 0)
+    {
+        int count = -1;
+
+        MPI_Probe(MPI_ANY_SOURCE, FARM_TAG_RESULT, farm->comm, &status);
+        MPI_Get_count(&status, farm->result_type, &count);
+
+        if (count > buffer_size)
+        {
+            buffer = (char*) realloc(buffer, farm->result_size * count);
+            buffer_size = count;
+        }
+        MPI_Recv(buffer, count, farm->result_type, status.MPI_SOURCE, FARM_TAG_RESULT, farm->comm, MPI_STATUS_IGNORE);
+
+        worker = status.MPI_SOURCE;
+        on_result(ctx, tasks + worker * farm->task_size, buffer, count, worker);
+
+        --num_busy;
+
+        if (has_tasks && scheduler->next_task(scheduler->state, tasks + worker * farm->task_size, worker))
+        {
+            MPI_Send(tasks + worker * farm->task_size, 1, farm->task_type, worker, FARM_TAG_TASK, farm->comm);
+            ++num_busy;
+        }
+        else has_tasks = 0;
+    }
+
+    /*----- CLEAN -----*/
+    free(buffer);
+    free(tasks);
+}
+
+/**
+ * Stop the workers
+ */
+void task_farm_stop(const task_farm *farm)
+{
+    int worker = 0;
+
+    for (worker = 1; worker <= farm->num_workers; ++worker)
+    {
+        MPI_Send(NULL, 0, MPI_BYTE, worker, FARM_TAG_EXIT, farm->comm);
+    }
+}
+
+/**
+ * Run the master loop until the scheduler is empty and every result
+ * has been received, then stop the workers.
+ */
+void task_farm_master(const task_farm *farm, task_scheduler *scheduler,
+                      farm_result_handler on_result, void *ctx)
+{
+    task_farm_dispatch(farm, scheduler, on_result, ctx);
+    task_farm_stop(farm);
+}
+
+/**
+ * Run the worker loop until the master sends FARM_TAG_EXIT
+ */
+void task_farm_worker(const task_farm *farm, farm_task_handler compute, void *ctx)
+{
+    char *task = (char*) malloc(farm->task_size);
+    MPI_Status status;
+    int run = 1;
+
+    while (run)
+    {
+        MPI_Probe(FARM_MASTER, MPI_ANY_TAG, farm->comm, &status);
+
+        if (status.MPI_TAG == FARM_TAG_TASK)
+        {
+            void *result = NULL;
+            int count = 0;
+
+            MPI_Recv(task, 1, farm->task_type, FARM_MASTER, FARM_TAG_TASK, farm->comm, MPI_STATUS_IGNORE);
+
+            count = compute(ctx, task, &result);
+
+            if (count < 0)
+                MPI_Send(NULL, 0, MPI_BYTE, FARM_MASTER, FARM_TAG_CANCELLED, farm->comm);
+            else
+                MPI_Send(result, count, farm->result_type, FARM_MASTER, FARM_TAG_RESULT, farm->comm);
+        }
+        else if (status.MPI_TAG == FARM_TAG_CANCEL)
+        {
+            // the task is already done (or was given up by the handler)
+            MPI_Recv(NULL, 0, MPI_BYTE, FARM_MASTER, FARM_TAG_CANCEL, farm->comm, MPI_STATUS_IGNORE);
+        }
+        else
+        {
+            MPI_Recv(NULL, 0, MPI_BYTE, FARM_MASTER, status.MPI_TAG, farm->comm, MPI_STATUS_IGNORE);
+            run = 0;
+        }
+    }
+
+    /*----- CLEAN -----*/
+    free(task);
+}
+
+/*----- Speculative farm -----*/
+
+/**
+ * Split a task in two halves, each one a valid task whose results
+ * together are the results of the task
+ * @param  ctx     user context
+ * @param  task    the task to split
+ * @param  first   first half to fill
+ * @param  second  second half to fill
+ * @return         0 when the task is too small to be split
+ */
+typedef int (*farm_task_splitter)(void *ctx, const void *task, void *first, void *second);
+
+typedef struct farm_speculation_s
+{
+    farm_task_splitter split;   /* NULL sends whole copies */
+    void *split_ctx;
+
+    /* statistics of the last dispatch */
+    int copies;                 /* tasks sent again whole */
+    int splits;                 /* tasks sent again as two halves */
+    int backup_wins;            /* tasks finished first by the copy or the halves */
+    int cancelled;              /* workers stopped by a cancel */
+    int wasted;                 /* results of tasks that were already done */
+    double tail_time;           /* from the empty scheduler to the last task done */
+    double saved_time;          /* estimated tail time saved */
+} farm_speculation;
+
+enum farm_backup
+{
+    FARM_BACKUP_NONE = 0,
+    FARM_BACKUP_COPY = 1,
+    FARM_BACKUP_SPLIT = 2
+};
+
+typedef struct farm_job_s
+{
+    int backup;                 /* one of farm_backup */
+    int done;
+    int backup_won;
+    int parts_done;             /* halves received */
+    int part_worker[2];         /* worker of the copy or of the halves, 0 while pending */
+    double start;               /* of the original task */
+    double part_time[2];        /* start of the parts, then their duration */
+    double end;
+} farm_job;
+
+/**
+ * Called by the task handlers of the speculative farm between two
+ * pieces of work, a handler whose task is cancelled returns -1
+ * @return  1 when the master does not need the task any more
+ */
+int task_farm_cancelled(const task_farm *farm)
+{
+    int flag = 0;
+
+    MPI_Iprobe(FARM_MASTER, FARM_TAG_CANCEL, farm->comm, &flag, MPI_STATUS_IGNORE);
+    return flag;
+}
+
+/**
+ * Backup work for an idle worker: a pending half, otherwise the copy or
+ * the halves of the oldest unfinished task without backup
+ * @param  tasks  original, first and second part of every job
+ * @return        part given to the worker (0 or 1), -1 when there is none
+ */
+int farm_next_backup(const task_farm *farm, farm_job *jobs, char *tasks, int num_jobs,
+                     farm_speculation *spec, int worker, int *job_index)
+{
+    const size_t task_size = farm->task_size;
+    int j = 0,
+        part = 0,
+        oldest = -1;
+
+    for (j = 0; j != num_jobs; ++j)
+    {
+        if (jobs[j].done) continue;
+
+        if (jobs[j].backup == FARM_BACKUP_SPLIT)
+        {
+            for (part = 0; part != 2; ++part)
+                if (jobs[j].part_worker[part] == 0) break;
+            if (part != 2) break;
+        }
+        else if (jobs[j].backup == FARM_BACKUP_NONE && (oldest == -1 || jobs[j].start < jobs[oldest].start))
+        {
+            oldest = j;
+        }
+    }
+
+    if (j == num_jobs)
+    {
+        char *task = NULL;
+
+        if (oldest == -1) return -1;
+
+        j = oldest;
+        part = 0;
+        task = tasks + task_size * 3 * j;
+
+        if (spec->split != NULL && spec->split(spec->split_ctx, task, task + task_size, task + 2 * task_size))
+        {
+            jobs[j].backup = FARM_BACKUP_SPLIT;
+            ++spec->splits;
+        }
+        else
+        {
+            memcpy(task + task_size, task, task_size);
+            jobs[j].backup = FARM_BACKUP_COPY;
+            jobs[j].part_worker[1] = -1;
+            ++spec->copies;
+        }
+    }
+
+    jobs[j].part_worker[part] = worker;
+    jobs[j].part_time[part] = MPI_Wtime();
+    *job_index = j;
+    return part;
+}
+
+/**
+ * task_farm_dispatch with speculative re-execution of the tail. The
+ * handler may see a task and its halves, so compute has to be
+ * deterministic. The saved time is estimated assuming equally fast
+ * workers: a task won by its backup would have taken as long as the
+ * copy, or as both halves one after the other.
+ */
+void task_farm_dispatch_speculative(const task_farm *farm, task_scheduler *scheduler,
+                                    farm_result_handler on_result, void *ctx, farm_speculation *spec)
+{
+    const size_t task_size = farm->task_size;
+    farm_job *jobs = NULL;
+    char *tasks = NULL,
+         *buffer = NULL;
+    /* job and part (-1 for the original) of every worker, indexed by rank */
+    int *job_of = (int*) malloc(sizeof(int) * (farm->num_workers + 1)),
+        *part_of = (int*) malloc(sizeof(int) * (farm->num_workers + 1)),
+        *cancelled = (int*) calloc(farm->num_workers + 1, sizeof(int));
+    int num_jobs = 0,
+        jobs_capacity = 0,
+        buffer_size = 0,
+        num_busy = 0,
+        has_tasks = 1,
+        worker = 0,
+        j = 0;
+    double empty_time = 0.0,
+           last_end = 0.0,
+           estimated_end = 0.0;
+    MPI_Status status;
+
+    spec->copies = spec->splits = spec->backup_wins = spec->cancelled = spec->wasted = 0;
+
+    for (worker = 1; worker <= farm->num_workers; ++worker) job_of[worker] = -1;
+
+    while (1)
+    {
+        int count = -1,
+            part = -1;
+        farm_job *job = NULL;
+
+        /*----- New tasks for the idle workers, backups once the scheduler is empty -----*/
+        for (worker = 1; worker <= farm->num_workers; ++worker)
+        {
+            if (job_of[worker] != -1) continue;
+
+            if (has_tasks)
+            {
+                if (num_jobs == jobs_capacity)
+                {
+                    jobs_capacity = 2 * jobs_capacity + farm->num_workers;
+                    jobs = (farm_job*) realloc(jobs, sizeof(farm_job) * jobs_capacity);
+                    tasks = (char*) realloc(tasks, task_size * 3 * jobs_capacity);
+                }
+
+                if (scheduler->next_task(scheduler->state, tasks + task_size * 3 * num_jobs, worker))
+                {
+                    memset(jobs + num_jobs, 0, sizeof(farm_job));
+                    jobs[num_jobs].start = MPI_Wtime();
+                    job_of[worker] = num_jobs++;
+                    part_of[worker] = -1;
+                }
+                else
+                {
+                    has_tasks = 0;
+                    empty_time = MPI_Wtime();
+                }
+            }
+
+            if (!has_tasks)
+            {
+                part_of[worker] = farm_next_backup(farm, jobs, tasks, num_jobs, spec, worker, &j);
+                if (part_of[worker] != -1) job_of[worker] = j;
+            }
+
+            if (job_of[worker] != -1)
+            {
+                MPI_Send(tasks + task_size * (3 * job_of[worker] + 1 + part_of[worker]), 1, farm->task_type,
+                         worker, FARM_TAG_TASK, farm->comm);
+                cancelled[worker] = 0;
+                ++num_busy;
+            }
+        }
+
+        if (num_busy == 0) break;
+
+        /*----- Next result or cancellation -----*/
+        MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, farm->comm, &status);
+        worker = status.MPI_SOURCE;
+        j = job_of[worker];
+        part = part_of[worker];
+        job = jobs + j;
+
+        job_of[worker] = -1;
+        --num_busy;
+
+        if (status.MPI_TAG == FARM_TAG_CANCELLED)
+        {
+            MPI_Recv(NULL, 0, MPI_BYTE, worker, FARM_TAG_CANCELLED, farm->comm, MPI_STATUS_IGNORE);
+            ++spec->cancelled;
+            continue;
+        }
+
+        MPI_Get_count(&status, farm->result_type, &count);
+
+        if (count > buffer_size)
+        {
+            buffer = (char*) realloc(buffer, farm->result_size * count);
+            buffer_size = count;
+        }
+        MPI_Recv(buffer, count, farm->result_type, worker, FARM_TAG_RESULT, farm->comm, MPI_STATUS_IGNORE);
+
+        if (job->done)
+        {
+            ++spec->wasted;
+            continue;
+        }
+
+        on_result(ctx, tasks + task_size * (3 * j + 1 + part), buffer, count, worker);
+
+        if (part != -1)
+        {
+            job->part_time[part] = MPI_Wtime() - job->part_time[part];
+            if (job->backup == FARM_BACKUP_SPLIT && ++job->parts_done != 2) continue;
+
+            job->backup_won = 1;
+            ++spec->backup_wins;
+        }
+
+        job->done = 1;
+        job->end = MPI_Wtime();
+
+        // the other workers of the task give it up
+        for (worker = 1; worker <= farm->num_workers; ++worker)
+        {
+            if (job_of[worker] == j && !cancelled[worker])
+            {
+                MPI_Send(NULL, 0, MPI_BYTE, worker, FARM_TAG_CANCEL, farm->comm);
+                cancelled[worker] = 1;
+            }
+        }
+    }
+
+    /*----- Tail statistics -----*/
+    for (j = 0; j != num_jobs; ++j)
+    {
+        double end = jobs[j].end;
+
+        if (jobs[j].backup_won)
+        {
+            end = jobs[j].start + jobs[j].part_time[0];
+            if (jobs[j].backup == FARM_BACKUP_SPLIT) end += jobs[j].part_time[1];
+        }
+
+        if (jobs[j].end > last_end) last_end = jobs[j].end;
+        if (end > estimated_end) estimated_end = end;
+    }
+
+    spec->tail_time = (last_end > empty_time) ? last_end - empty_time : 0.0;
+    spec->saved_time = (estimated_end > last_end) ? estimated_end - last_end : 0.0;
+
+    /*----- CLEAN -----*/
+    free(cancelled);
+    free(part_of);
+    free(job_of);
+    free(buffer);
+    free(tasks);
+    free(jobs);
+}
+
+/**
+ * Run the speculative master loop, then stop the workers
+ */
+void task_farm_master_speculative(const task_farm *farm, task_scheduler *scheduler,
+                                  farm_result_handler on_result, void *ctx, farm_speculation *spec)
+{
+    task_farm_dispatch_speculative(farm, scheduler, on_result, ctx, spec);
+    task_farm_stop(farm);
+}
+
+/*----- Hierarchical farm -----*/
+
+typedef struct farm_hierarchy_s
+{
+    MPI_Comm node_comm;         /* ranks of the node except the master, MPI_COMM_NULL on the master */
+    int num_nodes;              /* number of sub-masters */
+    int max_node_size;          /* ranks of the biggest node */
+    int batch_size;             /* tasks sent to a sub-master at once */
+} farm_hierarchy;
+
+/**
+ * Group the ranks of comm (except the master) by node, collective on comm
+ * @param  comm            communicator of the farm
+ * @param  ranks_per_node  0 to use the shared memory nodes, otherwise
+ *                         consecutive ranks are grouped in nodes of this size
+ * @param  batch_size      tasks sent to a sub-master at once
+ */
+farm_hierarchy farm_hierarchy_init(MPI_Comm comm, int ranks_per_node, int batch_size)
+{
+    farm_hierarchy hierarchy;
+    int rank = -1,
+        node = -1,
+        node_rank = -1,
+        node_size = 0,
+        is_submaster = 0;
+
+    MPI_Comm_rank(comm, &rank);
+
+    if (ranks_per_node > 0)
+    {
+        node = rank / ranks_per_node;
+    }
+    else
+    {
+        // the lowest rank of the shared memory node names the node
+        MPI_Comm shared_comm;
+
+        MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &shared_comm);
+        MPI_Allreduce(&rank, &node, 1, MPI_INT, MPI_MIN, shared_comm);
+        MPI_Comm_free(&shared_comm);
+    }
+
+    MPI_Comm_split(comm, (rank == FARM_MASTER) ? MPI_UNDEFINED : node, rank, &hierarchy.node_comm);
+
+    if (hierarchy.node_comm != MPI_COMM_NULL)
+    {
+        MPI_Comm_rank(hierarchy.node_comm, &node_rank);
+        MPI_Comm_size(hierarchy.node_comm, &node_size);
+        is_submaster = (node_rank == 0);
+    }
+
+    MPI_Allreduce(&is_submaster, &hierarchy.num_nodes, 1, MPI_INT, MPI_SUM, comm);
+    MPI_Allreduce(&node_size, &hierarchy.max_node_size, 1, MPI_INT, MPI_MAX, comm);
+
+    hierarchy.batch_size = (batch_size > 0) ? batch_size : 1;
+    return hierarchy;
+}
+
+void farm_hierarchy_free(farm_hierarchy *hierarchy)
+{
+    if (hierarchy->node_comm != MPI_COMM_NULL) MPI_Comm_free(&hierarchy->node_comm);
+}
+
+/**
+ * Master of the hierarchical farm: every message from a sub-master is
+ * the result of its last batch (empty the first time) and is answered
+ * with a new batch or with FARM_TAG_EXIT.
+ */
+void task_farm_hierarchical_master(const task_farm *farm, const farm_hierarchy *hierarchy,
+                                   task_scheduler *scheduler, farm_result_handler on_result, void *ctx)
+{
+    const int batch_size = hierarchy->batch_size;
+    int comm_size = 0,
+        buffer_size = 0,
+        num_active = hierarchy->num_nodes,
+        has_tasks = 1;
+    char *batches = NULL,
+         *buffer = NULL;
+    int *batch_len = NULL,
+        *counts = (int*) malloc(sizeof(int) * batch_size);
+    MPI_Status status;
+
+    MPI_Comm_size(farm->comm, &comm_size);
+
+    /* batch in progress on every sub-master (indexed by rank) */
+    batches = (char*) malloc(farm->task_size * batch_size * comm_size);
+    batch_len = (int*) calloc(comm_size, sizeof(int));
+
+    while (num_active != 0)
+    {
+        int num_counts = 0,
+            total = 0,
+            submaster = 0,
+            i = 0;
+        char *batch = NULL;
+
+        /*----- Results of the last batch -----*/
+        MPI_Probe(MPI_ANY_SOURCE, FARM_TAG_COUNTS, farm->comm, &status);
+        MPI_Get_count(&status, MPI_INT, &num_counts);
+        submaster = status.MPI_SOURCE;
+        batch = batches + farm->task_size * batch_size * submaster;
+
+        MPI_Recv(counts, num_counts, MPI_INT, submaster, FARM_TAG_COUNTS, farm->comm, MPI_STATUS_IGNORE);
+
+        if (num_counts != 0)
+        {
+            for (i = 0; i != num_counts; ++i) total += counts[i];
+
+            if (total > buffer_size)
+            {
+                buffer = (char*) realloc(buffer, farm->result_size * total);
+                buffer_size = total;
+            }
+            MPI_Recv(buffer, total, farm->result_type, submaster, FARM_TAG_RESULT, farm->comm, MPI_STATUS_IGNORE);
+
+            for (i = 0, total = 0; i != num_counts; ++i)
+            {
+                on_result(ctx, batch + farm->task_size * i, buffer + farm->result_size * total, counts[i], submaster);
+                total += counts[i];
+            }
+        }
+
+        /*----- Next batch -----*/
+        batch_len[submaster] = 0;
+        while (has_tasks && batch_len[submaster] != batch_size)
+        {
+            if (scheduler->next_task(scheduler->state, batch + farm->task_size * batch_len[submaster], submaster))
+                ++batch_len[submaster];
+            else
+                has_tasks = 0;
+        }
+
+        if (batch_len[submaster] != 0)
+        {
+            MPI_Send(batch, batch_len[submaster], farm->task_type, submaster, FARM_TAG_TASK, farm->comm);
+        }
+        else
+        {
+            MPI_Send(NULL, 0, MPI_BYTE, submaster, FARM_TAG_EXIT, farm->comm);
+            --num_active;
+        }
+    }
+
+    /*----- CLEAN -----*/
+    free(counts);
+    free(buffer);
+    free(batch_len);
+    free(batches);
+}
+
+/**
+ * Batch of a sub-master, it is both the scheduler of the node farm and
+ * the context of its result handler, so results are stored in the
+ * order of the batch.
+ */
+typedef struct node_batch_s
+{
+    const task_farm *farm;
+    const char *tasks;
+    int num_tasks;
+    int next;
+    int *assigned;              /* task index on every node rank */
+    int *counts;                /* result elements of every task */
+    size_t *offsets;            /* first result element of every task in data */
+    char *data;
+    size_t data_size;
+    size_t data_capacity;
+} node_batch;
+
+int node_batch_next_task(void *state, void *task, int worker)
+{
+    node_batch *batch = (node_batch*) state;
+
+    if (batch->next == batch->num_tasks) return 0;
+
+    memcpy(task, batch->tasks + batch->farm->task_size * batch->next, batch->farm->task_size);
+    batch->assigned[worker] = batch->next++;
+    return 1;
+}
+
+void node_batch_store(node_batch *batch, int index, const void *result, int count)
+{
+    const size_t result_size = batch->farm->result_size;
+
+    if (batch->data_size + count > batch->data_capacity)
+    {
+        batch->data_capacity = 2 * (batch->data_size + count);
+        batch->data = (char*) realloc(batch->data, result_size * batch->data_capacity);
+    }
+
+    memcpy(batch->data + result_size * batch->data_size, result, result_size * count);
+    batch->offsets[index] = batch->data_size;
+    batch->counts[index] = count;
+    batch->data_size += count;
+}
+
+void node_batch_result(void *ctx, const void *task, const void *result, int count, int worker)
+{
+    node_batch *batch = (node_batch*) ctx;
+
+    (void) task;
+    node_batch_store(batch, batch->assigned[worker], result, count);
+}
+
+/**
+ * Run by every rank except the master: the first rank of the node is
+ * the sub-master, the others are workers of the node farm. A sub-master
+ * alone on its node computes the tasks itself.
+ */
+void task_farm_hierarchical_node(const task_farm *farm, const farm_hierarchy *hierarchy,
+                                 farm_task_handler compute, void *ctx)
+{
+    const int batch_size = hierarchy->batch_size;
+    int node_rank = -1,
+        node_size = 0;
+
+    MPI_Comm_rank(hierarchy->node_comm, &node_rank);
+    MPI_Comm_size(hierarchy->node_comm, &node_size);
+
+    task_farm node_farm = task_farm_init(hierarchy->node_comm, node_size - 1,
+                                         farm->task_type, farm->task_size,
+                                         farm->result_type, farm->result_size);
+
+    if (node_rank != 0)
+    {
+        task_farm_worker(&node_farm, compute, ctx);
+        return;
+    }
+
+    node_batch batch;
+    task_scheduler scheduler = {node_batch_next_task, &batch};
+    char *tasks = (char*) malloc(farm->task_size * batch_size),
+         *band = NULL;
+    size_t band_capacity = 0;
+    MPI_Status status;
+    int run = 1;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.farm = farm;
+    batch.tasks = tasks;
+    batch.assigned = (int*) malloc(sizeof(int) * node_size);
+    batch.counts = (int*) malloc(sizeof(int) * batch_size);
+    batch.offsets = (size_t*) malloc(sizeof(size_t) * batch_size);
+
+    // ask for the first batch
+    MPI_Send(NULL, 0, MPI_INT, FARM_MASTER, FARM_TAG_COUNTS, farm->comm);
+
+    while (run)
+    {
+        MPI_Probe(FARM_MASTER, MPI_ANY_TAG, farm->comm, &status);
+
+        if (status.MPI_TAG == FARM_TAG_TASK)
+        {
+            int i = 0;
+
+            MPI_Get_count(&status, farm->task_type, &batch.num_tasks);
+            MPI_Recv(tasks, batch.num_tasks, farm->task_type, FARM_MASTER, FARM_TAG_TASK, farm->comm, MPI_STATUS_IGNORE);
+
+            batch.next = 0;
+            batch.data_size = 0;
+
+            if (node_farm.num_workers != 0)
+            {
+                task_farm_dispatch(&node_farm, &scheduler, node_batch_result, &batch);
+            }
+            else
+            {
+                for (i = 0; i != batch.num_tasks; ++i)
+                {
+                    void *result = NULL;
+                    int count = compute(ctx, tasks + farm->task_size * i, &result);
+                    node_batch_store(&batch, i, result, count);
+                }
+            }
+
+            /*----- Band of the batch, results in task order -----*/
+            if (batch.data_size > band_capacity)
+            {
+                band_capacity = batch.data_size;
+                band = (char*) realloc(band, farm->result_size * band_capacity);
+            }
+
+            size_t offset = 0;
+            for (i = 0; i != batch.num_tasks; ++i)
+            {
+                memcpy(band + farm->result_size * offset,
+                       batch.data + farm->result_size * batch.offsets[i],
+                       farm->result_size * batch.counts[i]);
+                offset += batch.counts[i];
+            }
+
+            MPI_Send(batch.counts, batch.num_tasks, MPI_INT, FARM_MASTER, FARM_TAG_COUNTS, farm->comm);
+            MPI_Send(band, (int) offset, farm->result_type, FARM_MASTER, FARM_TAG_RESULT, farm->comm);
+        }
+        else
+        {
+            MPI_Recv(NULL, 0, MPI_BYTE, FARM_MASTER, status.MPI_TAG, farm->comm, MPI_STATUS_IGNORE);
+            run = 0;
+        }
+    }
+
+    task_farm_stop(&node_farm);
+
+    /*----- CLEAN -----*/
+    free(band);
+    free(batch.data);
+    free(batch.offsets);
+    free(batch.counts);
+    free(batch.assigned);
+    free(tasks);
+}
+
+#endif
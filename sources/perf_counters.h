@@ -0,0 +1,339 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdio.h>
+
+/**
+ * Hardware counters of the hot loops, read with Linux perf_event_open.
+ *
+ * Define PERF_COUNTERS before including the kernels (e.g. -DPERF_COUNTERS
+ * in build.flags) to count around every invocation of the escape-time
+ * kernel (fractal_kernels.h) and of the deflection integrand (tetaQuad.h):
+ *
+ *   PERF_BEGIN(name);              snapshot of the counters of the thread
+ *   ... kernel ... PERF_UNITS(n);  n iterations / integrand evaluations done
+ *   PERF_END(name, kernel);        add the difference to the totals
+ *
+ * Otherwise the macros expand to nothing and the kernels are unchanged.
+ * PERF_REPORT(comm) sums the totals of the ranks of comm and prints them
+ * per unit on rank 0 (after including mpi.h), PERF_PRINT(out) prints the
+ * totals of the process. Both then close the groups of every thread
+ * (perf_close), a thread counting again opens a new group.
+ *
+ * Every thread opens its own group, led by the task clock (a software
+ * event, always there) so that ns per unit are known even where the
+ * hardware counters are not (virtual machines, perf_event_paranoid > 2),
+ * those are then reported as n/a. Linux has no generic FP event: set
+ * PERF_FP_EVENTS to the raw events of the CPU with the operations per
+ * instruction, e.g. on Intel (FP_ARITH_INST_RETIRED, double precision
+ * scalar, 128 and 256 bit packed)
+ *
+ *   PERF_FP_EVENTS=0x01c7:1,0x04c7:2,0x10c7:4
+ */
+
+enum perf_kernel
+{
+    PERF_KERNEL_ESCAPE = 0,         /* units are iterations */
+    PERF_KERNEL_INTEGRAND = 1,      /* units are integrand evaluations */
+    PERF_NUM_KERNELS = 2
+};
+
+enum perf_field
+{
+    PERF_TASK_CLOCK = 0,            /* ns */
+    PERF_CYCLES = 1,
+    PERF_INSTRUCTIONS = 2,
+    PERF_BRANCH_MISSES = 3,
+    PERF_FP_OPS = 4,
+    PERF_NUM_COUNTERS = 5,
+    PERF_UNIT_COUNT = 5,            /* iterations or evaluations */
+    PERF_CALLS = 6,                 /* kernel invocations */
+    PERF_NUM_FIELDS = 7
+};
+
+#ifdef PERF_COUNTERS
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PERF_MAX_FP_EVENTS 4
+#define PERF_NUM_EVENTS (PERF_FP_OPS + PERF_MAX_FP_EVENTS)
+
+/* totals of the process, per kernel */
+unsigned long long perf_totals[PERF_NUM_KERNELS][PERF_NUM_FIELDS];
+
+/* 1 when the counter was opened by at least one thread */
+int perf_available[PERF_NUM_COUNTERS];
+
+/* raw FP events and their operations per instruction */
+unsigned long long perf_fp_config[PERF_MAX_FP_EVENTS];
+unsigned long long perf_fp_weight[PERF_MAX_FP_EVENTS];
+int perf_num_fp_events = -1;
+
+/* descriptors of the groups of every thread, closed by perf_close */
+int *perf_fds = NULL;
+int perf_num_fds = 0;
+int perf_generation = 1;
+
+typedef struct perf_thread_s
+{
+    int state;                      /* 0 not opened yet, 1 open, -1 unavailable */
+    int generation;                 /* perf_generation at the opening */
+    int leader;
+    int position[PERF_NUM_EVENTS];  /* place in the group read, -1 if not opened */
+    int num_events;
+    unsigned long long units;
+} perf_thread;
+
+typedef struct perf_sample_s
+{
+    unsigned long long value[PERF_NUM_EVENTS];
+    unsigned long long units;
+} perf_sample;
+
+static __thread perf_thread perf_local;
+
+/**
+ * Parse PERF_FP_EVENTS, once per process
+ */
+void perf_parse_fp_events(void)
+{
+    const char *spec = getenv("PERF_FP_EVENTS");
+    int n = 0;
+
+    while (spec != NULL && *spec != '\0' && n != PERF_MAX_FP_EVENTS)
+    {
+        char *end;
+        perf_fp_config[n] = strtoull(spec, &end, 0);
+        perf_fp_weight[n] = 1;
+        if (end == spec) break;
+        if (*end == ':') perf_fp_weight[n] = strtoull(end + 1, &end, 0);
+        ++n;
+        spec = (*end == ',') ? end + 1 : end;
+    }
+
+    perf_num_fp_events = n;
+}
+
+int perf_open_event(unsigned int type, unsigned long long config, int group)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = (group == -1);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/**
+ * Open the group of the calling thread, the events the kernel refuses
+ * are left out
+ */
+void perf_thread_open(perf_thread *t)
+{
+    static const unsigned long long hardware[3] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    int fds[PERF_NUM_EVENTS];
+    int e, fd;
+
+    #pragma omp critical(perf_counters)
+    {
+        if (perf_num_fp_events < 0) perf_parse_fp_events();
+        t->generation = perf_generation;
+    }
+
+    t->leader = perf_open_event(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1);
+    if (t->leader < 0)
+    {
+        t->state = -1;
+        return;
+    }
+
+    for (e = 0; e != PERF_NUM_EVENTS; ++e) t->position[e] = -1;
+    t->position[PERF_TASK_CLOCK] = 0;
+    t->num_events = 1;
+    fds[0] = t->leader;
+
+    for (e = 0; e != PERF_NUM_EVENTS - 1; ++e)
+    {
+        if (e < 3) fd = perf_open_event(PERF_TYPE_HARDWARE, hardware[e], t->leader);
+        else if (e - 3 < perf_num_fp_events) fd = perf_open_event(PERF_TYPE_RAW, perf_fp_config[e - 3], t->leader);
+        else break;
+
+        if (fd >= 0)
+        {
+            fds[t->num_events] = fd;
+            t->position[e + 1] = t->num_events++;
+        }
+    }
+
+    #pragma omp critical(perf_counters)
+    {
+        for (e = 0; e != PERF_NUM_EVENTS; ++e)
+            if (t->position[e] >= 0) perf_available[e < PERF_FP_OPS ? e : PERF_FP_OPS] = 1;
+
+        perf_fds = (int*) realloc(perf_fds, sizeof(int) * (perf_num_fds + t->num_events));
+        for (e = 0; e != t->num_events; ++e) perf_fds[perf_num_fds++] = fds[e];
+    }
+
+    ioctl(t->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(t->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    t->state = 1;
+}
+
+/**
+ * Read the counters of the calling thread, opened on the first call.
+ * The group counts all the time, a sample is one read system call.
+ */
+void perf_read(perf_sample *s)
+{
+    perf_thread *t = &perf_local;
+    unsigned long long buffer[1 + PERF_NUM_EVENTS];
+    int e;
+
+    if (t->state == 0 || t->generation != perf_generation) perf_thread_open(t);
+
+    memset(s, 0, sizeof(perf_sample));
+    s->units = t->units;
+
+    if (t->state < 0 || read(t->leader, buffer, sizeof(buffer)) <= 0) return;
+
+    for (e = 0; e != PERF_NUM_EVENTS; ++e)
+        if (t->position[e] >= 0) s->value[e] = buffer[1 + t->position[e]];
+}
+
+/**
+ * Add the counts since begin to the totals of kernel
+ */
+void perf_end(const perf_sample *begin, int kernel)
+{
+    perf_sample end;
+    unsigned long long delta[PERF_NUM_FIELDS];
+    int e;
+
+    perf_read(&end);
+
+    for (e = 0; e != PERF_FP_OPS; ++e) delta[e] = end.value[e] - begin->value[e];
+    delta[PERF_FP_OPS] = 0;
+    for (e = 0; e < perf_num_fp_events; ++e)
+        delta[PERF_FP_OPS] += perf_fp_weight[e] * (end.value[PERF_FP_OPS + e] - begin->value[PERF_FP_OPS + e]);
+    delta[PERF_UNIT_COUNT] = end.units - begin->units;
+    delta[PERF_CALLS] = 1;
+
+    for (e = 0; e != PERF_NUM_FIELDS; ++e)
+    {
+        #pragma omp atomic
+        perf_totals[kernel][e] += delta[e];
+    }
+}
+
+void perf_print_ratio(FILE *out, const char *name, unsigned long long count, unsigned long long units,
+                      int available)
+{
+    if (available && units != 0) fprintf(out, ", %s %.3f", name, (double) count / (double) units);
+    else fprintf(out, ", %s n/a", name);
+}
+
+/**
+ * Print totals (as perf_totals) per unit, one line per kernel that ran
+ * @param  out        output stream
+ * @param  totals     counts of the kernels
+ * @param  available  counters that were opened
+ * @param  processes  number of processes summed in totals
+ */
+void perf_print_totals(FILE *out, unsigned long long totals[PERF_NUM_KERNELS][PERF_NUM_FIELDS],
+                       const int *available, int processes)
+{
+    static const char *kernel_names[PERF_NUM_KERNELS] = { "escape-time", "integrand" };
+    static const char *unit_names[PERF_NUM_KERNELS] = { "iteration", "evaluation" };
+    int k;
+
+    for (k = 0; k != PERF_NUM_KERNELS; ++k)
+    {
+        const unsigned long long *t = totals[k];
+        const unsigned long long units = t[PERF_UNIT_COUNT];
+
+        if (t[PERF_CALLS] == 0) continue;
+
+        fprintf(out, ">>> Perf %s: %llu %ss in %llu calls on %d processes, per %s: ",
+                kernel_names[k], units, unit_names[k], t[PERF_CALLS], processes, unit_names[k]);
+        fprintf(out, "ns %.3f", units != 0 ? (double) t[PERF_TASK_CLOCK] / (double) units : 0.0);
+        perf_print_ratio(out, "cycles", t[PERF_CYCLES], units, available[PERF_CYCLES]);
+        perf_print_ratio(out, "instructions", t[PERF_INSTRUCTIONS], units, available[PERF_INSTRUCTIONS]);
+        perf_print_ratio(out, "branch misses", t[PERF_BRANCH_MISSES], units, available[PERF_BRANCH_MISSES]);
+        perf_print_ratio(out, "FP ops", t[PERF_FP_OPS], units, available[PERF_FP_OPS]);
+        perf_print_ratio(out, "IPC", t[PERF_INSTRUCTIONS], t[PERF_CYCLES],
+                         available[PERF_CYCLES] && available[PERF_INSTRUCTIONS]);
+        fprintf(out, "\n");
+    }
+}
+
+/**
+ * Close the groups of every thread, outside of the parallel regions.
+ * The totals are kept, a thread counting again opens a new group.
+ */
+void perf_close(void)
+{
+    int i;
+
+    #pragma omp critical(perf_counters)
+    {
+        for (i = 0; i != perf_num_fds; ++i) close(perf_fds[i]);
+        free(perf_fds);
+        perf_fds = NULL;
+        perf_num_fds = 0;
+        ++perf_generation;
+    }
+}
+
+#ifdef MPI_VERSION
+/**
+ * Sum the totals of the ranks of comm and print them on rank 0,
+ * collective on comm
+ */
+void perf_report(MPI_Comm comm)
+{
+    unsigned long long totals[PERF_NUM_KERNELS][PERF_NUM_FIELDS];
+    int available[PERF_NUM_COUNTERS];
+    int rank, num_ranks;
+
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &num_ranks);
+
+    MPI_Reduce(perf_totals, totals, PERF_NUM_KERNELS * PERF_NUM_FIELDS, MPI_UNSIGNED_LONG_LONG,
+               MPI_SUM, 0, comm);
+    MPI_Reduce(perf_available, available, PERF_NUM_COUNTERS, MPI_INT, MPI_MAX, 0, comm);
+
+    if (rank == 0) perf_print_totals(stdout, totals, available, num_ranks);
+}
+
+#define PERF_REPORT(comm) do { perf_report(comm); perf_close(); } while(0)
+#endif
+
+#define PERF_BEGIN(name) perf_sample name; perf_read(&name)
+#define PERF_UNITS(n) (perf_local.units += (n))
+#define PERF_END(name, kernel) perf_end(&name, kernel)
+#define PERF_PRINT(out) do { perf_print_totals(out, perf_totals, perf_available, 1); perf_close(); } while(0)
+
+#else
+
+#define PERF_BEGIN(name) do { } while(0)
+#define PERF_UNITS(n) do { } while(0)
+#define PERF_END(name, kernel) do { } while(0)
+#define PERF_PRINT(out) do { } while(0)
+#define PERF_REPORT(comm) do { } while(0)
+
+#endif
+
+#endif
@@ -3,61 +3,30 @@
 #include <stdio.h>
 #include <stddef.h>  // required by offsetof
 #include <mpi.h>
+#include "../mpi_task_farm.h"
+#include "../mpi_shared_image.h"
 
 #define PRINT_MATRIX 0
 #define LOG 0
 
+/* rows computed between two checks of a cancellation */
+#define CANCEL_POLL_ROWS 4
+
 typedef unsigned char BYTE;
 typedef unsigned short DATA_TYPE;
 
+#include "../fractal_kernels.h"
+#include "../fractal_png.h"
+#include "../mandelbrot_autotune.h"
+
 typedef struct mandelbrot_params_s 
 {
     unsigned int start_x;
     unsigned int start_y;
     unsigned int size_x;
     unsigned int size_y;
-    unsigned int _exit;
 } mandelbrot_params;
 
-void gen_mandelbrot_set(
-						DATA_TYPE *point_list,
-						const unsigned int start_x,
-						const unsigned int start_y,
-						const unsigned int max_iterations,
-						unsigned int size_x,
-						unsigned int size_y,
-						unsigned int img_size_x,
-						unsigned int img_size_y
-                        )
-{
-    unsigned int Px = 0;
-    unsigned int Py = 0;
-
-    for(Py = start_y; Py != start_y + size_y; ++Py)
-    {
-        for(Px = start_x; Px != start_x + size_x; ++Px)
-        {
-            double x0 = ((double) Px * 3.5 / (double) img_size_x) - 2.5;
-            double y0 = ((double) Py * 2.0 / (double) img_size_y) - 1.0;
-            double x = 0.0;
-            double y = 0.0;
-            double xTemp = 0.0;
-            DATA_TYPE iteration = 0;
-            
-            while( (x*x + y*y) < 2*2 && iteration < max_iterations)
-            {
-                xTemp = x*x - y*y + x0;
-                y = 2*x*y + y0;
-                x = xTemp;
-                
-                iteration++;
-            }
-            
-            point_list[(Px - start_x) + (Py - start_y) * size_x] = iteration;
-        }
-    }
-}
-
 #if PRINT_MATRIX
     void printMatrix(DATA_TYPE *matrix, unsigned int width, unsigned int height)
     {   
@@ -73,36 +42,477 @@ void gen_mandelbrot_set(
     }
 #endif
 
+/*----- Tile scheduler -----*/
+
+typedef struct tile_scheduler_s
+{
+    unsigned int x;
+    unsigned int y;
+    unsigned int num_elm_x;
+    unsigned int num_elm_y;
+    unsigned int width;
+    unsigned int height;
+} tile_scheduler;
+
 /**
- * Return the index of the available worker
- * @param  workers constant list of the worker params
- * @param  worker_num         size of the list
- * @return                    index of the available space (NULL index in the list)
+ * Next tile of the image, row by row
+ * @param  state   tile_scheduler
+ * @param  task    mandelbrot_params to fill
+ * @param  worker  rank of the worker (unused)
+ * @return         0 when the image is complete, 1 otherwise
  */
-int worker_available(short* const workers, const unsigned int worker_num)
-{   
-    int i = 0;
-    for (i = 0; i != worker_num; ++i)
+int tile_next_task(void *state, void *task, int worker)
+{
+    tile_scheduler *sched = (tile_scheduler*) state;
+    mandelbrot_params *params = (mandelbrot_params*) task;
+
+    (void) worker;
+
+    if (sched->y >= sched->height) return 0;
+
+    params->start_x = sched->x;
+    params->start_y = sched->y;
+    params->size_x = sched->num_elm_x;
+    params->size_y = sched->num_elm_y;
+
+    if (params->start_x + params->size_x > sched->width)
+        params->size_x = sched->width % sched->num_elm_x;
+
+    if (params->start_y + params->size_y > sched->height)
+        params->size_y = sched->height % sched->num_elm_y;
+
+    #if LOG
+        fprintf(stdout, ">>> s_x: %d\ts_y: %d\tsize_x: %d\tsize_y: %d\tworker: %d\n",
+            params->start_x, params->start_y, params->size_x, params->size_y, worker);
+    #endif
+
+    sched->x += sched->num_elm_x;
+    if (sched->x >= sched->width)
     {
-        if(workers[i] == -1) return i;
+        sched->x = 0;
+        sched->y += sched->num_elm_y;
     }
-    return -1;
+
+    return 1;
 }
 
 /**
- * return 1 if there aren't workers with a job
- * @param  workers constant list of the worker params
- * @param  worker_num         size of the list
- * @return                    0 (False) if all workers are free, 1 otherwise
+ * Split a tile in its top and bottom halves (left and right for a single row)
+ * @return  0 for a single pixel
  */
-int someone_busy(short* const workers, const unsigned int worker_num)
-{   
-    int i = 0;
-    for (i = 0; i != worker_num; ++i)
+int split_tile(void *ctx, const void *task, void *first, void *second)
+{
+    const mandelbrot_params *tile = (const mandelbrot_params*) task;
+    mandelbrot_params *top = (mandelbrot_params*) first,
+                      *bottom = (mandelbrot_params*) second;
+
+    (void) ctx;
+
+    *top = *tile;
+    *bottom = *tile;
+
+    if (tile->size_y >= 2)
     {
-        if(workers[i] != -1) return 1;
+        top->size_y = tile->size_y / 2;
+        bottom->start_y += top->size_y;
+        bottom->size_y -= top->size_y;
     }
-    return 0;
+    else if (tile->size_x >= 2)
+    {
+        top->size_x = tile->size_x / 2;
+        bottom->start_x += top->size_x;
+        bottom->size_x -= top->size_x;
+    }
+    else return 0;
+
+    return 1;
+}
+
+enum speculation_mode
+{
+    SPECULATION_NONE = 0,       /* the tail waits for the slowest tile */
+    SPECULATION_COPY = 1,       /* idle workers compute copies of the unfinished tiles */
+    SPECULATION_SPLIT = 2       /* idle workers compute their halves */
+};
+
+const char *speculation_names[3] = { "none", "copy", "split" };
+
+int speculation_parse(const char *arg, int *mode)
+{
+    if (strcmp(arg, "none") == 0) *mode = SPECULATION_NONE;
+    else if (strcmp(arg, "copy") == 0) *mode = SPECULATION_COPY;
+    else if (strcmp(arg, "split") == 0) *mode = SPECULATION_SPLIT;
+    else return 0;
+
+    return 1;
+}
+
+/*----- Master and worker handlers -----*/
+
+typedef struct image_ctx_s
+{
+    DATA_TYPE *final_matrix;
+    unsigned int width;
+} image_ctx;
+
+/**
+ * Copy a tile received by the master in the final image
+ */
+void store_tile(void *ctx, const void *task, const void *result, int count, int worker)
+{
+    image_ctx *image = (image_ctx*) ctx;
+    const mandelbrot_params *cur_params = (const mandelbrot_params*) task;
+    const DATA_TYPE *buffer = (const DATA_TYPE*) result;
+    unsigned int row = 0;
+
+    // an empty result is a tile written in place in the shared image
+    for (row = 0; count != 0 && row != cur_params->size_y; ++row) {
+        unsigned int offset = row * cur_params->size_x;
+        unsigned int final_index = cur_params->start_x + (cur_params->start_y + row) * image->width;
+        memcpy(
+            image->final_matrix + final_index,
+            buffer + offset,
+            sizeof(DATA_TYPE) * cur_params->size_x
+        );
+    }
+
+    #if LOG
+        fprintf(stdout, "Received result from process %d, now it will have a new job...\n", worker);
+    #else
+        (void) worker;
+    #endif
+}
+
+typedef struct worker_ctx_s
+{
+    DATA_TYPE *result_buf;
+    unsigned int result_size;
+    unsigned int max_iterations;
+    unsigned int width;
+    unsigned int height;
+    const fractal_params *fractal;
+    DATA_TYPE *shared_matrix;       /* final image when on the node of the master, NULL otherwise */
+    const shared_image *shared;
+    const task_farm *farm;
+    double busy;                    /* compute time of the tiles */
+} worker_ctx;
+
+/**
+ * Compute a tile on a worker, in place when the final image is shared.
+ * The rows are computed in bands so that a cancelled copy stops early.
+ */
+int compute_tile(void *ctx, const void *task, void **result)
+{
+    worker_ctx *worker = (worker_ctx*) ctx;
+    const mandelbrot_params *recv_params = (const mandelbrot_params*) task;
+    unsigned int num_elms = recv_params->size_x * recv_params->size_y,
+                 row_stride = recv_params->size_x,
+                 row = 0;
+    DATA_TYPE *tile = NULL;
+
+    if (worker->shared_matrix != NULL)
+    {
+        tile = worker->shared_matrix + recv_params->start_x + recv_params->start_y * worker->width;
+        row_stride = worker->width;
+    }
+    else
+    {
+        if (num_elms > worker->result_size)
+        {
+            worker->result_buf = (DATA_TYPE*) realloc(worker->result_buf, sizeof(DATA_TYPE) * num_elms);
+            worker->result_size = num_elms;
+        }
+        tile = worker->result_buf;
+    }
+
+    double start = MPI_Wtime();
+
+    for (row = 0; row < recv_params->size_y; row += CANCEL_POLL_ROWS)
+    {
+        const unsigned int rows = (recv_params->size_y - row < CANCEL_POLL_ROWS) ? recv_params->size_y - row : CANCEL_POLL_ROWS;
+
+        if (task_farm_cancelled(worker->farm)) break;
+
+        fractal_tile_strided(worker->fractal, tile + row * row_stride, row_stride,
+                             recv_params->start_x, recv_params->start_y + row, worker->max_iterations,
+                             recv_params->size_x, rows, worker->width, worker->height);
+    }
+
+    worker->busy += MPI_Wtime() - start;
+
+    if (worker->shared_matrix != NULL) shared_image_sync(worker->shared);
+
+    if (row < recv_params->size_y) return -1;
+
+    if (worker->shared_matrix != NULL)
+    {
+        *result = NULL;
+        return 0;
+    }
+
+    #if PRINT_MATRIX
+        printMatrix(worker->result_buf, recv_params->size_x, recv_params->size_y);
+    #endif
+
+    *result = worker->result_buf;
+    return num_elms;
+}
+
+/*----- Cost model features -----*/
+
+/**
+ * Makespan of a configuration, simulated on the tiles of the scheduler
+ * and their halves, and the tiles per worker
+ */
+void dlb_features(const work_map *map, const cost_model *model, run_profile *run)
+{
+    const int workers = run->grid_x * run->grid_y - 1;
+    tile_scheduler tiles = {0, 0, 0, 0, run->width, run->height};
+    mandelbrot_params tile, halves[2];
+    int capacity = 64,
+        n = 0;
+    double *cost = (double*) malloc(sizeof(double) * capacity),
+           (*half)[2] = (double(*)[2]) malloc(sizeof(double[2]) * capacity);
+
+    // the same tile size as render_image
+    tiles.num_elm_x = (short) (run->k * run->width / run->grid_x);
+    tiles.num_elm_y = (short) (run->k * run->height / run->grid_y);
+
+    while (tile_next_task(&tiles, &tile, 0))
+    {
+        if (n == capacity)
+        {
+            capacity *= 2;
+            cost = (double*) realloc(cost, sizeof(double) * capacity);
+            half = (double(*)[2]) realloc(half, sizeof(double[2]) * capacity);
+        }
+
+        cost[n] = work_map_rect(map, run->width, run->height, tile.start_x, tile.start_y, tile.size_x, tile.size_y);
+
+        if (split_tile(NULL, &tile, halves, halves + 1))
+        {
+            half[n][0] = work_map_rect(map, run->width, run->height, halves[0].start_x, halves[0].start_y,
+                                       halves[0].size_x, halves[0].size_y);
+            half[n][1] = work_map_rect(map, run->width, run->height, halves[1].start_x, halves[1].start_y,
+                                       halves[1].size_x, halves[1].size_y);
+        }
+        else
+        {
+            half[n][0] = cost[n];
+            half[n][1] = cost[n];
+        }
+        ++n;
+    }
+
+    run->makespan = farm_simulate(cost, (const double (*)[2]) half, n, workers, run->speculation == SPECULATION_SPLIT);
+    run->tasks = (double) n / workers;
+    run->predicted = cost_model_predict(model, run->makespan, run->tasks);
+
+    /*----- CLEAN -----*/
+    free(half);
+    free(cost);
+}
+
+/**
+ * Grids N x (ranks / N) with at least one worker, every K and
+ * speculation none or split, sorted by predicted time
+ */
+int dlb_candidates(const work_map *map, const cost_model *model, const run_profile *base,
+                   run_profile *best, int max)
+{
+    const double ks[4] = {0.25, 0.5, 0.75, 1.0};
+    const int speculations[2] = {SPECULATION_NONE, SPECULATION_SPLIT};
+    int grid_x = 0,
+        i = 0,
+        j = 0,
+        count = 0;
+
+    for (grid_x = 1; grid_x <= base->ranks; ++grid_x)
+    {
+        for (i = 0; i != 4; ++i)
+        {
+            for (j = 0; j != 2; ++j)
+            {
+                run_profile candidate = *base;
+
+                candidate.grid_x = grid_x;
+                candidate.grid_y = base->ranks / grid_x;
+                candidate.k = ks[i];
+                candidate.speculation = speculations[j];
+
+                if (candidate.grid_x * candidate.grid_y < 2
+                    || (short) (candidate.k * base->width / candidate.grid_x) <= 0
+                    || (short) (candidate.k * base->height / candidate.grid_y) <= 0) continue;
+
+                dlb_features(map, model, &candidate);
+                profile_rank(best, max, &count, &candidate);
+            }
+        }
+    }
+
+    return count;
+}
+
+/*----- Render -----*/
+
+typedef struct render_ctx_s
+{
+    const fractal_params *fractal;
+    MPI_Datatype mpi_mandelbrot_params;
+    MPI_Datatype result_type;
+    int ranks_per_node;
+    const char *png_path;           /* NULL for no image */
+    int color_mode;
+} render_ctx;
+
+/**
+ * Render the image of run with its grid, K and speculation, collective
+ * on MPI_COMM_WORLD
+ * @param  context  render_ctx, fractal, MPI types, nodes and output
+ * @param  run      configuration, size and iterations, rank 0 gets the
+ *                  elapsed time and the busy time of the ranks
+ * @param  verbose  0 for a calibration render: no report and no png
+ */
+void render_image(const void *context, run_profile *run, int verbose)
+{
+    const render_ctx *ctx = (const render_ctx*) context;
+    const int num_groups_x = run->grid_x,
+              num_groups_y = run->grid_y,
+              speculation = run->speculation;
+    const unsigned int width = run->width,
+                       height = run->height,
+                       max_iterations = run->max_iterations;
+    const double k = run->k;
+    const fractal_params *fractal = ctx->fractal;
+    MPI_Datatype mpi_mandelbrot_params = ctx->mpi_mandelbrot_params,
+                 current_mpi_type = ctx->result_type;
+    int rank = -1;
+    double start = 0.0,
+           end = 0.0,
+           busy = 0.0;
+
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    const short num_elm_x = k * width / num_groups_x;
+    const short num_elm_y = k * height / num_groups_y;
+
+    /*----- Farm and nodes -----*/
+    MPI_Comm farm_comm = MPI_COMM_NULL;
+    farm_hierarchy hierarchy;
+    shared_image shared;
+    int hierarchical = 0;
+
+    MPI_Comm_split(MPI_COMM_WORLD, (rank < num_groups_x * num_groups_y) ? 0 : MPI_UNDEFINED, rank, &farm_comm);
+
+    task_farm farm = task_farm_init(farm_comm, num_groups_x * num_groups_y - 1,
+                                    mpi_mandelbrot_params, sizeof(mandelbrot_params),
+                                    current_mpi_type, sizeof(DATA_TYPE));
+
+    if (farm_comm != MPI_COMM_NULL)
+    {
+        const int tiles_per_row = (width + num_elm_x - 1) / num_elm_x;
+
+        // a batch is a band of whole rows of tiles, enough to keep the node busy
+        hierarchy = farm_hierarchy_init(farm_comm, ctx->ranks_per_node, tiles_per_row);
+        while (hierarchy.batch_size < 2 * hierarchy.max_node_size)
+            hierarchy.batch_size += tiles_per_row;
+
+        hierarchical = hierarchy.num_nodes > 1;
+
+        // the ranks on the node of the master write the final image in place
+        shared = shared_image_alloc(farm_comm, FARM_MASTER, sizeof(DATA_TYPE) * width * height);
+    }
+
+    if (rank == 0)
+    {       
+        if (verbose)
+        {
+            fprintf(stdout, ">>> nodes: %d (%s scheduling, %d tiles per batch)\n",
+                hierarchy.num_nodes, hierarchical ? "hierarchical" : "flat", hierarchy.batch_size);
+            fprintf(stdout, ">>> speculation: %s\n", hierarchical ? "none (hierarchical)" : speculation_names[speculation]);
+        }
+
+        #if LOG
+            fprintf(stdout, ">>> elms per groups: %dx%d\n", num_elm_x, num_elm_y);
+        #endif
+
+        tile_scheduler tiles = {0, 0, num_elm_x, num_elm_y, width, height};
+        task_scheduler scheduler = {tile_next_task, &tiles};
+
+        image_ctx image;
+        image.final_matrix = (DATA_TYPE*) shared.base;
+        image.width = width;
+
+        farm_speculation spec;
+        memset(&spec, 0, sizeof(spec));
+        spec.split = (speculation == SPECULATION_SPLIT) ? split_tile : NULL;
+
+        start = MPI_Wtime();
+
+        if (hierarchical)
+            task_farm_hierarchical_master(&farm, &hierarchy, &scheduler, store_tile, &image);
+        else if (speculation != SPECULATION_NONE)
+            task_farm_master_speculative(&farm, &scheduler, store_tile, &image, &spec);
+        else
+            task_farm_master(&farm, &scheduler, store_tile, &image);
+
+        shared_image_sync(&shared);
+
+        #if PRINT_MATRIX
+            printMatrix(image.final_matrix, width, height);
+        #endif
+
+        end = MPI_Wtime();
+        run->elapsed = end - start;
+
+        if (verbose)
+        {
+            fprintf(stdout, ">>> Done!\n");
+            fprintf(stdout, ">>> Elapsed time is %f\n", end - start );
+            if (run->predicted > 0.0) fprintf(stdout, ">>> Predicted time is %f\n", run->predicted);
+        }
+
+        if (verbose && !hierarchical && speculation != SPECULATION_NONE)
+        {
+            fprintf(stdout, ">>> Speculation: %d tiles split, %d copied, %d won by the backup, %d cancelled, %d results wasted\n",
+                spec.splits, spec.copies, spec.backup_wins, spec.cancelled, spec.wasted);
+            fprintf(stdout, ">>> Tail time is %f, estimated saving %f\n", spec.tail_time, spec.saved_time);
+        }
+
+        /*----- Colorization and PNG -----*/
+        if (verbose && ctx->png_path != NULL)
+        {
+            start = MPI_Wtime();
+
+            if (fractal_write_png(ctx->png_path, image.final_matrix, width, height, max_iterations, ctx->color_mode, fractal) != 0)
+                fprintf(stdout, ">> Cannot write %s...\n", ctx->png_path);
+            else
+                fprintf(stdout, ">>> Image written in %s in %f\n", ctx->png_path, MPI_Wtime() - start);
+        }
+    }
+    else if(rank < num_groups_x * num_groups_y)
+    {   
+        worker_ctx worker = {NULL, 0, max_iterations, width, height, fractal, (DATA_TYPE*) shared.base, &shared, &farm, 0.0};
+
+        if (hierarchical)
+            task_farm_hierarchical_node(&farm, &hierarchy, compute_tile, &worker);
+        else
+            task_farm_worker(&farm, compute_tile, &worker);
+
+        busy = worker.busy;
+
+        /*----- CLEAN -----*/
+        free(worker.result_buf);
+    }
+
+    if (farm_comm != MPI_COMM_NULL)
+    {
+        shared_image_free(&shared);
+        farm_hierarchy_free(&hierarchy);
+        MPI_Comm_free(&farm_comm);
+    }
+
+    busy_reduce(MPI_COMM_WORLD, busy, &run->busy_max, &run->busy_mean);
 }
 
 int main (int argc, char** argv)
@@ -122,6 +532,12 @@ int main (int argc, char** argv)
                  height = 1080,
                  max_iterations = 10000;
     double k = 1.0;
+    int ranks_per_node = 0;
+    fractal_params fractal = fractal_default();
+    const char *png_path = NULL;
+    int color_mode = COLOR_HISTOGRAM;
+    int speculation = SPECULATION_SPLIT;
+    int autotune = AUTOTUNE_OFF;
     
     /*----- Start MPI environment -----*/
     MPI_Init(&argc, &argv);
@@ -131,22 +547,28 @@ int main (int argc, char** argv)
     /**
      * Arguments:
      *
-     * - argv[1] -> NxM (grid)(required)
-     * - argv[2] -> N (K)(required)
+     * - argv[1] -> NxM (grid), auto or auto:calibrate to choose grid, K and speculation from the run profiles (required)
+     * - argv[2] -> N (K), with an auto grid a placeholder, auto or a number (required)
      * - argv[3] -> NxM (screen resolution)(optional, has default value)
      * - argv[4] -> N (number of iterations)(optional, has default value)
+     * - argv[5] -> fractal, e.g. mandelbrot, multibrot:3, julia:-0.8,0.156 or julia:0.3,0.5,4 (optional, has default value)
+     * - argv[6] -> N (ranks per node, 0 uses the shared memory nodes)(optional, has default value)
+     * - argv[7] -> output png (optional, no image without it)
+     * - argv[8] -> coloring, histogram, smooth or gray (optional, has default value)
+     * - argv[9] -> speculation on the tail, none, copy or split, ignored with an auto grid (optional, has default value)
      * 
      */
 
     /*----- START Args parsing -----*/
     if (argc < 3)
     {
-        fprintf(stdout, ">> An input grid and a value K are required to run this program, grid can be for example 2x3, 3x2, 2x8, 4x4, 8x2 and K = [0.25, 0.5, 0.75, 1]\n");
+        fprintf(stdout, ">> An input grid and a value K are required to run this program, grid can be for example 2x3, 3x2, 2x8, 4x4, 8x2 and K = [0.25, 0.5, 0.75, 1] (auto with an auto grid)\n");
         MPI_Abort(MPI_COMM_WORLD, 3);
     }
 
     /** Grid **/
-    ok = sscanf( argv[1], "%dx%d", &num_groups_x, &num_groups_y);
+    if (autotune_parse(argv[1], &autotune)) ok = 2;
+    else ok = sscanf( argv[1], "%dx%d", &num_groups_x, &num_groups_y);
 
     if (ok != 2)
     {
@@ -154,8 +576,21 @@ int main (int argc, char** argv)
         MPI_Abort(MPI_COMM_WORLD, 5);
     }
 
-    /** K **/
-    ok = sscanf( argv[2], "%lf", &k);
+    /** K, only a placeholder with an auto grid **/
+    if (!autotune) ok = sscanf( argv[2], "%lf", &k);
+    else
+    {
+        // a number alone, a resolution like 1920x1080 means that K is missing
+        double placeholder = 0.0;
+        char tail = 0;
+        ok = (strcmp(argv[2], "auto") == 0 || sscanf( argv[2], "%lf%c", &placeholder, &tail) == 1);
+    }
+
+    if (autotune && ok != 1)
+    {
+        fprintf(stdout, ">> With an auto grid K is still required as a placeholder, e.g. %s auto 1920x1080\n", argv[1]);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
 
     if (ok != 1)
     {
@@ -185,7 +620,44 @@ int main (int argc, char** argv)
         }
     }
 
-    if (num_groups_x * num_groups_y > size)
+    if (argc >= 6 && !fractal_parse(argv[5], &fractal))
+    {
+        fprintf(stdout, ">> Something went wrong during fractal parsing...\n");
+        MPI_Abort(MPI_COMM_WORLD, 11);
+    }
+
+    if (argc >= 7)
+    {
+        /** Ranks per node **/
+        ok = sscanf( argv[6], "%d", &ranks_per_node);
+        if (ok != 1 || ranks_per_node < 0)
+        {
+            fprintf(stdout, ">> Something went wrong during ranks per node parsing...\n");
+            MPI_Abort(MPI_COMM_WORLD, 12);
+        }
+    }
+
+    if (argc >= 8) png_path = argv[7];
+
+    if (argc >= 9 && !color_parse(argv[8], &color_mode))
+    {
+        fprintf(stdout, ">> Something went wrong during coloring parsing...\n");
+        MPI_Abort(MPI_COMM_WORLD, 13);
+    }
+
+    if (argc >= 10 && !speculation_parse(argv[9], &speculation))
+    {
+        fprintf(stdout, ">> Something went wrong during speculation parsing...\n");
+        MPI_Abort(MPI_COMM_WORLD, 14);
+    }
+
+    if (autotune && size < 2)
+    {
+        fprintf(stdout, ">> You need at least 2 processes to choose the grid, a master and a worker...\n");
+        MPI_Abort(MPI_COMM_WORLD, 15);
+    }
+
+    if (!autotune && num_groups_x * num_groups_y > size)
     {
         fprintf(stdout, ">> You need %d processes in a grid %s and you have %d processes...\n", num_groups_x * num_groups_y, argv[1], size);
         MPI_Abort(MPI_COMM_WORLD, 9);
@@ -199,17 +671,16 @@ int main (int argc, char** argv)
     /*----- END Args parsing -----*/
 
     /*----- Message MODEL -----*/
-    const int nitems = 5;
-    int blocklengths[5] = {1, 1, 1, 1, 1};
-    MPI_Datatype types[5] = {MPI_UNSIGNED, MPI_UNSIGNED, MPI_UNSIGNED, MPI_UNSIGNED, MPI_UNSIGNED};
+    const int nitems = 4;
+    int blocklengths[4] = {1, 1, 1, 1};
+    MPI_Datatype types[4] = {MPI_UNSIGNED, MPI_UNSIGNED, MPI_UNSIGNED, MPI_UNSIGNED};
     MPI_Datatype mpi_mandelbrot_params;
-    MPI_Aint offsets[5];
+    MPI_Aint offsets[4];
 
     offsets[0] = offsetof(mandelbrot_params, start_x);
     offsets[1] = offsetof(mandelbrot_params, start_y);
     offsets[2] = offsetof(mandelbrot_params, size_x);
     offsets[3] = offsetof(mandelbrot_params, size_y);
-    offsets[4] = offsetof(mandelbrot_params, _exit);
 
     MPI_Type_create_struct(nitems, blocklengths, offsets, types, &mpi_mandelbrot_params);
     MPI_Type_commit(&mpi_mandelbrot_params);
@@ -221,13 +692,52 @@ int main (int argc, char** argv)
     switch(sizeof(DATA_TYPE)) {
         case 4 :
             current_mpi_type = MPI_UNSIGNED;
+            break;
         case 2 :
             current_mpi_type = MPI_UNSIGNED_SHORT;
+            break;
         default :
             current_mpi_type = MPI_BYTE;
     }
     /*----- END MPI TYPE -----*/
 
+    /*----- Work map and configuration -----*/
+    run_profile run;
+    memset(&run, 0, sizeof(run));
+    strcpy(run.program, "DLB");
+    run.ranks = size;
+    run.width = width;
+    run.height = height;
+    run.max_iterations = max_iterations;
+    run.grid_x = num_groups_x;
+    run.grid_y = num_groups_y;
+    run.k = k;
+    run.speculation = speculation;
+
+    render_ctx ctx = {&fractal, mpi_mandelbrot_params, current_mpi_type, ranks_per_node, png_path, color_mode};
+
+    // manual runs skip the work map unless they are recorded
+    int profiled = profile_enabled(autotune);
+    work_map map = {0, 0, NULL, 0.0};
+    cost_model model = {0.0, 0.0, 0.0, 0};
+
+    MPI_Bcast(&profiled, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    if (profiled)
+    {
+        start = MPI_Wtime();
+        map = work_map_build(MPI_COMM_WORLD, &fractal, max_iterations, width, height);
+        end = MPI_Wtime();
+
+        model = autotune_configure(autotune, &map, &run, dlb_features, dlb_candidates, render_image, &ctx);
+    }
+
+    if (run.grid_x < 1)
+    {
+        if (rank == 0) fprintf(stdout, ">> No grid fits %d processes and a %ux%u image, choose one by hand...\n", size, width, height);
+        MPI_Abort(MPI_COMM_WORLD, 16);
+    }
+
     #if LOG
         fprintf(stdout, ">> Process rank(%d) online - tot processes (%d)\n", rank, size);
     #endif
@@ -235,251 +745,30 @@ int main (int argc, char** argv)
     if (rank == 0)
     {       
         fprintf(stdout, ">>> Starting DLB Algorithm...\n");
-        fprintf(stdout, ">>> num groups: %dx%d\n", num_groups_x, num_groups_y);
+        fprintf(stdout, ">>> num groups: %dx%d%s\n", run.grid_x, run.grid_y, autotune ? " (auto)" : "");
         fprintf(stdout, ">>> image size: %dx%d\n", width, height);
         fprintf(stdout, ">>> max iterations: %d\n", max_iterations);
-        fprintf(stdout, ">>> K: %f\n", k);
-        
-        const short num_elm_x = k * width / num_groups_x;
-        const short num_elm_y = k * height / num_groups_y;
-
-        mandelbrot_params *params_container = NULL;
-        unsigned int params_container_size = num_groups_x * num_groups_y - 1;
-        params_container = (mandelbrot_params*) malloc(sizeof(mandelbrot_params) * params_container_size);
-        short params_container_flags[params_container_size];
-
-        int cont_i = 0;
-        for (cont_i = 0; cont_i != params_container_size; ++cont_i)
-        {
-            params_container_flags[cont_i] = -1;
-        }
-
-        int process_num = 0;
-        for(process_num = 1; process_num < (num_groups_x * num_groups_y); ++process_num)
-        {   
-            params_container[process_num - 1].size_x = 0;  
-            params_container[process_num - 1].size_y = 0;
-            params_container[process_num - 1].start_x = 0;
-            params_container[process_num - 1].start_y = 0;
-            params_container[process_num - 1]._exit = 0;
-        }
-
-        #if LOG
-            fprintf(stdout, ">>> elms per groups: %dx%d\n", num_elm_x, num_elm_y);
-        #endif
-
-        DATA_TYPE *final_matrix = (DATA_TYPE*) malloc(sizeof(DATA_TYPE) * (width * height));
-        MPI_Status status;
+        fprintf(stdout, ">>> K: %f\n", run.k);
+        fprintf(stdout, ">>> fractal: %d (d = %d, c = %f%+fi)\n", fractal.family, fractal.power, fractal.c_re, fractal.c_im);
 
-        start = MPI_Wtime();
-
-        unsigned int y = 0,
-                     x = 0;
-
-        for (y = 0; y < height; y += num_elm_y)
-        {
-            for (x = 0; x < width; x += num_elm_x)
-            {
-                int start_x = x;
-                int start_y = y;
-                int size_x = num_elm_x;
-                int size_y = num_elm_y;
-
-                if (start_x + size_x > width)
-                    size_x = width % num_elm_x;
-
-                if (start_y + size_y > height)
-                    size_y = height % num_elm_y;
-
-                #if LOG
-                    fprintf(stdout, ">>> s_x: %d\ts_y: %d\tsize_x: %d\tsize_y: %d\tworker_available: %d\n",
-                        start_x, start_y, size_x, size_y, worker_available(params_container_flags, params_container_size));
-                #endif
-
-                if(worker_available(params_container_flags, params_container_size) != -1)
-                {   
-                    int free_worker = worker_available(params_container_flags, params_container_size);
-                    
-                    params_container[free_worker].start_x = start_x;
-                    params_container[free_worker].start_y = start_y;
-                    params_container[free_worker].size_x = size_x;
-                    params_container[free_worker].size_y = size_y;
-                    params_container[free_worker]._exit = 0;
-
-                    params_container_flags[free_worker] = 0;
-
-                    MPI_Send(&params_container[free_worker], 1, mpi_mandelbrot_params, (free_worker+1), 0, MPI_COMM_WORLD);               
-                }
-                else
-                {   
-                    DATA_TYPE *buffer = NULL;
-                    while(worker_available(params_container_flags, params_container_size) == -1)
-                    {
-                        int num_elems = -1;
-
-                        MPI_Probe(MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &status);
-                        MPI_Get_count(&status, current_mpi_type, &num_elems);
-
-                        buffer = (DATA_TYPE*) realloc(buffer, sizeof(DATA_TYPE) * num_elems);
-                        #if LOG
-                            fprintf(stdout, "HERE %d\n", num_elems);
-                        #endif
-                        MPI_Recv(&buffer[0], num_elems, current_mpi_type, status.MPI_SOURCE, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-                        #if LOG
-                            fprintf(stdout, "HERE2\n");
-                        #endif
-
-                        unsigned int row = 0;
-                        mandelbrot_params cur_params = params_container[(status.MPI_SOURCE - 1)];
-
-                        for (row = 0; row != cur_params.size_y; ++row) {
-                            unsigned int offset = row * cur_params.size_x;
-                            unsigned int final_index = cur_params.start_x + (cur_params.start_y + row) * width;
-                            memcpy(
-                                final_matrix + final_index,
-                                buffer + offset,
-                                sizeof(DATA_TYPE) * cur_params.size_x
-                            );
-                        }
-
-                        #if LOG
-                            fprintf(stdout, "Received result from process %d, now it will have a new job...\n", status.MPI_SOURCE);
-                        #endif
-
-                        params_container_flags[(status.MPI_SOURCE - 1)] = -1;
-                    }
-
-                    /*----- CLEAN -----*/
-                    free(buffer);
-
-                    #if LOG
-                        fprintf(stdout, ">>>> New job for process (%d) -> s_x: %d\ts_y: %d\tsize_x: %d\tsize_y: %d\tworker_available: %d\n",
-                            status.MPI_SOURCE, start_x, start_y, size_x, size_y, worker_available(params_container_flags, params_container_size));
-                    #endif
-
-                    int free_worker = worker_available(params_container_flags, params_container_size);
-                    
-                    params_container[free_worker].start_x = start_x;
-                    params_container[free_worker].start_y = start_y;
-                    params_container[free_worker].size_x = size_x;
-                    params_container[free_worker].size_y = size_y;
-                    params_container[free_worker]._exit = 0;
-
-                    params_container_flags[free_worker] = 0;
-
-                    MPI_Send(&params_container[free_worker], 1, mpi_mandelbrot_params, status.MPI_SOURCE, 0, MPI_COMM_WORLD);
-                }
-            }
-        }
-
-        DATA_TYPE *buffer = NULL;
-        while(someone_busy(params_container_flags, params_container_size))
+        if (profiled)
         {
-            int num_elems = -1;
-
-            #if LOG
-                fprintf(stdout, ">>> Wait for results... someone is busy...\n");
-            #endif
-            MPI_Probe(MPI_ANY_SOURCE, 0, MPI_COMM_WORLD, &status);
-            MPI_Get_count(&status, current_mpi_type, &num_elems);
-
-            buffer = (DATA_TYPE*) realloc(buffer, sizeof(DATA_TYPE) * num_elems);
-            MPI_Recv(&buffer[0], num_elems, current_mpi_type, status.MPI_SOURCE, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-            unsigned int row = 0;
-            mandelbrot_params cur_params = params_container[(status.MPI_SOURCE - 1)];
-
-            for (row = 0; row != cur_params.size_y; ++row) {
-                unsigned int offset = row * cur_params.size_x;
-                unsigned int final_index = cur_params.start_x + (cur_params.start_y + row) * width;
-                memcpy(
-                    final_matrix + final_index,
-                    buffer + offset,
-                    sizeof(DATA_TYPE) * cur_params.size_x
-                );
-            }
-
-            #if LOG
-                fprintf(stdout, "Received result from process %d, now it will have a new job...\n", status.MPI_SOURCE);
-            #endif
-
-            params_container_flags[(status.MPI_SOURCE - 1)] = -1;
-
-            
+            fprintf(stdout, ">>> work map: %ux%u in %f\n", map.width, map.height, end - start);
+            fprintf(stdout, ">>> cost model: %e s per iteration, %e s per tile, %f s (%d profiles)\n",
+                model.alpha, model.beta, model.gamma, model.samples);
         }
-        /*----- CLEAN -----*/
-        free(buffer);
-
-        #if PRINT_MATRIX
-            printMatrix(final_matrix, width, height);
-        #endif
-
-        end = MPI_Wtime();
+    }
 
-        fprintf(stdout, ">>> Done!\n");
-        fprintf(stdout, ">>> Elapsed time is %f\n", end - start );
+    render_image(&ctx, &run, 1);
 
-        /*----- CLEAN -----*/
-        for(process_num = 1; process_num <(num_groups_x * num_groups_y); ++process_num)
-        {    
-            mandelbrot_params exit_params;
-            exit_params.start_x = 0;
-            exit_params.start_y = 0;
-            exit_params.size_x = 0;
-            exit_params.size_y = 0;
-            exit_params._exit = 1;
-            MPI_Send(&exit_params, 1, mpi_mandelbrot_params, process_num, 0, MPI_COMM_WORLD);
-        }
-        free(params_container);
-        free(final_matrix);
+    if (profiled && rank == 0 && profile_append(&run) != 0)
+        fprintf(stdout, ">> Cannot write the run profile...\n");
 
-    }
-    else if(rank < num_groups_x * num_groups_y)
-    {   
-        int run = 1;
+    work_map_free(&map);
+    MPI_Type_free(&mpi_mandelbrot_params);
 
-        while(run)
-        {
-            mandelbrot_params recv_params;
-            MPI_Recv(&recv_params, 1, mpi_mandelbrot_params, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-
-            if(recv_params._exit == 0)
-            {
-                #if LOG
-                    fprintf(stdout, ">>>> Process rank(%d) received the job - tot process: %d\n", rank, size);
-                    fprintf(stdout, ">>>> Process rank(%d) will calculate image\n>>>>\tfrom (%d,%d)\n>>>>\twith size (%d,%d)\n>>>>\tof the image (%d,%d)\n",
-                        rank, recv_params.start_x, recv_params.start_y, recv_params.size_x, recv_params.size_y, width, height);
-                #endif
-
-                int num_elms = recv_params.size_x * recv_params.size_y;
-
-                DATA_TYPE *result_buf = (DATA_TYPE*) malloc(sizeof(DATA_TYPE) * num_elms);
-                
-                gen_mandelbrot_set(result_buf, recv_params.start_x, recv_params.start_y, max_iterations, recv_params.size_x, recv_params.size_y, width, height);
-
-                #if PRINT_MATRIX
-                    printMatrix(result_buf, recv_params.size_x, recv_params.size_y);   
-                #endif  
-                
-                #if LOG
-                    fprintf(stdout, ">>>> Process rank(%d) send %d elements\n", rank, num_elms);
-                #endif
-
-                MPI_Send(&result_buf[0], num_elms, current_mpi_type, 0, 0, MPI_COMM_WORLD); 
-
-                /*----- CLEAN -----*/
-                free(result_buf);
-            }
-            else
-            {   
-                #if LOG
-                    fprintf(stdout, ">> Process rank(%d) received order to exit!\n", rank);
-                #endif
-                run = 0;
-            }     
-        }
-    }
+    /* counters of the kernels, with -DPERF_COUNTERS */
+    PERF_REPORT(MPI_COMM_WORLD);
 
     #if LOG
         fprintf(stdout, ">> Process rank(%d) exiting...\n", rank);
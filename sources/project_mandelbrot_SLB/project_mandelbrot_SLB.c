@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stddef.h>  // required by offsetof
 #include <mpi.h>
+#include "../mpi_shared_image.h"
 
 #define PRINT_MATRIX 0
 #define LOG 0
@@ -10,6 +11,10 @@
 typedef unsigned char BYTE;
 typedef unsigned short DATA_TYPE;
 
+#include "../fractal_kernels.h"
+#include "../fractal_png.h"
+#include "../mandelbrot_autotune.h"
+
 typedef struct mandelbrot_params_s 
 {
     unsigned int start_x;
@@ -19,6 +24,7 @@ typedef struct mandelbrot_params_s
 } mandelbrot_params;
 
 DATA_TYPE* gen_mandelbrot_set(
+                         const fractal_params *fractal,
                          const unsigned int start_x,
                          const unsigned int start_y,
                          const unsigned int max_iterations,
@@ -30,34 +36,9 @@ DATA_TYPE* gen_mandelbrot_set(
 {
     DATA_TYPE *point_list;
     point_list = (DATA_TYPE*) malloc(sizeof(DATA_TYPE) * size_x * size_y);
-    
-    unsigned int Px = 0;
-    unsigned int Py = 0;
 
-    for(Py = start_y; Py != start_y + size_y; ++Py)
-    {
-        for(Px = start_x; Px != start_x + size_x; ++Px)
-        {
-            double x0 = ((double) Px * 3.5 / (double) img_size_x) - 2.5;
-            double y0 = ((double) Py * 2.0 / (double) img_size_y) - 1.0;
-            double x = 0.0;
-            double y = 0.0;
-            double xTemp = 0.0;
-            DATA_TYPE iteration = 0;
-            
-            while( (x*x + y*y) < 2*2 && iteration < max_iterations)
-            {
-                xTemp = x*x - y*y + x0;
-                y = 2*x*y + y0;
-                x = xTemp;
-                
-                iteration++;
-            }
-            
-            point_list[(Px - start_x) + (Py - start_y) * size_x] = iteration;
-        }
-    }
-    
+    fractal_tile(fractal, point_list, start_x, start_y, max_iterations, size_x, size_y, img_size_x, img_size_y);
+
     return point_list;
 }
 
@@ -76,122 +57,109 @@ DATA_TYPE* gen_mandelbrot_set(
     }
 #endif
 
-int main (int argc, char** argv)
-{
-    int rank = -1, 
-        size = -1, 
-        ok = 0;
+/*----- Cost model features -----*/
 
-    int num_groups_x = -1, 
-        num_groups_y = -1;
-    
-    double start = 0.0, 
-           end = 0.0;
+/**
+ * Makespan of a grid, the iterations of the biggest block, every rank
+ * computes one tile
+ */
+void slb_features(const work_map *map, const cost_model *model, run_profile *run)
+{
+    const unsigned int num_elm_x = run->width / run->grid_x,
+                       num_elm_y = run->height / run->grid_y;
+    int x = 0,
+        y = 0;
 
-    /*----- Default values -----*/
-    unsigned int width = 1920,
-                 height = 1080,
-                 max_iterations = 10000;
-    
-    /*----- Start MPI environment -----*/
-    MPI_Init(&argc, &argv);
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    run->makespan = 0.0;
+    run->tasks = 1.0;
 
-    /**
-     * Arguments:
-     *
-     * - argv[1] -> NxM (grid)(required)
-     * - argv[2] -> NxM (screen resolution)(optional, has default value)
-     * - argv[3] -> N (number of iterations)(optional, has default value)
-     * 
-     */
-
-    /*----- START Args parsing -----*/
-    if (argc == 1)
+    for (y = 0; y != run->grid_y; ++y)
     {
-        fprintf(stdout, ">> An input grid is required to run this program, for example 2x3, 3x2, 2x8, 4x4, 8x2\n");
-        MPI_Abort(MPI_COMM_WORLD, 3);
+        for (x = 0; x != run->grid_x; ++x)
+        {
+            // the last row and column of blocks take the rest, as in render_image
+            unsigned int size_x = (x == run->grid_x - 1) ? num_elm_x + run->width % num_elm_x : num_elm_x,
+                         size_y = (y == run->grid_y - 1) ? num_elm_y + run->height % num_elm_y : num_elm_y;
+            double work = work_map_rect(map, run->width, run->height, x * num_elm_x, y * num_elm_y, size_x, size_y);
+
+            if (work > run->makespan) run->makespan = work;
+        }
     }
 
-    /** Grid **/
-    ok = sscanf( argv[1], "%dx%d", &num_groups_x, &num_groups_y);
+    run->predicted = cost_model_predict(model, run->makespan, run->tasks);
+}
 
-    if (ok != 2)
+/**
+ * Grids N x (ranks / N), sorted by predicted time
+ */
+int slb_candidates(const work_map *map, const cost_model *model, const run_profile *base,
+                   run_profile *best, int max)
+{
+    int grid_x = 0,
+        count = 0;
+
+    for (grid_x = 1; grid_x <= base->ranks; ++grid_x)
     {
-        fprintf(stdout, ">> Something went wrong during grid parsing...\n");
-        MPI_Abort(MPI_COMM_WORLD, 5);
-    }
+        run_profile candidate = *base;
 
-    if (argc >= 3)
-    {   
-        /** Screen resolution **/
-        ok = sscanf( argv[2], "%dx%d", &width, &height);
-        if (ok != 2)
-        {
-            fprintf(stdout, ">> Something went wrong during image resolution parsing...\n");
-            MPI_Abort(MPI_COMM_WORLD, 6);
-        }
-    }
+        candidate.grid_x = grid_x;
+        candidate.grid_y = base->ranks / grid_x;
+        candidate.k = 1.0;
+        candidate.speculation = 0;
 
-    if (argc >= 4)
-    {   
-        /** Number of iterations **/
-        ok = sscanf( argv[3], "%d", &max_iterations);
-        if (ok != 1)
-        {
-            fprintf(stdout, ">> Something went wrong during max iterations parsing...\n");
-            MPI_Abort(MPI_COMM_WORLD, 7);
-        }
-    }
+        if (base->width / candidate.grid_x == 0 || base->height / candidate.grid_y == 0) continue;
 
-    if (num_groups_x * num_groups_y > size)
-    {
-        fprintf(stdout, ">> You need %d processes in a grid %s and you have %d processes...\n", num_groups_x * num_groups_y, argv[1], size);
-        MPI_Abort(MPI_COMM_WORLD, 8);
+        slb_features(map, model, &candidate);
+        profile_rank(best, max, &count, &candidate);
     }
-    /*----- END Args parsing -----*/
-
-    /*----- Message MODEL -----*/
-    const int nitems = 4;
-    int blocklengths[4] = {1, 1, 1, 1};
-    MPI_Datatype types[4] = {MPI_UNSIGNED, MPI_UNSIGNED, MPI_UNSIGNED, MPI_UNSIGNED};
-    MPI_Datatype mpi_mandelbrot_params;
-    MPI_Aint offsets[4];
 
-    offsets[0] = offsetof(mandelbrot_params, start_x);
-    offsets[1] = offsetof(mandelbrot_params, start_y);
-    offsets[2] = offsetof(mandelbrot_params, size_x);
-    offsets[3] = offsetof(mandelbrot_params, size_y);
+    return count;
+}
 
-    MPI_Type_create_struct(nitems, blocklengths, offsets, types, &mpi_mandelbrot_params);
-    MPI_Type_commit(&mpi_mandelbrot_params);
-    /*----- END Message MODEL -----*/
+/*----- Render -----*/
 
-    /*----- MPI TYPE -----*/
-    MPI_Datatype current_mpi_type = MPI_BYTE;
+typedef struct render_ctx_s
+{
+    const fractal_params *fractal;
+    MPI_Datatype mpi_mandelbrot_params;
+    MPI_Datatype result_type;
+    const char *png_path;           /* NULL for no image */
+    int color_mode;
+} render_ctx;
+
+/**
+ * Render the image of run on its grid, one block per rank, collective
+ * on MPI_COMM_WORLD
+ * @param  context  render_ctx, fractal, MPI types and output
+ * @param  run      grid, size and iterations, rank 0 gets the elapsed
+ *                  time and the busy time of the ranks
+ * @param  verbose  0 for a calibration render: no report and no png
+ */
+void render_image(const void *context, run_profile *run, int verbose)
+{
+    const render_ctx *ctx = (const render_ctx*) context;
+    const int num_groups_x = run->grid_x,
+              num_groups_y = run->grid_y;
+    const unsigned int width = run->width,
+                       height = run->height,
+                       max_iterations = run->max_iterations;
+    const fractal_params *fractal = ctx->fractal;
+    MPI_Datatype mpi_mandelbrot_params = ctx->mpi_mandelbrot_params,
+                 current_mpi_type = ctx->result_type;
+    int rank = -1,
+        size = -1;
+    double start = 0.0,
+           end = 0.0,
+           busy = 0.0;
 
-    switch(sizeof(DATA_TYPE)) {
-        case 4 :
-            current_mpi_type = MPI_UNSIGNED;
-        case 2 :
-            current_mpi_type = MPI_UNSIGNED_SHORT;
-        default :
-            current_mpi_type = MPI_BYTE;
-    }
-    /*----- END MPI TYPE -----*/
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
 
-    #if LOG
-        fprintf(stdout, ">> Process rank(%d) online - tot processes (%d)\n", rank, size);
-    #endif
+    /*----- Final image, shared with the ranks on the node of the master -----*/
+    shared_image shared = shared_image_alloc(MPI_COMM_WORLD, 0, sizeof(DATA_TYPE) * width * height);
 
     if (rank == 0)
     {       
-        fprintf(stdout, ">>> Starting SLB Algorithm...\n");
-        fprintf(stdout, ">>> num groups: %dx%d\n", num_groups_x, num_groups_y);
-        fprintf(stdout, ">>> image size: %dx%d\n", width, height);
-        fprintf(stdout, ">>> max iterations: %d\n", max_iterations);
-        
         const short num_elm_x = width / num_groups_x;
         const short num_elm_y = height / num_groups_y;
 
@@ -254,29 +222,33 @@ int main (int argc, char** argv)
         params_container[0].size_x = num_elm_x;
         params_container[0].size_y = num_elm_y;
         
-        DATA_TYPE *master_buffer = NULL;
-        master_buffer = gen_mandelbrot_set(0, 0, max_iterations, num_elm_x, num_elm_y, width, height); 
+        DATA_TYPE *final_matrix = (DATA_TYPE*) shared.base;
+
+        // the master writes its tile in place
+        busy = MPI_Wtime();
+        fractal_tile_strided(fractal, final_matrix, width, 0, 0, max_iterations, num_elm_x, num_elm_y, width, height);
+        busy = MPI_Wtime() - busy;
         
         /*----- Receive results -----*/
         int process_num = 0;
 
-        DATA_TYPE *final_matrix = NULL;
         DATA_TYPE *buffer = NULL;
-        final_matrix = (DATA_TYPE*) malloc(sizeof(DATA_TYPE) * (width * height));
 
-        for(process_num = 0; process_num < (num_groups_x * num_groups_y); ++process_num)
+        for(process_num = 1; process_num < (num_groups_x * num_groups_y); ++process_num)
         {   
             mandelbrot_params *cur_params = &params_container[process_num];
+            int num_elms = cur_params->size_x * cur_params->size_y;
+            int num_recv = 0;
+            MPI_Status status;
 
-            if(process_num != 0)
-            {   
-                int num_elms = cur_params->size_x * cur_params->size_y;
+            if(buffer != NULL) buffer = (DATA_TYPE*) realloc(buffer, sizeof(DATA_TYPE) * num_elms);
+            else buffer = (DATA_TYPE*) malloc(sizeof(DATA_TYPE) * num_elms);
+            
+            MPI_Recv(&buffer[0], num_elms, current_mpi_type, process_num, 0, MPI_COMM_WORLD, &status);
+            MPI_Get_count(&status, current_mpi_type, &num_recv);
 
-                if(buffer != NULL) buffer = (DATA_TYPE*) realloc(buffer, sizeof(DATA_TYPE) * num_elms);
-                else buffer = (DATA_TYPE*) malloc(sizeof(DATA_TYPE) * num_elms);
-                
-                MPI_Recv(&buffer[0], num_elms, current_mpi_type, process_num, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            }
+            // an empty message is a tile written in place in the shared image
+            if (num_recv == 0) continue;
 
             unsigned int row = 0;
 
@@ -285,39 +257,44 @@ int main (int argc, char** argv)
                 unsigned int offset = row * cur_params->size_x;
                 unsigned int final_index = cur_params->start_x + (cur_params->start_y + row) * width;
                 
-                if(process_num != 0)
-                {
-                    memcpy(
-                        final_matrix + final_index,
-                        buffer + offset,
-                        sizeof(DATA_TYPE) * cur_params->size_x
-                    );
-                }
-                else
-                {
-                    memcpy(
-                        final_matrix + final_index,
-                        master_buffer + offset,
-                        sizeof(DATA_TYPE) * cur_params->size_x
-                    );
-                }
+                memcpy(
+                    final_matrix + final_index,
+                    buffer + offset,
+                    sizeof(DATA_TYPE) * cur_params->size_x
+                );
             }   
         }
 
+        shared_image_sync(&shared);
+
         end = MPI_Wtime();
+        run->elapsed = end - start;
 
         #if PRINT_MATRIX
             printMatrix(final_matrix, width, height);
         #endif  
 
-        fprintf(stdout, ">>> Done!\n");
-        fprintf(stdout, ">>> Elapsed time is %f\n", end - start );
+        if (verbose)
+        {
+            fprintf(stdout, ">>> Done!\n");
+            fprintf(stdout, ">>> Elapsed time is %f\n", end - start );
+            if (run->predicted > 0.0) fprintf(stdout, ">>> Predicted time is %f\n", run->predicted);
+        }
+
+        /*----- Colorization and PNG -----*/
+        if (verbose && ctx->png_path != NULL)
+        {
+            start = MPI_Wtime();
+
+            if (fractal_write_png(ctx->png_path, final_matrix, width, height, max_iterations, ctx->color_mode, fractal) != 0)
+                fprintf(stdout, ">> Cannot write %s...\n", ctx->png_path);
+            else
+                fprintf(stdout, ">>> Image written in %s in %f\n", ctx->png_path, MPI_Wtime() - start);
+        }
 
         /*----- CLEAN -----*/
-        free(master_buffer);
         free(buffer);
         free(params_container);
-        free(final_matrix);
     }
     else if(rank < num_groups_x * num_groups_y)
     {   
@@ -333,22 +310,246 @@ int main (int argc, char** argv)
         #endif
 
         int num_elms = recv_params.size_x * recv_params.size_y;
-        DATA_TYPE *result = gen_mandelbrot_set(recv_params.start_x, recv_params.start_y, max_iterations, recv_params.size_x, recv_params.size_y, width, height);
 
-        #if PRINT_MATRIX
-            printMatrix(result, recv_params.size_x, recv_params.size_y);   
-        #endif  
-        
-        #if LOG
-            fprintf(stdout, ">>>> Process rank(%d) send %d elms\n", rank, num_elms);
-        #endif
+        if (shared.base != NULL)
+        {
+            /*----- Same node of the master, write in place -----*/
+            DATA_TYPE *final_matrix = (DATA_TYPE*) shared.base;
 
-        MPI_Send(&result[0], num_elms, current_mpi_type, 0, 0, MPI_COMM_WORLD);
+            busy = MPI_Wtime();
+            fractal_tile_strided(fractal, final_matrix + recv_params.start_x + recv_params.start_y * width, width,
+                                 recv_params.start_x, recv_params.start_y, max_iterations,
+                                 recv_params.size_x, recv_params.size_y, width, height);
+            shared_image_sync(&shared);
+            busy = MPI_Wtime() - busy;
 
-        /*----- CLEAN -----*/
-        free(result);
+            #if LOG
+                fprintf(stdout, ">>>> Process rank(%d) wrote %d elms in the shared image\n", rank, num_elms);
+            #endif
+
+            MPI_Send(NULL, 0, current_mpi_type, 0, 0, MPI_COMM_WORLD);
+        }
+        else
+        {
+            busy = MPI_Wtime();
+            DATA_TYPE *result = gen_mandelbrot_set(fractal, recv_params.start_x, recv_params.start_y, max_iterations, recv_params.size_x, recv_params.size_y, width, height);
+            busy = MPI_Wtime() - busy;
+
+            #if PRINT_MATRIX
+                printMatrix(result, recv_params.size_x, recv_params.size_y);   
+            #endif  
+            
+            #if LOG
+                fprintf(stdout, ">>>> Process rank(%d) send %d elms\n", rank, num_elms);
+            #endif
+
+            MPI_Send(&result[0], num_elms, current_mpi_type, 0, 0, MPI_COMM_WORLD);
+
+            /*----- CLEAN -----*/
+            free(result);
+        }
+    }
+
+    shared_image_free(&shared);
+
+    busy_reduce(MPI_COMM_WORLD, busy, &run->busy_max, &run->busy_mean);
+}
+
+int main (int argc, char** argv)
+{
+    int rank = -1, 
+        size = -1, 
+        ok = 0;
+
+    int num_groups_x = -1, 
+        num_groups_y = -1;
+    
+    double start = 0.0, 
+           end = 0.0;
+
+    /*----- Default values -----*/
+    unsigned int width = 1920,
+                 height = 1080,
+                 max_iterations = 10000;
+    fractal_params fractal = fractal_default();
+    const char *png_path = NULL;
+    int color_mode = COLOR_HISTOGRAM;
+    int autotune = AUTOTUNE_OFF;
+    
+    /*----- Start MPI environment -----*/
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    /**
+     * Arguments:
+     *
+     * - argv[1] -> NxM (grid), auto or auto:calibrate to choose it from the run profiles (required)
+     * - argv[2] -> NxM (screen resolution)(optional, has default value)
+     * - argv[3] -> N (number of iterations)(optional, has default value)
+     * - argv[4] -> fractal, e.g. mandelbrot, multibrot:3, julia:-0.8,0.156 or julia:0.3,0.5,4 (optional, has default value)
+     * - argv[5] -> output png (optional, no image without it)
+     * - argv[6] -> coloring, histogram, smooth or gray (optional, has default value)
+     * 
+     */
+
+    /*----- START Args parsing -----*/
+    if (argc == 1)
+    {
+        fprintf(stdout, ">> An input grid is required to run this program, for example 2x3, 3x2, 2x8, 4x4, 8x2 or auto\n");
+        MPI_Abort(MPI_COMM_WORLD, 3);
+    }
+
+    /** Grid **/
+    if (autotune_parse(argv[1], &autotune)) ok = 2;
+    else ok = sscanf( argv[1], "%dx%d", &num_groups_x, &num_groups_y);
+
+    if (ok != 2)
+    {
+        fprintf(stdout, ">> Something went wrong during grid parsing...\n");
+        MPI_Abort(MPI_COMM_WORLD, 5);
+    }
+
+    if (argc >= 3)
+    {   
+        /** Screen resolution **/
+        ok = sscanf( argv[2], "%dx%d", &width, &height);
+        if (ok != 2)
+        {
+            fprintf(stdout, ">> Something went wrong during image resolution parsing...\n");
+            MPI_Abort(MPI_COMM_WORLD, 6);
+        }
+    }
+
+    if (argc >= 4)
+    {   
+        /** Number of iterations **/
+        ok = sscanf( argv[3], "%d", &max_iterations);
+        if (ok != 1)
+        {
+            fprintf(stdout, ">> Something went wrong during max iterations parsing...\n");
+            MPI_Abort(MPI_COMM_WORLD, 7);
+        }
+    }
+
+    if (argc >= 5 && !fractal_parse(argv[4], &fractal))
+    {
+        fprintf(stdout, ">> Something went wrong during fractal parsing...\n");
+        MPI_Abort(MPI_COMM_WORLD, 9);
+    }
+
+    if (argc >= 6) png_path = argv[5];
+
+    if (argc >= 7 && !color_parse(argv[6], &color_mode))
+    {
+        fprintf(stdout, ">> Something went wrong during coloring parsing...\n");
+        MPI_Abort(MPI_COMM_WORLD, 10);
+    }
+
+    if (!autotune && num_groups_x * num_groups_y > size)
+    {
+        fprintf(stdout, ">> You need %d processes in a grid %s and you have %d processes...\n", num_groups_x * num_groups_y, argv[1], size);
+        MPI_Abort(MPI_COMM_WORLD, 8);
+    }
+    /*----- END Args parsing -----*/
+
+    /*----- Message MODEL -----*/
+    const int nitems = 4;
+    int blocklengths[4] = {1, 1, 1, 1};
+    MPI_Datatype types[4] = {MPI_UNSIGNED, MPI_UNSIGNED, MPI_UNSIGNED, MPI_UNSIGNED};
+    MPI_Datatype mpi_mandelbrot_params;
+    MPI_Aint offsets[4];
+
+    offsets[0] = offsetof(mandelbrot_params, start_x);
+    offsets[1] = offsetof(mandelbrot_params, start_y);
+    offsets[2] = offsetof(mandelbrot_params, size_x);
+    offsets[3] = offsetof(mandelbrot_params, size_y);
+
+    MPI_Type_create_struct(nitems, blocklengths, offsets, types, &mpi_mandelbrot_params);
+    MPI_Type_commit(&mpi_mandelbrot_params);
+    /*----- END Message MODEL -----*/
+
+    /*----- MPI TYPE -----*/
+    MPI_Datatype current_mpi_type = MPI_BYTE;
+
+    switch(sizeof(DATA_TYPE)) {
+        case 4 :
+            current_mpi_type = MPI_UNSIGNED;
+            break;
+        case 2 :
+            current_mpi_type = MPI_UNSIGNED_SHORT;
+            break;
+        default :
+            current_mpi_type = MPI_BYTE;
+    }
+    /*----- END MPI TYPE -----*/
+
+    /*----- Work map and configuration -----*/
+    run_profile run;
+    memset(&run, 0, sizeof(run));
+    strcpy(run.program, "SLB");
+    run.ranks = size;
+    run.width = width;
+    run.height = height;
+    run.max_iterations = max_iterations;
+    run.grid_x = num_groups_x;
+    run.grid_y = num_groups_y;
+    run.k = 1.0;
+
+    render_ctx ctx = {&fractal, mpi_mandelbrot_params, current_mpi_type, png_path, color_mode};
+
+    // manual runs skip the work map unless they are recorded
+    int profiled = profile_enabled(autotune);
+    work_map map = {0, 0, NULL, 0.0};
+    cost_model model = {0.0, 0.0, 0.0, 0};
+
+    MPI_Bcast(&profiled, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    if (profiled)
+    {
+        start = MPI_Wtime();
+        map = work_map_build(MPI_COMM_WORLD, &fractal, max_iterations, width, height);
+        end = MPI_Wtime();
+
+        model = autotune_configure(autotune, &map, &run, slb_features, slb_candidates, render_image, &ctx);
+    }
+
+    if (run.grid_x < 1)
+    {
+        if (rank == 0) fprintf(stdout, ">> No grid fits %d processes and a %ux%u image, choose one by hand...\n", size, width, height);
+        MPI_Abort(MPI_COMM_WORLD, 11);
     }
 
+    #if LOG
+        fprintf(stdout, ">> Process rank(%d) online - tot processes (%d)\n", rank, size);
+    #endif
+
+    if (rank == 0)
+    {       
+        fprintf(stdout, ">>> Starting SLB Algorithm...\n");
+        fprintf(stdout, ">>> num groups: %dx%d%s\n", run.grid_x, run.grid_y, autotune ? " (auto)" : "");
+        fprintf(stdout, ">>> image size: %dx%d\n", width, height);
+        fprintf(stdout, ">>> max iterations: %d\n", max_iterations);
+        fprintf(stdout, ">>> fractal: %d (d = %d, c = %f%+fi)\n", fractal.family, fractal.power, fractal.c_re, fractal.c_im);
+
+        if (profiled)
+        {
+            fprintf(stdout, ">>> work map: %ux%u in %f\n", map.width, map.height, end - start);
+            fprintf(stdout, ">>> cost model: %e s per iteration, %e s per tile, %f s (%d profiles)\n",
+                model.alpha, model.beta, model.gamma, model.samples);
+        }
+    }
+
+    render_image(&ctx, &run, 1);
+
+    if (profiled && rank == 0 && profile_append(&run) != 0)
+        fprintf(stdout, ">> Cannot write the run profile...\n");
+
+    work_map_free(&map);
+
+    /* counters of the kernels, with -DPERF_COUNTERS */
+    PERF_REPORT(MPI_COMM_WORLD);
+
     #if LOG
         fprintf(stdout, ">> Process rank(%d) exiting...\n", rank);
     #endif
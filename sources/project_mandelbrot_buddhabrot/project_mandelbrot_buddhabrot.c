@@ -0,0 +1,541 @@
+#include <stdlib.h>  // required by malloc
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>  // required by access
+#include <mpi.h>
+
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+#define LOG 0
+
+typedef unsigned short DATA_TYPE;
+
+#include "../fractal_kernels.h"
+#include "../fractal_png.h"
+
+/* side of the escape-time grid of the pre-pass over c in [-2, 2]^2 */
+#define PREPASS_SIZE 256
+#define PREPASS_MAX_ITERATIONS 2000
+/* smallest weight of a cell, keeps the sampling unbiased */
+#define SAMPLE_EPSILON 0.02
+/* samples handed to a thread at a time */
+#define SAMPLE_CHUNK 256
+/* the density is mapped on DENSITY_LEVELS gray levels for the png */
+#define DENSITY_LEVELS 1024
+/* the run stops after the current batch when this file exists */
+#define STOP_FILE "buddhabrot.stop"
+
+/**
+ * Orbit density (Buddhabrot) rendering.
+ *
+ * The orbits of random points c are traced and every point visited is
+ * accumulated in a density image: Buddhabrot keeps the orbits that
+ * escape, anti-Buddhabrot the ones that do not.
+ *
+ * - c is drawn from the cells of an escape-time pre-pass with a
+ *   probability proportional to their score (boundary cells and long
+ *   escapes for Buddhabrot, the set for anti-Buddhabrot), every sample
+ *   is weighted by 1 / probability so the image is unbiased
+ * - every thread accumulates in a private histogram (the writes are
+ *   random), the histograms are merged pixel by pixel with a pairwise
+ *   tree and then summed on rank 0 with MPI_Reduce
+ * - the samples come in batches, after each one rank 0 adds the batch to
+ *   the image and writes a snapshot, so the run can be stopped at any
+ *   time (batches, time budget or STOP_FILE)
+ */
+
+enum orbit_mode
+{
+    ORBIT_BUDDHABROT = 0,       /* orbits that escape */
+    ORBIT_ANTI = 1              /* orbits that do not escape */
+};
+
+typedef struct orbit_stats_s
+{
+    unsigned long long samples;
+    unsigned long long traced;      /* orbit points computed */
+    unsigned long long accumulated; /* orbit points added to the image */
+} orbit_stats;
+
+/*----- Random numbers -----*/
+
+uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+double random_unit(uint64_t *state)
+{
+    return (double) (splitmix64(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*----- Importance sampling -----*/
+
+typedef struct sampler_s
+{
+    double *cdf;            /* cumulative probability of the cells */
+    double *weight;         /* 1 / (probability * number of cells) of the samples of a cell */
+} sampler;
+
+/**
+ * Escape-time pre-pass on the corners of the cells and probability of
+ * every cell
+ */
+sampler sampler_build(int mode, unsigned int max_iterations)
+{
+    const unsigned int corners = PREPASS_SIZE + 1,
+                       iterations = (max_iterations < PREPASS_MAX_ITERATIONS) ? max_iterations : PREPASS_MAX_ITERATIONS;
+    const fractal_params domain = {FRACTAL_MANDELBROT, 2, 0.0, 0.0, -2.0, -2.0, 4.0, 4.0};
+    DATA_TYPE *grid = (DATA_TYPE*) malloc(sizeof(DATA_TYPE) * corners * corners);
+    double *score = (double*) malloc(sizeof(double) * PREPASS_SIZE * PREPASS_SIZE);
+    double total = 0.0;
+    sampler s;
+    long row;
+    unsigned int cell;
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (row = 0; row < (long) corners; ++row)
+    {
+        fractal_tile(&domain, grid + row * corners, 0, row, iterations, corners, 1, PREPASS_SIZE, PREPASS_SIZE);
+    }
+
+    for (cell = 0; cell != PREPASS_SIZE * PREPASS_SIZE; ++cell)
+    {
+        const unsigned int x = cell % PREPASS_SIZE,
+                           y = cell / PREPASS_SIZE;
+        const DATA_TYPE values[4] = {grid[y * corners + x], grid[y * corners + x + 1],
+                                     grid[(y + 1) * corners + x], grid[(y + 1) * corners + x + 1]};
+        unsigned int inside = 0, k;
+        double escape = 0.0;
+
+        for (k = 0; k != 4; ++k)
+        {
+            if (values[k] == iterations) ++inside;
+            else if (values[k] > escape) escape = values[k];
+        }
+
+        if (mode == ORBIT_ANTI) score[cell] = inside ? 1.0 : 0.0;
+        else if (inside == 4) score[cell] = 0.0;
+        else if (inside != 0) score[cell] = 1.0;
+        else score[cell] = escape / iterations;
+
+        if (score[cell] < SAMPLE_EPSILON) score[cell] = SAMPLE_EPSILON;
+        total += score[cell];
+    }
+
+    s.cdf = (double*) malloc(sizeof(double) * PREPASS_SIZE * PREPASS_SIZE);
+    s.weight = score;
+
+    for (cell = 0; cell != PREPASS_SIZE * PREPASS_SIZE; ++cell)
+    {
+        s.cdf[cell] = ((cell != 0) ? s.cdf[cell - 1] : 0.0) + score[cell] / total;
+        s.weight[cell] = total / (score[cell] * PREPASS_SIZE * PREPASS_SIZE);
+    }
+    s.cdf[PREPASS_SIZE * PREPASS_SIZE - 1] = 1.0;
+
+    free(grid);
+    return s;
+}
+
+/**
+ * Draw c, the cell by inversion of the cdf and a uniform point in it
+ * @return  weight of the sample
+ */
+double sampler_draw(const sampler *s, uint64_t *state, double *c_re, double *c_im)
+{
+    const double u = random_unit(state);
+    unsigned int low = 0,
+                 high = PREPASS_SIZE * PREPASS_SIZE - 1;
+
+    while (low < high)
+    {
+        const unsigned int mid = (low + high) / 2;
+
+        if (s->cdf[mid] < u) low = mid + 1;
+        else high = mid;
+    }
+
+    *c_re = -2.0 + 4.0 * ((low % PREPASS_SIZE) + random_unit(state)) / PREPASS_SIZE;
+    *c_im = -2.0 + 4.0 * ((low / PREPASS_SIZE) + random_unit(state)) / PREPASS_SIZE;
+    return s->weight[low];
+}
+
+void sampler_free(sampler *s)
+{
+    free(s->cdf);
+    free(s->weight);
+}
+
+/*----- Orbits -----*/
+
+typedef struct orbit_view_s
+{
+    unsigned int width;
+    unsigned int height;
+    double x_min;
+    double y_min;
+    double span_x;
+    double span_y;
+} orbit_view;
+
+/**
+ * Points of the main cardioid and of the period 2 bulb never escape
+ */
+int in_main_bulbs(double c_re, double c_im)
+{
+    const double q = (c_re - 0.25) * (c_re - 0.25) + c_im * c_im;
+
+    return q * (q + (c_re - 0.25)) <= 0.25 * c_im * c_im
+        || (c_re + 1.0) * (c_re + 1.0) + c_im * c_im <= 0.0625;
+}
+
+/**
+ * Trace the orbit of c and accumulate it when it is kept by the mode
+ * @param  orbit  work space, 2 * max_iterations values
+ */
+void trace_orbit(const orbit_view *view, int mode, unsigned int max_iterations,
+                 double c_re, double c_im, double weight,
+                 double *orbit, float *hist, orbit_stats *stats)
+{
+    double x = 0.0,
+           y = 0.0;
+    unsigned int it = 0, i;
+
+    ++stats->samples;
+
+    // without tracing: the bulbs are not in the Buddhabrot
+    if (mode == ORBIT_BUDDHABROT && in_main_bulbs(c_re, c_im)) return;
+
+    for (it = 0; it != max_iterations && x * x + y * y < 2*2; ++it)
+    {
+        const double tmp = x * x - y * y + c_re;
+        y = 2.0 * x * y + c_im;
+        x = tmp;
+
+        orbit[2 * it] = x;
+        orbit[2 * it + 1] = y;
+    }
+    stats->traced += it;
+
+    if ((it == max_iterations) != (mode == ORBIT_ANTI)) return;
+
+    for (i = 0; i != it; ++i)
+    {
+        const double px = (orbit[2 * i] - view->x_min) / view->span_x * view->width,
+                     py = (orbit[2 * i + 1] - view->y_min) / view->span_y * view->height;
+
+        if (px >= 0.0 && px < view->width && py >= 0.0 && py < view->height)
+        {
+            hist[(size_t) py * view->width + (size_t) px] += (float) weight;
+            ++stats->accumulated;
+        }
+    }
+}
+
+/**
+ * Sum the histograms of the threads in hist[0], pixel by pixel with a
+ * pairwise tree (log2(num_threads) levels, the pixels are split among
+ * the threads)
+ */
+void merge_histograms(float **hist, int num_threads, size_t size)
+{
+    long p;
+
+    #pragma omp parallel for schedule(static)
+    for (p = 0; p < (long) size; ++p)
+    {
+        int stride, t;
+
+        for (stride = 1; stride < num_threads; stride *= 2)
+        {
+            for (t = 0; t + stride < num_threads; t += 2 * stride) hist[t][p] += hist[t + stride][p];
+        }
+    }
+}
+
+/**
+ * Density to DENSITY_LEVELS levels (square root scale) for the png
+ */
+void density_levels(const double *density, DATA_TYPE *levels, size_t size)
+{
+    double max_density = 0.0;
+    size_t p;
+
+    for (p = 0; p != size; ++p)
+    {
+        if (density[p] > max_density) max_density = density[p];
+    }
+    if (max_density == 0.0) max_density = 1.0;
+
+    for (p = 0; p != size; ++p)
+    {
+        levels[p] = (DATA_TYPE) (sqrt(density[p] / max_density) * (DENSITY_LEVELS - 1));
+    }
+}
+
+int main (int argc, char** argv)
+{
+    int rank = -1,
+        size = -1,
+        ok = 0,
+        num_threads = 1,
+        stop = 0;
+
+    double start = 0.0,
+           batch_start = 0.0;
+
+    /*----- Default values -----*/
+    unsigned int width = 800,
+                 height = 600,
+                 max_iterations = 1000,
+                 num_batches = 10,
+                 batch = 0;
+    unsigned long long samples_per_batch = 1000000;
+    double time_budget = 0.0;
+    int mode = ORBIT_BUDDHABROT;
+    const char *png_path = NULL;
+
+    /*----- Start MPI environment -----*/
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    /**
+     * Arguments:
+     *
+     * - argv[1] -> NxM (image resolution)(optional, has default value)
+     * - argv[2] -> N (number of iterations)(optional, has default value)
+     * - argv[3] -> buddhabrot or anti (optional, has default value)
+     * - argv[4] -> N (samples per batch, on all the ranks)(optional, has default value)
+     * - argv[5] -> N (number of batches, 0 runs until STOP_FILE or the time budget)(optional, has default value)
+     * - argv[6] -> output png, written after every batch (optional, no image without it)
+     * - argv[7] -> N (time budget in seconds, 0 is no budget)(optional, has default value)
+     *
+     */
+
+    /*----- START Args parsing -----*/
+    if (argc >= 2)
+    {
+        /** Image resolution **/
+        ok = sscanf( argv[1], "%ux%u", &width, &height);
+        if (ok != 2 || width == 0 || height == 0)
+        {
+            fprintf(stdout, ">> Something went wrong during image resolution parsing...\n");
+            MPI_Abort(MPI_COMM_WORLD, 3);
+        }
+    }
+
+    if (argc >= 3)
+    {
+        /** Number of iterations **/
+        ok = sscanf( argv[2], "%u", &max_iterations);
+        if (ok != 1 || max_iterations == 0)
+        {
+            fprintf(stdout, ">> Something went wrong during max iterations parsing...\n");
+            MPI_Abort(MPI_COMM_WORLD, 4);
+        }
+    }
+
+    if (argc >= 4)
+    {
+        /** Mode **/
+        if (strcmp(argv[3], "buddhabrot") == 0) mode = ORBIT_BUDDHABROT;
+        else if (strcmp(argv[3], "anti") == 0) mode = ORBIT_ANTI;
+        else
+        {
+            fprintf(stdout, ">> The mode must be buddhabrot or anti...\n");
+            MPI_Abort(MPI_COMM_WORLD, 5);
+        }
+    }
+
+    if (argc >= 5)
+    {
+        /** Samples per batch **/
+        ok = sscanf( argv[4], "%llu", &samples_per_batch);
+        if (ok != 1 || samples_per_batch == 0)
+        {
+            fprintf(stdout, ">> Something went wrong during samples per batch parsing...\n");
+            MPI_Abort(MPI_COMM_WORLD, 6);
+        }
+    }
+
+    if (argc >= 6)
+    {
+        /** Batches **/
+        ok = sscanf( argv[5], "%u", &num_batches);
+        if (ok != 1)
+        {
+            fprintf(stdout, ">> Something went wrong during batches parsing...\n");
+            MPI_Abort(MPI_COMM_WORLD, 7);
+        }
+    }
+
+    if (argc >= 7) png_path = argv[6];
+
+    if (argc >= 8)
+    {
+        /** Time budget **/
+        ok = sscanf( argv[7], "%lf", &time_budget);
+        if (ok != 1 || time_budget < 0.0)
+        {
+            fprintf(stdout, ">> Something went wrong during time budget parsing...\n");
+            MPI_Abort(MPI_COMM_WORLD, 8);
+        }
+    }
+
+    if (num_batches == 0 && time_budget == 0.0 && rank == 0)
+    {
+        fprintf(stdout, ">> No batches and no time budget, create %s to stop...\n", STOP_FILE);
+    }
+    /*----- END Args parsing -----*/
+
+    #ifdef _OPENMP
+        num_threads = omp_get_max_threads();
+    #endif
+
+    // 4 units wide and centered in the origin
+    const orbit_view view = {width, height, -2.0, -2.0 * height / width, 4.0, 4.0 * height / width};
+    const size_t num_pixels = (size_t) width * height;
+    const unsigned long long rank_samples = samples_per_batch / size + ((unsigned long long) rank < samples_per_batch % size);
+
+    sampler s = sampler_build(mode, max_iterations);
+    float **hist = (float**) malloc(sizeof(float*) * num_threads);
+    float *batch_image = NULL;
+    double *density = NULL;
+    orbit_stats total = {0, 0, 0};
+    int t;
+
+    // zeroed here too, the runtime can give a parallel region less than num_threads threads
+    for (t = 0; t != num_threads; ++t) hist[t] = (float*) calloc(num_pixels, sizeof(float));
+
+    if (rank == 0)
+    {
+        batch_image = (float*) malloc(sizeof(float) * num_pixels);
+        density = (double*) calloc(num_pixels, sizeof(double));
+
+        fprintf(stdout, ">>> Starting %s rendering...\n", (mode == ORBIT_ANTI) ? "anti-Buddhabrot" : "Buddhabrot");
+        fprintf(stdout, ">>> image size: %ux%u\n", width, height);
+        fprintf(stdout, ">>> max iterations: %u\n", max_iterations);
+        fprintf(stdout, ">>> samples per batch: %llu\n", samples_per_batch);
+        fprintf(stdout, ">>> processes: %d, threads: %d\n", size, num_threads);
+    }
+
+    start = MPI_Wtime();
+
+    for (batch = 0; !stop; ++batch)
+    {
+        orbit_stats batch_stats = {0, 0, 0};
+        int active_threads = 1;
+
+        batch_start = MPI_Wtime();
+
+        /*----- Samples of the rank, every thread in its own histogram -----*/
+        #pragma omp parallel num_threads(num_threads)
+        {
+            int thread = 0;
+            double *orbit = (double*) malloc(sizeof(double) * 2 * max_iterations);
+            orbit_stats stats = {0, 0, 0};
+            uint64_t state;
+            long long i;
+
+            #ifdef _OPENMP
+                thread = omp_get_thread_num();
+                if (thread == 0) active_threads = omp_get_num_threads();
+            #endif
+
+            state = ((uint64_t) batch << 40) ^ ((uint64_t) rank << 20) ^ (uint64_t) thread;
+            splitmix64(&state);
+
+            memset(hist[thread], 0, sizeof(float) * num_pixels);
+
+            #pragma omp for schedule(dynamic, SAMPLE_CHUNK)
+            for (i = 0; i < (long long) rank_samples; ++i)
+            {
+                double c_re, c_im;
+                const double weight = sampler_draw(&s, &state, &c_re, &c_im);
+
+                trace_orbit(&view, mode, max_iterations, c_re, c_im, weight, orbit, hist[thread], &stats);
+            }
+
+            #pragma omp critical
+            {
+                batch_stats.samples += stats.samples;
+                batch_stats.traced += stats.traced;
+                batch_stats.accumulated += stats.accumulated;
+            }
+
+            free(orbit);
+        }
+
+        merge_histograms(hist, active_threads, num_pixels);
+
+        /*----- Batch on rank 0 -----*/
+        MPI_Reduce(hist[0], batch_image, (int) num_pixels, MPI_FLOAT, MPI_SUM, 0, MPI_COMM_WORLD);
+        MPI_Reduce(rank == 0 ? MPI_IN_PLACE : &batch_stats, &batch_stats, 3, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+
+        if (rank == 0)
+        {
+            const double elapsed = MPI_Wtime() - batch_start;
+            size_t p;
+
+            for (p = 0; p != num_pixels; ++p) density[p] += batch_image[p];
+
+            total.samples += batch_stats.samples;
+            total.traced += batch_stats.traced;
+            total.accumulated += batch_stats.accumulated;
+
+            fprintf(stdout, ">>> Batch %u: %llu samples, %.3e orbit points/s (%.3e accumulated/s), %f\n",
+                batch, batch_stats.samples, batch_stats.traced / elapsed, batch_stats.accumulated / elapsed, elapsed);
+
+            /*----- Snapshot -----*/
+            if (png_path != NULL)
+            {
+                DATA_TYPE *levels = (DATA_TYPE*) malloc(sizeof(DATA_TYPE) * num_pixels);
+
+                density_levels(density, levels, num_pixels);
+                if (fractal_write_png(png_path, levels, width, height, DENSITY_LEVELS, COLOR_GRAY, NULL) != 0)
+                    fprintf(stdout, ">> Cannot write %s...\n", png_path);
+                free(levels);
+            }
+
+            stop = (num_batches != 0 && batch + 1 == num_batches)
+                || (time_budget != 0.0 && MPI_Wtime() - start >= time_budget)
+                || access(STOP_FILE, F_OK) == 0;
+            fflush(stdout);
+        }
+
+        MPI_Bcast(&stop, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    }
+
+    if (rank == 0)
+    {
+        const double elapsed = MPI_Wtime() - start;
+
+        fprintf(stdout, ">>> Done!\n");
+        fprintf(stdout, ">>> Elapsed time is %f\n", elapsed);
+        fprintf(stdout, ">>> Samples: %llu, orbit points: %llu (%.3e/s), accumulated: %llu (%.3e/s)\n",
+            total.samples, total.traced, total.traced / elapsed, total.accumulated, total.accumulated / elapsed);
+        if (png_path != NULL) fprintf(stdout, ">>> Image written in %s\n", png_path);
+    }
+
+    /*----- CLEAN -----*/
+    for (t = 0; t != num_threads; ++t) free(hist[t]);
+    free(hist);
+    free(batch_image);
+    free(density);
+    sampler_free(&s);
+
+    #if LOG
+        fprintf(stdout, ">> Process rank(%d) exiting...\n", rank);
+    #endif
+
+    MPI_Finalize();
+    return 0;
+}
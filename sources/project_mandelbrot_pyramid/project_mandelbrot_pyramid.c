@@ -0,0 +1,547 @@
+#include <stdlib.h>  // required by malloc
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>  // required by offsetof
+#include <mpi.h>
+#include <zlib.h>
+#include "../mpi_task_farm.h"
+
+#define LOG 0
+
+typedef unsigned short DATA_TYPE;
+
+#include "../fractal_kernels.h"
+#include "../fractal_pyramid.h"
+
+/* side of the blocks filled when their border is inside the set */
+#define PYRAMID_BLOCK 16
+#define PYRAMID_COMPRESSION_LEVEL 1
+
+/**
+ * Quadtree pyramid of tiles generated level by level on the task farm.
+ *
+ * The pixels of a tile at level L + 1 with even coordinates are the
+ * pixels of its parent (the coordinates are the same up to a power of
+ * two, so the values are bit-identical) and the parent quadrant is sent
+ * with the task. A block of the child whose parent pixels are all in the
+ * set (max_iterations) only computes its border: if the whole border is
+ * in the set the block is filled, as in the Mariani-Silver algorithm
+ * (the filled sets have no holes; a filament thinner than the pixels of
+ * the border can still be missed, argv[6] = 0 computes every pixel).
+ *
+ * The tiles are compressed by the workers and appended by the master to
+ * the container (fractal_pyramid.h), the parents are read back from it.
+ */
+
+typedef struct pyramid_task_s
+{
+    unsigned int level;
+    unsigned int x;
+    unsigned int y;
+    unsigned int seeded;    /* a parent quadrant of (tile_size / 2)^2 values follows */
+} pyramid_task;
+
+typedef struct pyramid_result_s
+{
+    unsigned int computed;  /* pixels iterated */
+    unsigned int filled;    /* pixels of the blocks filled */
+} pyramid_result;
+
+/*----- Scheduler, the children of a parent in a row -----*/
+
+typedef struct pyramid_scheduler_s
+{
+    pyramid_file *pyramid;
+    unsigned int tile_size;
+    unsigned int level;
+    unsigned int parent;        /* next parent of the level, row-major */
+    unsigned int quadrant;      /* next child of the parent */
+    int reuse;
+    DATA_TYPE *parent_tile;
+} pyramid_scheduler;
+
+int pyramid_next_task(void *state, void *task, int worker)
+{
+    pyramid_scheduler *tiles = (pyramid_scheduler*) state;
+    pyramid_task *tile = (pyramid_task*) task;
+    DATA_TYPE *seed = (DATA_TYPE*) ((char*) task + sizeof(pyramid_task));
+    const unsigned int half = tiles->tile_size / 2;
+    unsigned int parent_x, parent_y, row;
+
+    (void) worker;
+
+    if (tiles->level == 0)
+    {
+        if (tiles->parent != 0) return 0;
+
+        tile->level = 0;
+        tile->x = 0;
+        tile->y = 0;
+        tile->seeded = 0;
+        tiles->parent = 1;
+        return 1;
+    }
+
+    if (tiles->parent == (1u << (2 * (tiles->level - 1)))) return 0;
+
+    parent_x = tiles->parent % (1u << (tiles->level - 1));
+    parent_y = tiles->parent / (1u << (tiles->level - 1));
+
+    tile->level = tiles->level;
+    tile->x = 2 * parent_x + tiles->quadrant % 2;
+    tile->y = 2 * parent_y + tiles->quadrant / 2;
+    tile->seeded = 0;
+
+    if (tiles->reuse)
+    {
+        if (tiles->quadrant == 0
+            && pyramid_read_tile(tiles->pyramid, tiles->level - 1, parent_x, parent_y, tiles->parent_tile) != 0)
+        {
+            fprintf(stdout, ">> Cannot read the tile (%u, %u, %u)...\n", tiles->level - 1, parent_x, parent_y);
+            MPI_Abort(MPI_COMM_WORLD, 11);
+        }
+
+        for (row = 0; row != half; ++row)
+        {
+            memcpy(seed + row * half,
+                   tiles->parent_tile + (tiles->quadrant / 2 * half + row) * tiles->tile_size + tiles->quadrant % 2 * half,
+                   sizeof(DATA_TYPE) * half);
+        }
+        tile->seeded = 1;
+    }
+
+    if (++tiles->quadrant == 4)
+    {
+        tiles->quadrant = 0;
+        ++tiles->parent;
+    }
+
+    return 1;
+}
+
+/*----- Master, tiles appended to the container -----*/
+
+typedef struct pyramid_ctx_s
+{
+    pyramid_file *pyramid;
+    unsigned long long computed;
+    unsigned long long filled;
+} pyramid_ctx;
+
+void store_tile(void *ctx, const void *task, const void *result, int count, int worker)
+{
+    pyramid_ctx *image = (pyramid_ctx*) ctx;
+    const pyramid_task *tile = (const pyramid_task*) task;
+    pyramid_result stats;
+
+    (void) worker;
+
+    memcpy(&stats, result, sizeof(pyramid_result));
+    image->computed += stats.computed;
+    image->filled += stats.filled;
+
+    if (pyramid_write_tile(image->pyramid, tile->level, tile->x, tile->y,
+                           (const char*) result + sizeof(pyramid_result), count - sizeof(pyramid_result)) != 0)
+    {
+        fprintf(stdout, ">> Cannot write the tile (%u, %u, %u)...\n", tile->level, tile->x, tile->y);
+        MPI_Abort(MPI_COMM_WORLD, 12);
+    }
+}
+
+/*----- Worker -----*/
+
+typedef struct worker_ctx_s
+{
+    const fractal_params *fractal;
+    unsigned int tile_size;
+    unsigned int max_iterations;
+    DATA_TYPE *tile;
+    unsigned char *candidate;   /* blocks whose parent pixels are in the set */
+    unsigned char *result_buf;
+    unsigned long result_size;
+    /* pixels to compute */
+    unsigned int *px;
+    unsigned int *py;
+    DATA_TYPE *values;
+    unsigned int num_points;
+} worker_ctx;
+
+/**
+ * Queue the pixel (x, y) of the tile
+ */
+void add_pixel(worker_ctx *worker, unsigned int x, unsigned int y)
+{
+    worker->px[worker->num_points] = x;
+    worker->py[worker->num_points] = y;
+    ++worker->num_points;
+}
+
+/**
+ * Compute the queued pixels (all the lanes are busy whatever their
+ * position) and write them in the tile
+ * @return  number of pixels computed
+ */
+unsigned int compute_pixels(worker_ctx *worker, const pyramid_task *tile)
+{
+    const unsigned int num_points = worker->num_points,
+                       img_size = worker->tile_size << tile->level;
+    unsigned int i;
+
+    for (i = 0; i != num_points; ++i)
+    {
+        worker->px[i] += tile->x * worker->tile_size;
+        worker->py[i] += tile->y * worker->tile_size;
+    }
+
+    fractal_pixels(worker->fractal, worker->values, worker->px, worker->py, num_points,
+                   worker->max_iterations, img_size, img_size);
+
+    for (i = 0; i != num_points; ++i)
+    {
+        worker->tile[(worker->py[i] - tile->y * worker->tile_size) * worker->tile_size
+                     + worker->px[i] - tile->x * worker->tile_size] = worker->values[i];
+    }
+
+    worker->num_points = 0;
+    return num_points;
+}
+
+/**
+ * The pixels with an odd row or column are not in the parent
+ */
+int is_unknown(unsigned int x, unsigned int y)
+{
+    return (x % 2) || (y % 2);
+}
+
+int is_border(unsigned int x, unsigned int y)
+{
+    return x % PYRAMID_BLOCK == 0 || x % PYRAMID_BLOCK == PYRAMID_BLOCK - 1
+        || y % PYRAMID_BLOCK == 0 || y % PYRAMID_BLOCK == PYRAMID_BLOCK - 1;
+}
+
+int compute_tile(void *ctx, const void *task, void **result)
+{
+    worker_ctx *worker = (worker_ctx*) ctx;
+    const pyramid_task *tile = (const pyramid_task*) task;
+    const DATA_TYPE *seed = (const DATA_TYPE*) ((const char*) task + sizeof(pyramid_task));
+    const DATA_TYPE inside = (DATA_TYPE) worker->max_iterations;
+    const unsigned int tile_size = worker->tile_size,
+                       half = tile_size / 2,
+                       num_blocks = tile_size / PYRAMID_BLOCK;
+    pyramid_result stats = {0, 0};
+    uLongf compressed_size = worker->result_size - sizeof(pyramid_result);
+    unsigned int x, y, block;
+
+    if (!tile->seeded)
+    {
+        fractal_tile(worker->fractal, worker->tile, tile->x * tile_size, tile->y * tile_size, worker->max_iterations,
+                     tile_size, tile_size, tile_size << tile->level, tile_size << tile->level);
+        stats.computed = tile_size * tile_size;
+    }
+    else
+    {
+        /*----- Pixels of the parent -----*/
+        for (y = 0; y != half; ++y)
+        {
+            for (x = 0; x != half; ++x) worker->tile[2 * y * tile_size + 2 * x] = seed[y * half + x];
+        }
+
+        /*----- Border of the blocks inside the set in the parent -----*/
+        for (block = 0; block != num_blocks * num_blocks; ++block)
+        {
+            const unsigned int bx = block % num_blocks * PYRAMID_BLOCK,
+                               by = block / num_blocks * PYRAMID_BLOCK;
+
+            worker->candidate[block] = 1;
+            for (y = by / 2; y != (by + PYRAMID_BLOCK) / 2 && worker->candidate[block]; ++y)
+            {
+                for (x = bx / 2; x != (bx + PYRAMID_BLOCK) / 2 && worker->candidate[block]; ++x)
+                    worker->candidate[block] = seed[y * half + x] == inside;
+            }
+
+            if (!worker->candidate[block]) continue;
+
+            for (y = by; y != by + PYRAMID_BLOCK; ++y)
+            {
+                for (x = bx; x != bx + PYRAMID_BLOCK; ++x)
+                {
+                    if (is_unknown(x, y) && is_border(x, y)) add_pixel(worker, x, y);
+                }
+            }
+        }
+
+        stats.computed += compute_pixels(worker, tile);
+
+        /*----- Fill the blocks with the border in the set, the others are computed -----*/
+        for (block = 0; block != num_blocks * num_blocks; ++block)
+        {
+            const unsigned int bx = block % num_blocks * PYRAMID_BLOCK,
+                               by = block / num_blocks * PYRAMID_BLOCK;
+            const int tested = worker->candidate[block];
+            int fill = tested;
+
+            for (y = by; y != by + PYRAMID_BLOCK && fill; ++y)
+            {
+                for (x = bx; x != bx + PYRAMID_BLOCK && fill; ++x)
+                {
+                    if (is_border(x, y)) fill = worker->tile[y * tile_size + x] == inside;
+                }
+            }
+
+            for (y = by; y != by + PYRAMID_BLOCK; ++y)
+            {
+                for (x = bx; x != bx + PYRAMID_BLOCK; ++x)
+                {
+                    // the parent pixels are known, the border of a tested block too
+                    if (!is_unknown(x, y) || (tested && is_border(x, y))) continue;
+
+                    if (fill)
+                    {
+                        worker->tile[y * tile_size + x] = inside;
+                        ++stats.filled;
+                    }
+                    else add_pixel(worker, x, y);
+                }
+            }
+        }
+
+        stats.computed += compute_pixels(worker, tile);
+    }
+
+    memcpy(worker->result_buf, &stats, sizeof(pyramid_result));
+
+    if (compress2(worker->result_buf + sizeof(pyramid_result), &compressed_size, (const Bytef*) worker->tile,
+                  sizeof(DATA_TYPE) * tile_size * tile_size, PYRAMID_COMPRESSION_LEVEL) != Z_OK)
+    {
+        fprintf(stdout, ">> Cannot compress the tile (%u, %u, %u)...\n", tile->level, tile->x, tile->y);
+        MPI_Abort(MPI_COMM_WORLD, 13);
+    }
+
+    *result = worker->result_buf;
+    return sizeof(pyramid_result) + compressed_size;
+}
+
+int main (int argc, char** argv)
+{
+    int rank = -1,
+        size = -1,
+        ok = 0;
+
+    double start = 0.0,
+           level_start = 0.0;
+
+    /*----- Default values -----*/
+    unsigned int levels = 5,
+                 tile_size = 256,
+                 max_iterations = 1000,
+                 level = 0;
+    int reuse = 1;
+    fractal_params fractal = fractal_default();
+    const char *output_path = "mandelbrot_pyramid.bin";
+
+    /*----- Start MPI environment -----*/
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    /**
+     * Arguments:
+     *
+     * - argv[1] -> N (number of levels)(optional, has default value)
+     * - argv[2] -> N (tile side in pixels, multiple of 16)(optional, has default value)
+     * - argv[3] -> N (number of iterations)(optional, has default value)
+     * - argv[4] -> fractal, e.g. mandelbrot, multibrot:3, julia:-0.8,0.156 (optional, has default value)
+     * - argv[5] -> output container (optional, has default value)
+     * - argv[6] -> 1 reuses the parent tiles, 0 computes every pixel (optional, has default value)
+     *
+     */
+
+    /*----- START Args parsing -----*/
+    if (argc >= 2)
+    {
+        /** Levels **/
+        ok = sscanf( argv[1], "%u", &levels);
+        if (ok != 1 || levels == 0 || levels > PYRAMID_MAX_LEVELS)
+        {
+            fprintf(stdout, ">> Something went wrong during levels parsing (1 to %d)...\n", PYRAMID_MAX_LEVELS);
+            MPI_Abort(MPI_COMM_WORLD, 3);
+        }
+    }
+
+    if (argc >= 3)
+    {
+        /** Tile size **/
+        ok = sscanf( argv[2], "%u", &tile_size);
+        if (ok != 1 || tile_size == 0 || tile_size % PYRAMID_BLOCK != 0 || tile_size > 4096)
+        {
+            fprintf(stdout, ">> The tile size must be a multiple of %d up to 4096...\n", PYRAMID_BLOCK);
+            MPI_Abort(MPI_COMM_WORLD, 4);
+        }
+    }
+
+    if (argc >= 4)
+    {
+        /** Number of iterations **/
+        ok = sscanf( argv[3], "%u", &max_iterations);
+        if (ok != 1 || max_iterations == 0 || max_iterations > 65535)
+        {
+            fprintf(stdout, ">> Something went wrong during max iterations parsing...\n");
+            MPI_Abort(MPI_COMM_WORLD, 5);
+        }
+    }
+
+    if (argc >= 5 && !fractal_parse(argv[4], &fractal))
+    {
+        fprintf(stdout, ">> Something went wrong during fractal parsing...\n");
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+
+    if (argc >= 6) output_path = argv[5];
+
+    if (argc >= 7 && (sscanf(argv[6], "%d", &reuse) != 1 || (reuse != 0 && reuse != 1)))
+    {
+        fprintf(stdout, ">> The reuse flag must be 0 or 1...\n");
+        MPI_Abort(MPI_COMM_WORLD, 7);
+    }
+
+    if (((unsigned long long) tile_size << (levels - 1)) > 0x7fffffffULL)
+    {
+        fprintf(stdout, ">> The last level is too large, use less levels or smaller tiles...\n");
+        MPI_Abort(MPI_COMM_WORLD, 8);
+    }
+
+    if (size < 2)
+    {
+        fprintf(stdout, ">> You need at least 2 processes and you have %d processes...\n", size);
+        MPI_Abort(MPI_COMM_WORLD, 9);
+    }
+    /*----- END Args parsing -----*/
+
+    /*----- Square view around the view of the fractal -----*/
+    {
+        const double side = (fractal.span_x > fractal.span_y) ? fractal.span_x : fractal.span_y;
+
+        fractal.x_min += (fractal.span_x - side) / 2;
+        fractal.y_min += (fractal.span_y - side) / 2;
+        fractal.span_x = side;
+        fractal.span_y = side;
+    }
+
+    /*----- Message MODEL -----*/
+    const size_t task_size = sizeof(pyramid_task) + sizeof(DATA_TYPE) * (tile_size / 2) * (tile_size / 2);
+    int blocklengths[2] = {4, (int) ((tile_size / 2) * (tile_size / 2))};
+    MPI_Datatype types[2] = {MPI_UNSIGNED, MPI_UNSIGNED_SHORT};
+    MPI_Datatype mpi_pyramid_task, mpi_pyramid_task_struct;
+    MPI_Aint offsets[2];
+
+    offsets[0] = offsetof(pyramid_task, level);
+    offsets[1] = sizeof(pyramid_task);
+
+    MPI_Type_create_struct(2, blocklengths, offsets, types, &mpi_pyramid_task_struct);
+    MPI_Type_create_resized(mpi_pyramid_task_struct, 0, task_size, &mpi_pyramid_task);
+    MPI_Type_commit(&mpi_pyramid_task);
+    MPI_Type_free(&mpi_pyramid_task_struct);
+    /*----- END Message MODEL -----*/
+
+    task_farm farm = task_farm_init(MPI_COMM_WORLD, size - 1, mpi_pyramid_task, task_size, MPI_BYTE, 1);
+
+    if (rank == 0)
+    {
+        pyramid_file pyramid;
+        pyramid_ctx image = {&pyramid, 0, 0};
+        pyramid_scheduler tiles;
+        task_scheduler scheduler = {pyramid_next_task, &tiles};
+        unsigned long long total = 0;
+
+        fprintf(stdout, ">>> Starting pyramid generation...\n");
+        fprintf(stdout, ">>> levels: %u\n", levels);
+        fprintf(stdout, ">>> tile size: %ux%u\n", tile_size, tile_size);
+        fprintf(stdout, ">>> max iterations: %u\n", max_iterations);
+        fprintf(stdout, ">>> fractal: %d (d = %d, c = %f%+fi)\n", fractal.family, fractal.power, fractal.c_re, fractal.c_im);
+        fprintf(stdout, ">>> parent reuse: %s\n", reuse ? "on" : "off");
+
+        if (pyramid_create(&pyramid, output_path, levels, tile_size, max_iterations, &fractal) != 0)
+        {
+            fprintf(stdout, ">> Cannot create %s...\n", output_path);
+            MPI_Abort(MPI_COMM_WORLD, 10);
+        }
+
+        memset(&tiles, 0, sizeof(tiles));
+        tiles.pyramid = &pyramid;
+        tiles.tile_size = tile_size;
+        tiles.reuse = reuse;
+        tiles.parent_tile = (DATA_TYPE*) malloc(sizeof(DATA_TYPE) * tile_size * tile_size);
+
+        start = MPI_Wtime();
+
+        for (level = 0; level != levels; ++level)
+        {
+            const unsigned long long level_pixels = ((unsigned long long) tile_size * tile_size) << (2 * level);
+            const unsigned long long computed = image.computed;
+
+            level_start = MPI_Wtime();
+
+            tiles.level = level;
+            tiles.parent = 0;
+            tiles.quadrant = 0;
+
+            task_farm_dispatch(&farm, &scheduler, store_tile, &image);
+
+            total += level_pixels;
+            fprintf(stdout, ">>> Level %u: %u tiles, %.1f%% of the pixels computed, %f\n", level, 1u << (2 * level),
+                100.0 * (image.computed - computed) / level_pixels, MPI_Wtime() - level_start);
+        }
+
+        task_farm_stop(&farm);
+
+        if (pyramid_close(&pyramid, 1) != 0) fprintf(stdout, ">> Cannot write %s...\n", output_path);
+
+        fprintf(stdout, ">>> Done!\n");
+        fprintf(stdout, ">>> Elapsed time is %f\n", MPI_Wtime() - start);
+        fprintf(stdout, ">>> Pixels: %llu, computed %llu (%.1f%%), filled %llu\n", total, image.computed,
+            100.0 * image.computed / total, image.filled);
+        fprintf(stdout, ">>> Pyramid written in %s\n", output_path);
+
+        /*----- CLEAN -----*/
+        free(tiles.parent_tile);
+    }
+    else
+    {
+        worker_ctx worker;
+
+        memset(&worker, 0, sizeof(worker));
+        worker.fractal = &fractal;
+        worker.tile_size = tile_size;
+        worker.max_iterations = max_iterations;
+        worker.tile = (DATA_TYPE*) malloc(sizeof(DATA_TYPE) * tile_size * tile_size);
+        worker.candidate = (unsigned char*) malloc((tile_size / PYRAMID_BLOCK) * (tile_size / PYRAMID_BLOCK));
+        worker.px = (unsigned int*) malloc(sizeof(unsigned int) * tile_size * tile_size);
+        worker.py = (unsigned int*) malloc(sizeof(unsigned int) * tile_size * tile_size);
+        worker.values = (DATA_TYPE*) malloc(sizeof(DATA_TYPE) * tile_size * tile_size);
+        worker.result_size = sizeof(pyramid_result) + compressBound(sizeof(DATA_TYPE) * tile_size * tile_size);
+        worker.result_buf = (unsigned char*) malloc(worker.result_size);
+
+        task_farm_worker(&farm, compute_tile, &worker);
+
+        /*----- CLEAN -----*/
+        free(worker.tile);
+        free(worker.candidate);
+        free(worker.px);
+        free(worker.py);
+        free(worker.values);
+        free(worker.result_buf);
+    }
+
+    MPI_Type_free(&mpi_pyramid_task);
+
+    /* counters of the kernels, with -DPERF_COUNTERS */
+    PERF_REPORT(MPI_COMM_WORLD);
+
+    #if LOG
+        fprintf(stdout, ">> Process rank(%d) exiting...\n", rank);
+    #endif
+
+    MPI_Finalize();
+    return 0;
+}
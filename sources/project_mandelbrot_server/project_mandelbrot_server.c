@@ -0,0 +1,636 @@
+#include <stdlib.h>  // required by malloc
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>  // required by va_list
+#include <stddef.h>  // required by offsetof
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <mpi.h>
+#include "../mpi_task_farm.h"
+
+#define LOG 0
+
+typedef unsigned short DATA_TYPE;
+
+#include "../fractal_kernels.h"
+
+/* side of the square tiles sent to the workers */
+#define TILE_SIZE 64
+/* the preview frame is PREVIEW_FACTOR times smaller on each side */
+#define PREVIEW_FACTOR 4
+#define NUM_LEVELS 2
+#define LINE_SIZE 512
+
+/* largest frame of a request, the iterations have to fit DATA_TYPE */
+#define MAX_SIDE 16384
+#define MAX_PIXELS ((size_t) 1 << 26)
+#define MAX_ITERATIONS 65535
+
+/**
+ * Persistent render server: the workers stay in the task farm between
+ * requests and rank 0 serves a local Unix socket.
+ *
+ * Requests are text lines:
+ *
+ *   RENDER <id> <W>x<H> <iterations> [fractal] [x_min,y_min,span_x,span_y]
+ *              (W, H up to MAX_SIDE and MAX_PIXELS, iterations up to MAX_ITERATIONS)
+ *   QUIT       (close the connection)
+ *   SHUTDOWN   (stop the server)
+ *
+ * Every render answers with a coarse frame (level 0) and the full frame
+ * (level 1). When the size is a multiple of PREVIEW_FACTOR the pixels of
+ * the coarse frame are pixels of the full one (same coordinates up to a
+ * power of two, bit-identical values) and are not computed again:
+ *
+ *   FRAME <id> <level> <W>x<H> <bytes>\n  followed by W*H native DATA_TYPE
+ *   DONE <id> <seconds>\n
+ *
+ * A new request that arrives during a render replaces it: no more tiles
+ * are handed out, the ones in flight are dropped and the server answers
+ * CANCELLED <id>. A bad request, or a frame that does not fit the
+ * memory, is answered with ERROR.
+ */
+
+typedef struct render_task_s
+{
+    unsigned int job;
+    unsigned int start_x;
+    unsigned int start_y;
+    unsigned int size_x;
+    unsigned int size_y;
+    unsigned int width;
+    unsigned int height;
+    unsigned int max_iterations;
+    unsigned int seeded;            /* the pixels on the preview grid come from the preview */
+    fractal_params fractal;
+} render_task;
+
+typedef struct render_request_s
+{
+    unsigned int id;
+    unsigned int width;
+    unsigned int height;
+    unsigned int max_iterations;
+    fractal_params fractal;
+} render_request;
+
+/*----- Client connection -----*/
+
+typedef struct client_conn_s
+{
+    int fd;
+    char buffer[LINE_SIZE];
+    size_t length;
+    int closed;
+} client_conn;
+
+/**
+ * Read what is available on the connection
+ * @param  timeout  poll timeout in ms (-1 waits)
+ */
+void client_fill(client_conn *client, int timeout)
+{
+    struct pollfd pfd;
+    ssize_t num_read;
+
+    if (client->closed || client->length == LINE_SIZE) return;
+
+    pfd.fd = client->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, timeout) <= 0) return;
+
+    num_read = recv(client->fd, client->buffer + client->length, LINE_SIZE - client->length, 0);
+    if (num_read <= 0) client->closed = 1;
+    else client->length += num_read;
+}
+
+/**
+ * Extract a complete line (without the newline)
+ * @return  1 when a line was available, 0 otherwise
+ */
+int client_line(client_conn *client, char *line)
+{
+    char *end = (char*) memchr(client->buffer, '\n', client->length);
+    size_t size;
+
+    if (end == NULL)
+    {
+        // a line longer than the buffer is dropped
+        if (client->length == LINE_SIZE) client->length = 0;
+        return 0;
+    }
+
+    size = end - client->buffer;
+    memcpy(line, client->buffer, size);
+    line[size] = '\0';
+    if (size > 0 && line[size - 1] == '\r') line[size - 1] = '\0';
+
+    client->length -= size + 1;
+    memmove(client->buffer, end + 1, client->length);
+    return 1;
+}
+
+int client_send(client_conn *client, const void *data, size_t size)
+{
+    const char *bytes = (const char*) data;
+
+    while (size != 0 && !client->closed)
+    {
+        ssize_t num_sent = send(client->fd, bytes, size, MSG_NOSIGNAL);
+
+        if (num_sent < 0)
+        {
+            if (errno == EINTR) continue;
+            client->closed = 1;
+        }
+        else
+        {
+            bytes += num_sent;
+            size -= num_sent;
+        }
+    }
+
+    return client->closed ? -1 : 0;
+}
+
+int client_printf(client_conn *client, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+int client_printf(client_conn *client, const char *format, ...)
+{
+    char line[LINE_SIZE];
+    va_list args;
+    int size;
+
+    va_start(args, format);
+    size = vsnprintf(line, LINE_SIZE, format, args);
+    va_end(args);
+
+    return client_send(client, line, (size < LINE_SIZE) ? (size_t) size : LINE_SIZE - 1);
+}
+
+/*----- Requests -----*/
+
+enum request_kind
+{
+    REQUEST_NONE = 0,
+    REQUEST_RENDER,
+    REQUEST_QUIT,
+    REQUEST_SHUTDOWN,
+    REQUEST_INVALID
+};
+
+/**
+ * Parse a request line
+ * @return  the request_kind
+ */
+int parse_request(const char *line, render_request *request)
+{
+    char command[16], fractal[128], view[128];
+    int num_fields = 0;
+
+    fractal[0] = '\0';
+    view[0] = '\0';
+
+    if (sscanf(line, "%15s", command) != 1) return REQUEST_INVALID;
+    if (strcmp(command, "QUIT") == 0) return REQUEST_QUIT;
+    if (strcmp(command, "SHUTDOWN") == 0) return REQUEST_SHUTDOWN;
+    if (strcmp(command, "RENDER") != 0) return REQUEST_INVALID;
+
+    num_fields = sscanf(line, "%*s %u %ux%u %u %127s %127s", &request->id, &request->width, &request->height,
+                        &request->max_iterations, fractal, view);
+
+    if (num_fields < 4 || request->width == 0 || request->height == 0 || request->max_iterations == 0)
+        return REQUEST_INVALID;
+
+    // one line must not be able to exhaust the memory of rank 0 or wrap the counters
+    if (request->width > MAX_SIDE || request->height > MAX_SIDE
+        || (size_t) request->width * (size_t) request->height > MAX_PIXELS
+        || request->max_iterations > MAX_ITERATIONS)
+        return REQUEST_INVALID;
+
+    request->fractal = fractal_default();
+    if (num_fields >= 5 && !fractal_parse(fractal, &request->fractal)) return REQUEST_INVALID;
+
+    if (num_fields >= 6 && sscanf(view, "%lf,%lf,%lf,%lf", &request->fractal.x_min, &request->fractal.y_min,
+                                  &request->fractal.span_x, &request->fractal.span_y) != 4)
+        return REQUEST_INVALID;
+
+    return REQUEST_RENDER;
+}
+
+/*----- Frame scheduler, stops when a new request arrives -----*/
+
+typedef struct frame_ctx_s
+{
+    /* tiles */
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+    const render_request *request;
+    /* image */
+    DATA_TYPE *image;
+    const DATA_TYPE *preview;       /* coarse frame seeding this one, NULL otherwise */
+    unsigned int preview_width;
+    /* client */
+    client_conn *client;
+    int next_kind;                  /* request that interrupted the frame */
+    render_request next_request;
+} frame_ctx;
+
+int frame_next_task(void *state, void *task, int worker)
+{
+    frame_ctx *frame = (frame_ctx*) state;
+    render_task *tile = (render_task*) task;
+    char line[LINE_SIZE];
+
+    (void) worker;
+
+    if (frame->next_kind != REQUEST_NONE) return 0;
+
+    /*----- Cancellation -----*/
+    client_fill(frame->client, 0);
+    while (client_line(frame->client, line))
+    {
+        frame->next_kind = parse_request(line, &frame->next_request);
+        if (frame->next_kind != REQUEST_INVALID) return 0;
+
+        client_printf(frame->client, "ERROR invalid request\n");
+        frame->next_kind = REQUEST_NONE;
+    }
+    if (frame->client->closed)
+    {
+        frame->next_kind = REQUEST_QUIT;
+        return 0;
+    }
+
+    if (frame->y >= frame->height) return 0;
+
+    tile->job = frame->request->id;
+    tile->start_x = frame->x;
+    tile->start_y = frame->y;
+    tile->size_x = (frame->x + TILE_SIZE > frame->width) ? frame->width - frame->x : TILE_SIZE;
+    tile->size_y = (frame->y + TILE_SIZE > frame->height) ? frame->height - frame->y : TILE_SIZE;
+    tile->width = frame->width;
+    tile->height = frame->height;
+    tile->max_iterations = frame->request->max_iterations;
+    tile->seeded = (frame->preview != NULL);
+    tile->fractal = frame->request->fractal;
+
+    frame->x += TILE_SIZE;
+    if (frame->x >= frame->width)
+    {
+        frame->x = 0;
+        frame->y += TILE_SIZE;
+    }
+
+    return 1;
+}
+
+/**
+ * Copy a tile in the frame (tiles of a cancelled frame are dropped)
+ */
+void frame_store_tile(void *ctx, const void *task, const void *result, int count, int worker)
+{
+    frame_ctx *frame = (frame_ctx*) ctx;
+    const render_task *tile = (const render_task*) task;
+    const DATA_TYPE *buffer = (const DATA_TYPE*) result;
+    unsigned int row = 0,
+                 x = 0;
+
+    (void) count;
+    (void) worker;
+
+    if (frame->next_kind != REQUEST_NONE) return;
+
+    for (row = 0; row != tile->size_y; ++row)
+    {
+        DATA_TYPE *line = frame->image + tile->start_x + (tile->start_y + row) * frame->width;
+
+        memcpy(line, buffer + row * tile->size_x, sizeof(DATA_TYPE) * tile->size_x);
+
+        // the tiles start on the preview grid (TILE_SIZE is a multiple of PREVIEW_FACTOR)
+        if (!tile->seeded || (tile->start_y + row) % PREVIEW_FACTOR != 0) continue;
+
+        for (x = 0; x < tile->size_x; x += PREVIEW_FACTOR)
+        {
+            line[x] = frame->preview[(tile->start_x + x) / PREVIEW_FACTOR
+                                     + (tile->start_y + row) / PREVIEW_FACTOR * frame->preview_width];
+        }
+    }
+}
+
+/*----- Worker -----*/
+
+typedef struct worker_ctx_s
+{
+    DATA_TYPE *result_buf;
+    unsigned int result_size;
+    /* pixels of a seeded tile to compute */
+    unsigned int px[TILE_SIZE * TILE_SIZE];
+    unsigned int py[TILE_SIZE * TILE_SIZE];
+    DATA_TYPE values[TILE_SIZE * TILE_SIZE];
+} worker_ctx;
+
+/**
+ * Compute a tile, without the pixels on the preview grid when it is
+ * seeded (the master fills them)
+ */
+int compute_tile(void *ctx, const void *task, void **result)
+{
+    worker_ctx *worker = (worker_ctx*) ctx;
+    const render_task *tile = (const render_task*) task;
+    unsigned int num_elms = tile->size_x * tile->size_y,
+                 num_points = 0,
+                 x = 0,
+                 y = 0,
+                 i = 0;
+
+    if (num_elms > worker->result_size)
+    {
+        worker->result_buf = (DATA_TYPE*) realloc(worker->result_buf, sizeof(DATA_TYPE) * num_elms);
+        worker->result_size = num_elms;
+    }
+
+    if (!tile->seeded)
+    {
+        fractal_tile(&tile->fractal, worker->result_buf, tile->start_x, tile->start_y, tile->max_iterations,
+                     tile->size_x, tile->size_y, tile->width, tile->height);
+    }
+    else
+    {
+        for (y = 0; y != tile->size_y; ++y)
+        {
+            for (x = 0; x != tile->size_x; ++x)
+            {
+                if (x % PREVIEW_FACTOR == 0 && y % PREVIEW_FACTOR == 0) continue;
+                worker->px[num_points] = tile->start_x + x;
+                worker->py[num_points] = tile->start_y + y;
+                ++num_points;
+            }
+        }
+
+        fractal_pixels(&tile->fractal, worker->values, worker->px, worker->py, num_points,
+                       tile->max_iterations, tile->width, tile->height);
+
+        for (i = 0; i != num_points; ++i)
+        {
+            worker->result_buf[(worker->py[i] - tile->start_y) * tile->size_x + worker->px[i] - tile->start_x]
+                = worker->values[i];
+        }
+    }
+
+    *result = worker->result_buf;
+    return num_elms;
+}
+
+/*----- Server -----*/
+
+/**
+ * Render a request level by level on the warm workers
+ * @return  the request that interrupted it, REQUEST_NONE when complete
+ */
+int serve_render(const task_farm *farm, client_conn *client, const render_request *request,
+                 render_request *next_request)
+{
+    frame_ctx frame;
+    task_scheduler scheduler = {frame_next_task, &frame};
+    DATA_TYPE *image = (DATA_TYPE*) malloc(sizeof(DATA_TYPE) * (size_t) request->width * request->height),
+              *preview = NULL;
+    double start = MPI_Wtime();
+    int level;
+
+    // the preview has its own buffer, the full frame reuses its pixels
+    if (image != NULL && request->width % PREVIEW_FACTOR == 0 && request->height % PREVIEW_FACTOR == 0)
+        preview = (DATA_TYPE*) malloc(sizeof(DATA_TYPE) * (size_t) (request->width / PREVIEW_FACTOR)
+                                      * (request->height / PREVIEW_FACTOR));
+
+    if (image == NULL)
+    {
+        client_printf(client, "ERROR out of memory\n");
+        return REQUEST_NONE;
+    }
+
+    memset(&frame, 0, sizeof(frame));
+    frame.request = request;
+    frame.client = client;
+    frame.next_kind = REQUEST_NONE;
+
+    for (level = 0; level != NUM_LEVELS && frame.next_kind == REQUEST_NONE; ++level)
+    {
+        const unsigned int factor = (level == NUM_LEVELS - 1) ? 1 : PREVIEW_FACTOR;
+
+        frame.x = 0;
+        frame.y = 0;
+        frame.width = (request->width / factor > 0) ? request->width / factor : 1;
+        frame.height = (request->height / factor > 0) ? request->height / factor : 1;
+        frame.image = (level == 0 && preview != NULL) ? preview : image;
+        frame.preview = (level != 0 && preview != NULL) ? preview : NULL;
+        frame.preview_width = request->width / PREVIEW_FACTOR;
+
+        task_farm_dispatch(farm, &scheduler, frame_store_tile, &frame);
+
+        if (frame.next_kind == REQUEST_NONE)
+        {
+            const size_t size = sizeof(DATA_TYPE) * frame.width * frame.height;
+
+            client_printf(client, "FRAME %u %d %ux%u %zu\n", request->id, level, frame.width, frame.height, size);
+            client_send(client, frame.image, size);
+        }
+    }
+
+    if (frame.next_kind == REQUEST_NONE)
+    {
+        client_printf(client, "DONE %u %f\n", request->id, MPI_Wtime() - start);
+    }
+    else
+    {
+        client_printf(client, "CANCELLED %u\n", request->id);
+        *next_request = frame.next_request;
+    }
+
+    #if LOG
+        fprintf(stdout, ">>> Request %u %s in %f\n", request->id,
+            (frame.next_kind == REQUEST_NONE) ? "done" : "cancelled", MPI_Wtime() - start);
+    #endif
+
+    free(preview);
+    free(image);
+    return frame.next_kind;
+}
+
+/**
+ * Serve a client until it quits
+ * @return  1 when the server has to stop
+ */
+int serve_client(const task_farm *farm, client_conn *client)
+{
+    render_request request, next_request;
+    char line[LINE_SIZE];
+    int kind = REQUEST_NONE;
+
+    while (!client->closed)
+    {
+        if (kind == REQUEST_NONE)
+        {
+            if (!client_line(client, line))
+            {
+                client_fill(client, -1);
+                continue;
+            }
+            kind = parse_request(line, &request);
+        }
+
+        switch (kind) {
+            case REQUEST_RENDER :
+                kind = serve_render(farm, client, &request, &next_request);
+                if (kind != REQUEST_NONE) request = next_request;
+                break;
+            case REQUEST_QUIT :
+                client_printf(client, "BYE\n");
+                return 0;
+            case REQUEST_SHUTDOWN :
+                client_printf(client, "BYE\n");
+                return 1;
+            default :
+                client_printf(client, "ERROR invalid request\n");
+                kind = REQUEST_NONE;
+        }
+    }
+
+    return 0;
+}
+
+int main (int argc, char** argv)
+{
+    int rank = -1,
+        size = -1;
+
+    /*----- Default values -----*/
+    const char *socket_path = "/tmp/mandelbrot_server.sock";
+
+    /*----- Start MPI environment -----*/
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    /**
+     * Arguments:
+     *
+     * - argv[1] -> path of the Unix socket (optional, has default value)
+     *
+     */
+
+    /*----- START Args parsing -----*/
+    if (argc >= 2) socket_path = argv[1];
+
+    if (strlen(socket_path) >= sizeof(((struct sockaddr_un*) 0)->sun_path))
+    {
+        fprintf(stdout, ">> The socket path is too long...\n");
+        MPI_Abort(MPI_COMM_WORLD, 5);
+    }
+
+    if (size < 2)
+    {
+        fprintf(stdout, ">> You need at least 2 processes and you have %d processes...\n", size);
+        MPI_Abort(MPI_COMM_WORLD, 6);
+    }
+    /*----- END Args parsing -----*/
+
+    /*----- Message MODEL -----*/
+    int blocklengths[3] = {9, 2, 6};
+    MPI_Datatype types[3] = {MPI_UNSIGNED, MPI_INT, MPI_DOUBLE};
+    MPI_Datatype mpi_render_task, mpi_render_task_struct;
+    MPI_Aint offsets[3];
+
+    offsets[0] = offsetof(render_task, job);
+    offsets[1] = offsetof(render_task, fractal) + offsetof(fractal_params, family);
+    offsets[2] = offsetof(render_task, fractal) + offsetof(fractal_params, c_re);
+
+    MPI_Type_create_struct(3, blocklengths, offsets, types, &mpi_render_task_struct);
+    MPI_Type_create_resized(mpi_render_task_struct, 0, sizeof(render_task), &mpi_render_task);
+    MPI_Type_commit(&mpi_render_task);
+    MPI_Type_free(&mpi_render_task_struct);
+    /*----- END Message MODEL -----*/
+
+    task_farm farm = task_farm_init(MPI_COMM_WORLD, size - 1,
+                                    mpi_render_task, sizeof(render_task),
+                                    MPI_UNSIGNED_SHORT, sizeof(DATA_TYPE));
+
+    if (rank == 0)
+    {
+        struct sockaddr_un address;
+        int server_fd = socket(AF_UNIX, SOCK_STREAM, 0),
+            stop = 0;
+
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, socket_path);
+        unlink(socket_path);
+
+        if (server_fd < 0
+            || bind(server_fd, (struct sockaddr*) &address, sizeof(address)) != 0
+            || listen(server_fd, 4) != 0)
+        {
+            fprintf(stdout, ">> Cannot listen on %s...\n", socket_path);
+            MPI_Abort(MPI_COMM_WORLD, 7);
+        }
+
+        fprintf(stdout, ">>> Render server listening on %s\n", socket_path);
+        fprintf(stdout, ">>> workers: %d\n", farm.num_workers);
+        fflush(stdout);
+
+        while (!stop)
+        {
+            client_conn client;
+
+            memset(&client, 0, sizeof(client));
+            client.fd = accept(server_fd, NULL, NULL);
+            if (client.fd < 0)
+            {
+                if (errno == EINTR) continue;
+                break;
+            }
+
+            #if LOG
+                fprintf(stdout, ">>> Client connected\n");
+            #endif
+
+            stop = serve_client(&farm, &client);
+            close(client.fd);
+        }
+
+        /*----- CLEAN -----*/
+        close(server_fd);
+        unlink(socket_path);
+        task_farm_stop(&farm);
+
+        fprintf(stdout, ">>> Render server stopped\n");
+    }
+    else
+    {
+        worker_ctx worker;
+
+        memset(&worker, 0, sizeof(worker));
+
+        task_farm_worker(&farm, compute_tile, &worker);
+
+        /*----- CLEAN -----*/
+        free(worker.result_buf);
+    }
+
+    MPI_Type_free(&mpi_render_task);
+
+    #if LOG
+        fprintf(stdout, ">> Process rank(%d) exiting...\n", rank);
+    #endif
+
+    MPI_Finalize();
+    return 0;
+}
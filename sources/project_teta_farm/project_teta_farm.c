@@ -0,0 +1,306 @@
+#include <stdlib.h>  // required by malloc
+#include <string.h>
+#include <stdio.h>
+#include <mpi.h>
+#include "../tetaQuad.h"
+#include "../mpi_task_farm.h"
+
+#define LOG 0
+
+/* smallest number of (b, E) points in a task */
+#define MIN_CHUNK 8
+
+/**
+ * Distributed sweep of the deflection function theta(b, E) on a grid
+ * of NxM points (N values of b, M values of E) spread over the ranks
+ * with the task farm. Every task is a range of points, computed with
+ * integral_to_infinite_batch_potential (threads inside the rank when
+ * compiled with OpenMP).
+ */
+
+typedef struct sweep_grid_s
+{
+    unsigned int num_b;
+    unsigned int num_e;
+    double b_min;
+    double b_max;
+    double e_min;
+    double e_max;
+} sweep_grid;
+
+void grid_point(const sweep_grid *grid, unsigned long index, double *b, double *E)
+{
+    const unsigned int ib = index % grid->num_b,
+                       ie = index / grid->num_b;
+
+    *b = (grid->num_b > 1) ? grid->b_min + (grid->b_max - grid->b_min) * ib / (grid->num_b - 1) : grid->b_min;
+    *E = (grid->num_e > 1) ? grid->e_min + (grid->e_max - grid->e_min) * ie / (grid->num_e - 1) : grid->e_min;
+}
+
+/**
+ * Parse the potential: coulomb[:k], lj[:epsilon,sigma], repulsive[:C,n], morse[:D,r_e,alpha]
+ * @return  1 on success, 0 otherwise
+ */
+int parse_potential(const char *arg, potential_params *pot)
+{
+    char name[32];
+    double p1 = 1.0, p2 = 1.0, p3 = 1.0;
+    int ok = sscanf(arg, "%31[a-z]:%lf,%lf,%lf", name, &p1, &p2, &p3);
+
+    if (ok < 1) return 0;
+
+    if (strcmp(name, "coulomb") == 0) {
+        pot->kind = POTENTIAL_COULOMB;
+        pot->strength = p1;
+        pot->range = 0.0;
+        pot->exponent = 0.0;
+    }
+    else if (strcmp(name, "lj") == 0) {
+        pot->kind = POTENTIAL_LENNARD_JONES;
+        pot->strength = p1;
+        pot->range = p2;
+        pot->exponent = 0.0;
+    }
+    else if (strcmp(name, "repulsive") == 0) {
+        pot->kind = POTENTIAL_REPULSIVE;
+        pot->strength = p1;
+        pot->range = 0.0;
+        pot->exponent = (ok >= 3) ? p2 : 4.0;
+    }
+    else if (strcmp(name, "morse") == 0) {
+        pot->kind = POTENTIAL_MORSE;
+        pot->strength = p1;
+        pot->range = p2;
+        pot->exponent = p3;
+    }
+    else return 0;
+
+    return 1;
+}
+
+/*----- Master and worker handlers -----*/
+
+/**
+ * Copy the angles of a range in the final array
+ */
+void store_range(void *ctx, const void *task, const void *result, int count, int worker)
+{
+    double *theta = (double*) ctx;
+    const farm_range *range = (const farm_range*) task;
+
+    memcpy(theta + range->first, result, sizeof(double) * count);
+
+    #if LOG
+        fprintf(stdout, ">>> Received %d points [%lu, %lu) from process %d\n",
+            count, range->first, range->first + range->count, worker);
+    #else
+        (void) worker;
+    #endif
+}
+
+typedef struct worker_ctx_s
+{
+    const sweep_grid *grid;
+    const potential_params *pot;
+    double *b;
+    double *E;
+    double *theta;
+    unsigned long size;
+} worker_ctx;
+
+/**
+ * Integrate the points of a range on a worker, result in degrees
+ */
+int compute_range(void *ctx, const void *task, void **result)
+{
+    worker_ctx *worker = (worker_ctx*) ctx;
+    const farm_range *range = (const farm_range*) task;
+    unsigned long i;
+
+    if (range->count > worker->size)
+    {
+        worker->b = (double*) realloc(worker->b, sizeof(double) * range->count);
+        worker->E = (double*) realloc(worker->E, sizeof(double) * range->count);
+        worker->theta = (double*) realloc(worker->theta, sizeof(double) * range->count);
+        worker->size = range->count;
+    }
+
+    for (i = 0; i != range->count; ++i)
+    {
+        grid_point(worker->grid, range->first + i, &worker->b[i], &worker->E[i]);
+    }
+
+    integral_to_infinite_batch_potential(worker->pot, 0.0, worker->b, worker->E, worker->theta, range->count);
+
+    for (i = 0; i != range->count; ++i)
+    {
+        worker->theta[i] = to_degrees(fabs(worker->theta[i]));
+    }
+
+    *result = worker->theta;
+    return (int) range->count;
+}
+
+int main (int argc, char** argv)
+{
+    int rank = -1,
+        size = -1,
+        ok = 0;
+
+    double start = 0.0,
+           end = 0.0;
+
+    /*----- Default values -----*/
+    sweep_grid grid = {0, 0, 0.0, 100.0, 0.1, 0.1};
+    potential_params pot = {POTENTIAL_COULOMB, 1.0, 0.0, 0.0};
+    const char *output_path = "teta_sweep.csv";
+
+    /*----- Start MPI environment -----*/
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    /**
+     * Arguments:
+     *
+     * - argv[1] -> NxM (points of b x points of E)(required)
+     * - argv[2] -> min:max (range of b)(optional, has default value)
+     * - argv[3] -> min:max (range of E)(optional, has default value)
+     * - argv[4] -> potential, e.g. coulomb, lj:1,1, repulsive:1,4, morse:1,1,2 (optional, has default value)
+     * - argv[5] -> output csv (optional, has default value)
+     *
+     */
+
+    /*----- START Args parsing -----*/
+    if (argc == 1)
+    {
+        fprintf(stdout, ">> The number of points is required to run this program, for example 200x1, 100x10\n");
+        MPI_Abort(MPI_COMM_WORLD, 3);
+    }
+
+    /** Points **/
+    ok = sscanf( argv[1], "%ux%u", &grid.num_b, &grid.num_e);
+
+    if (ok != 2 || grid.num_b == 0 || grid.num_e == 0)
+    {
+        fprintf(stdout, ">> Something went wrong during points parsing...\n");
+        MPI_Abort(MPI_COMM_WORLD, 5);
+    }
+
+    if (argc >= 3)
+    {
+        /** b range **/
+        ok = sscanf( argv[2], "%lf:%lf", &grid.b_min, &grid.b_max);
+        if (ok != 2)
+        {
+            fprintf(stdout, ">> Something went wrong during b range parsing...\n");
+            MPI_Abort(MPI_COMM_WORLD, 6);
+        }
+    }
+
+    if (argc >= 4)
+    {
+        /** E range **/
+        ok = sscanf( argv[3], "%lf:%lf", &grid.e_min, &grid.e_max);
+        if (ok != 2 || grid.e_min <= 0.0)
+        {
+            fprintf(stdout, ">> Something went wrong during E range parsing...\n");
+            MPI_Abort(MPI_COMM_WORLD, 7);
+        }
+    }
+
+    if (argc >= 5 && !parse_potential(argv[4], &pot))
+    {
+        fprintf(stdout, ">> Something went wrong during potential parsing...\n");
+        MPI_Abort(MPI_COMM_WORLD, 8);
+    }
+
+    if (argc >= 6) output_path = argv[5];
+
+    if (size < 2)
+    {
+        fprintf(stdout, ">> You need at least 2 processes and you have %d processes...\n", size);
+        MPI_Abort(MPI_COMM_WORLD, 9);
+    }
+    /*----- END Args parsing -----*/
+
+    MPI_Datatype mpi_farm_range = farm_range_type();
+    task_farm farm = task_farm_init(MPI_COMM_WORLD, size - 1,
+                                    mpi_farm_range, sizeof(farm_range),
+                                    MPI_DOUBLE, sizeof(double));
+
+    #if LOG
+        fprintf(stdout, ">> Process rank(%d) online - tot processes (%d)\n", rank, size);
+    #endif
+
+    if (rank == 0)
+    {
+        const unsigned long num_points = (unsigned long) grid.num_b * grid.num_e;
+        unsigned long i;
+
+        fprintf(stdout, ">>> Starting distributed theta sweep...\n");
+        fprintf(stdout, ">>> points: %ux%u\n", grid.num_b, grid.num_e);
+        fprintf(stdout, ">>> b: [%f, %f]\tE: [%f, %f]\n", grid.b_min, grid.b_max, grid.e_min, grid.e_max);
+        fprintf(stdout, ">>> potential: %d (%f, %f, %f)\n", pot.kind, pot.strength, pot.range, pot.exponent);
+        fprintf(stdout, ">>> workers: %d\n", farm.num_workers);
+
+        double *theta = (double*) malloc(sizeof(double) * num_points);
+
+        range_scheduler ranges;
+        task_scheduler scheduler = range_scheduler_init(&ranges, num_points, MIN_CHUNK, 1, farm.num_workers);
+
+        start = MPI_Wtime();
+
+        task_farm_master(&farm, &scheduler, store_range, theta);
+
+        end = MPI_Wtime();
+
+        fprintf(stdout, ">>> Done!\n");
+        fprintf(stdout, ">>> Elapsed time is %f\n", end - start );
+
+        /*----- Output -----*/
+        FILE *out = fopen(output_path, "w");
+        if (out == NULL)
+        {
+            fprintf(stdout, ">> Cannot open %s...\n", output_path);
+        }
+        else
+        {
+            fprintf(out, "b,E,theta\n");
+            for (i = 0; i != num_points; ++i)
+            {
+                double b, E;
+                grid_point(&grid, i, &b, &E);
+                fprintf(out, "%.10f,%.10f,%.10f\n", b, E, theta[i]);
+            }
+            fclose(out);
+            fprintf(stdout, ">>> Results written in %s\n", output_path);
+        }
+
+        /*----- CLEAN -----*/
+        free(theta);
+    }
+    else
+    {
+        worker_ctx worker = {&grid, &pot, NULL, NULL, NULL, 0};
+
+        task_farm_worker(&farm, compute_range, &worker);
+
+        /*----- CLEAN -----*/
+        free(worker.b);
+        free(worker.E);
+        free(worker.theta);
+    }
+
+    MPI_Type_free(&mpi_farm_range);
+
+    /* counters of the kernels, with -DPERF_COUNTERS */
+    PERF_REPORT(MPI_COMM_WORLD);
+
+    #if LOG
+        fprintf(stdout, ">> Process rank(%d) exiting...\n", rank);
+    #endif
+
+    MPI_Finalize();
+    return 0;
+}
@@ -72,9 +72,15 @@ class Submit(Process):
             sys.stdout.flush()
             project_folder = os.path.join(SOURCES, self.project)
             project_exe = os.path.join(project_folder, self.project + ".run")
-            command = "cd " + project_folder + " && mpicc {0}.c -O3 -o {1}"
+            # extra compiler and linker flags of the project, if any
+            build_flags = ""
+            flags_file = os.path.join(project_folder, "build.flags")
+            if os.path.isfile(flags_file):
+                with open(flags_file, "r") as flags:
+                    build_flags = " ".join(flags.read().split())
+            command = "cd " + project_folder + " && mpicc {0}.c -O3 -o {1} {2}"
             command, ret_code, stdout, stderr = call_command(
-                command.format(self.project, self.project + ".run"))
+                command.format(self.project, self.project + ".run", build_flags))
             if ret_code != 0:
                 print(Colors.FAIL + "FAIL" + Colors.ENDC)
                 pretty_return(command, ret_code, stdout, stderr)
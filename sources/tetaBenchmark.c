@@ -0,0 +1,260 @@
+/**
+ * Accuracy vs throughput benchmark of the tetaQuad integrators on the
+ * Coulomb potential, where theta has the closed form
+ * 2 asin(1 / sqrt(1 + 4 b^2 E^2)). The classical trajectories of
+ * tetaTrajectory.h are measured on the same points as a cross-check,
+ * their evaluations are the force evaluations of the integration steps.
+ *
+ * Build:
+ *   gcc tetaBenchmark.c -O3 -fno-math-errno -fopenmp -o tetaBenchmark -lm
+ *   (-DPERF_COUNTERS adds the counters of the integrand, see perf_counters.h)
+ *
+ * Arguments:
+ *
+ * - argv[1] -> summary csv (optional, default tetaBenchmark_summary.csv)
+ * - argv[2] -> per point csv (optional, default tetaBenchmark_points.csv)
+ * - argv[3] -> N (max b)(optional, has default value)
+ * - argv[4] -> N (b step)(optional, has default value)
+ *
+ */
+#define TETA_COUNT_EVALUATIONS
+
+#include <stdlib.h>
+#include <time.h>
+#include "tetaTable.h"
+#include "tetaTrajectory.h"
+
+#define NUM_ENERGIES 3
+#define NUM_VARIANTS 5
+
+const double ENERGIES[NUM_ENERGIES] = {0.05, 0.1, 0.2};
+const double TABLE_TOLERANCE = 0.02;
+const size_t TABLE_MAX_NODES = 48;
+
+const char *VARIANT_NAMES[NUM_VARIANTS] = {
+    "scalar",       /* integral_to_infinite, one call per point */
+    "batch",        /* integral_to_infinite_batch, one call for all the points */
+    "table_build",  /* teta_table_build on the sweep range */
+    "table_query",  /* teta_table_query on the built table */
+    "trajectory"    /* trajectory_batch, classical trajectories */
+};
+
+typedef struct variant_result_s
+{
+    double time;
+    unsigned long long evaluations;
+    double *theta;
+} variant_result;
+
+double wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double analytic_evaluation(double b, double E)
+{
+    return 2.0 * asin(1.0 / sqrt(1.0 + 4.0 * b * b * E * E));
+}
+
+int main(int argc, char **argv)
+{
+    const char *summary_path = "tetaBenchmark_summary.csv",
+               *points_path = "tetaBenchmark_points.csv";
+    double b_max = 50.0,
+           b_step = 0.5;
+    const potential_params coulomb = { POTENTIAL_COULOMB, 1.0, 0.0, 0.0 };
+
+    variant_result results[NUM_VARIANTS];
+    double *b, *E, *analytic, start;
+    size_t num_b, n, i, v;
+    teta_table table;
+    FILE *out;
+
+    /*----- START Args parsing -----*/
+    if (argc >= 2) summary_path = argv[1];
+    if (argc >= 3) points_path = argv[2];
+
+    if (argc >= 4 && (sscanf(argv[3], "%lf", &b_max) != 1 || b_max <= 0.0))
+    {
+        fprintf(stdout, ">> Something went wrong during max b parsing...\n");
+        return 1;
+    }
+
+    if (argc >= 5 && (sscanf(argv[4], "%lf", &b_step) != 1 || b_step <= 0.0))
+    {
+        fprintf(stdout, ">> Something went wrong during b step parsing...\n");
+        return 2;
+    }
+    /*----- END Args parsing -----*/
+
+    /*----- Sweep points -----*/
+    num_b = (size_t) (b_max / b_step) + 1;
+    n = num_b * NUM_ENERGIES;
+
+    b = (double*) malloc(sizeof(double) * n);
+    E = (double*) malloc(sizeof(double) * n);
+    analytic = (double*) malloc(sizeof(double) * n);
+
+    for (i = 0; i != n; ++i)
+    {
+        b[i] = (i % num_b) * b_step;
+        E[i] = ENERGIES[i / num_b];
+        analytic[i] = analytic_evaluation(b[i], E[i]);
+    }
+
+    for (v = 0; v != NUM_VARIANTS; ++v)
+    {
+        // table_build has no values of its own
+        results[v].theta = (v == 2) ? NULL : (double*) malloc(sizeof(double) * n);
+    }
+
+    fprintf(stdout, ">>> Starting tetaQuad benchmark...\n");
+    fprintf(stdout, ">>> points: %zu (b up to %f, step %f, %d energies)\n", n, b_max, b_step, NUM_ENERGIES);
+    #ifdef _OPENMP
+        fprintf(stdout, ">>> threads: %d\n", omp_get_max_threads());
+    #endif
+
+    /*----- scalar -----*/
+    teta_evaluations = 0;
+    start = wall_time();
+    for (i = 0; i != n; ++i)
+    {
+        results[0].theta[i] = M_PI - fabs(integral_to_infinite(0.0, b[i], E[i]));
+    }
+    results[0].time = wall_time() - start;
+    results[0].evaluations = teta_evaluations;
+
+    /*----- batch -----*/
+    teta_evaluations = 0;
+    start = wall_time();
+    integral_to_infinite_batch(0.0, b, E, results[1].theta, n);
+    for (i = 0; i != n; ++i)
+    {
+        results[1].theta[i] = M_PI - fabs(results[1].theta[i]);
+    }
+    results[1].time = wall_time() - start;
+    results[1].evaluations = teta_evaluations;
+
+    /*----- table build -----*/
+    teta_evaluations = 0;
+    start = wall_time();
+    if (teta_table_build(&table, &coulomb, 0.0, b_max, ENERGIES[0], ENERGIES[NUM_ENERGIES - 1],
+                         TABLE_TOLERANCE, TABLE_MAX_NODES) != 0)
+    {
+        fprintf(stdout, ">> Something went wrong during the table build...\n");
+        return 3;
+    }
+    results[2].time = wall_time() - start;
+    results[2].evaluations = teta_evaluations;
+
+    /*----- table query -----*/
+    teta_evaluations = 0;
+    start = wall_time();
+    for (i = 0; i != n; ++i)
+    {
+        results[3].theta[i] = teta_table_query(&table, b[i], E[i]);
+    }
+    results[3].time = wall_time() - start;
+    results[3].evaluations = teta_evaluations;
+
+    /*----- trajectory -----*/
+    teta_evaluations = 0;
+    start = wall_time();
+    trajectory_batch(&coulomb, b, E, results[4].theta, NULL, n);
+    for (i = 0; i != n; ++i)
+    {
+        results[4].theta[i] = M_PI - fabs(results[4].theta[i]);
+    }
+    results[4].time = wall_time() - start;
+    results[4].evaluations = teta_evaluations;
+
+    /*----- Summary csv -----*/
+    out = fopen(summary_path, "w");
+    if (out == NULL)
+    {
+        fprintf(stdout, ">> Cannot open %s...\n", summary_path);
+        return 4;
+    }
+
+    fprintf(out, "variant,points,wall_time,time_per_point,evaluations,evaluations_per_point,"
+                 "max_abs_error,mean_abs_error,max_rel_error,mean_rel_error\n");
+
+    for (v = 0; v != NUM_VARIANTS; ++v)
+    {
+        double max_abs = 0.0, sum_abs = 0.0,
+               max_rel = 0.0, sum_rel = 0.0;
+
+        if (results[v].theta == NULL)
+        {
+            fprintf(out, "%s,%zu,%.9f,%.9e,%llu,%.1f,,,,\n",
+                    VARIANT_NAMES[v], n, results[v].time, results[v].time / n,
+                    results[v].evaluations, (double) results[v].evaluations / n);
+            fprintf(stdout, ">>> %-12s time %f s\tevaluations %llu\n",
+                    VARIANT_NAMES[v], results[v].time, results[v].evaluations);
+            continue;
+        }
+
+        for (i = 0; i != n; ++i)
+        {
+            const double abs_error = fabs(results[v].theta[i] - analytic[i]);
+            const double rel_error = abs_error / fabs(analytic[i]);
+
+            if (abs_error > max_abs) max_abs = abs_error;
+            if (rel_error > max_rel) max_rel = rel_error;
+            sum_abs += abs_error;
+            sum_rel += rel_error;
+        }
+
+        fprintf(out, "%s,%zu,%.9f,%.9e,%llu,%.1f,%.9e,%.9e,%.9e,%.9e\n",
+                VARIANT_NAMES[v], n, results[v].time, results[v].time / n,
+                results[v].evaluations, (double) results[v].evaluations / n,
+                max_abs, sum_abs / n, max_rel, sum_rel / n);
+
+        fprintf(stdout, ">>> %-12s time %f s\tevaluations %llu\tmax abs error %e\tmax rel error %e\n",
+                VARIANT_NAMES[v], results[v].time, results[v].evaluations, max_abs, max_rel);
+    }
+    fclose(out);
+
+    /* counters of the integrand over all the variants, with -DPERF_COUNTERS */
+    PERF_PRINT(stdout);
+
+    /*----- Per point csv -----*/
+    out = fopen(points_path, "w");
+    if (out == NULL)
+    {
+        fprintf(stdout, ">> Cannot open %s...\n", points_path);
+        return 5;
+    }
+
+    fprintf(out, "variant,b,E,theta,analytic,abs_error,rel_error\n");
+    for (v = 0; v != NUM_VARIANTS; ++v)
+    {
+        if (results[v].theta == NULL) continue;
+
+        for (i = 0; i != n; ++i)
+        {
+            const double abs_error = fabs(results[v].theta[i] - analytic[i]);
+            fprintf(out, "%s,%f,%f,%.12e,%.12e,%.9e,%.9e\n",
+                    VARIANT_NAMES[v], b[i], E[i], results[v].theta[i], analytic[i],
+                    abs_error, abs_error / fabs(analytic[i]));
+        }
+    }
+    fclose(out);
+
+    fprintf(stdout, ">>> Table %zux%zu nodes, max midpoint error %e\n", table.num_b, table.num_e, table.max_error);
+    fprintf(stdout, ">>> Done!\n");
+
+    /*----- CLEAN -----*/
+    teta_table_free(&table);
+    for (v = 0; v != NUM_VARIANTS; ++v)
+    {
+        free(results[v].theta);
+    }
+    free(b);
+    free(E);
+    free(analytic);
+
+    return 0;
+}
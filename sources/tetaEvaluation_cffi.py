@@ -1,9 +1,16 @@
 from cffi import FFI
+import numpy as np
 from matplotlib import pyplot as plt
 from matplotlib import patches as mpatches
 from ctypes import c_double
 from math import asin, sqrt, degrees
 
+# largest error (radians) of the linear interpolation between two points of b
+ADAPTIVE_TOLERANCE = 0.003
+# narrowest interval of b
+ADAPTIVE_MIN_STEP = 0.001
+MAX_POINTS = 1000
+
 
 def analytic_evaluation(var_b, var_e):
     """Analytic function of theta integral."""
@@ -24,14 +31,37 @@ def main():
     """Program main."""
     ffi = FFI()
     ffi.cdef("""
+typedef struct potential_params_s
+{
+    int kind;
+    double strength;
+    double range;
+    double exponent;
+} potential_params;
+
 double integral_to_infinite(double a, double b, double E);
+double turning_point(const potential_params *pot, double b, double E);
+void integral_to_infinite_batch_potential(const potential_params *pot, double a,
+                                          const double *b, const double *E,
+                                          double *res, size_t n);
+void integral_to_infinite_batch(double a, const double *b, const double *E,
+                                double *res, size_t n);
+size_t integral_to_infinite_adaptive_potential(const potential_params *pot, double a, double E,
+                                               double b_min, double b_max,
+                                               double tolerance, double min_step,
+                                               double *b, double *res, size_t max_points);
+size_t integral_to_infinite_adaptive(double a, double E, double b_min, double b_max,
+                                     double tolerance, double min_step,
+                                     double *b, double *res, size_t max_points);
 double to_degrees(double radians);
 
 """)
     # C = ffi.dlopen(None)
     lib = ffi.verify("""
 #include "tetaQuad.h"
-""", include_dirs=["."], extra_compile_args=["-O3"])
+""", include_dirs=["."],
+                     extra_compile_args=["-O3", "-fno-math-errno", "-fopenmp"],
+                     extra_link_args=["-fopenmp"])
 
     var_e = ffi.cast("double", 0.1)
     var_a = ffi.cast("double", 0.0)
@@ -42,9 +72,29 @@ double to_degrees(double radians);
 
     print("Calculus may take some time...")
 
-    for var_b in range_f(0.0, 100, 0.5):
+    # b is refined where theta(b) bends, each round is a single parallel call
+    values_b = np.empty(MAX_POINTS)
+    values_rad = np.empty(MAX_POINTS)
+
+    num_points = lib.integral_to_infinite_adaptive(
+        var_a,
+        var_e,
+        0.0,
+        100.0,
+        ADAPTIVE_TOLERANCE,
+        ADAPTIVE_MIN_STEP,
+        ffi.from_buffer("double[]", values_b),
+        ffi.from_buffer("double[]", values_rad),
+        MAX_POINTS)
+
+    values_b = values_b[:num_points]
+    values_rad = values_rad[:num_points]
+
+    print("{} integrations (the uniform grid of step 0.5 needs 201)".format(
+        num_points))
+
+    for var_b, rad in zip(values_b, values_rad):
         points_x.append(var_b)
-        rad = lib.integral_to_infinite(var_a, var_b, var_e)
         theta = lib.to_degrees(abs(rad))
         analytic = degrees(analytic_evaluation(var_b, var_e))
 
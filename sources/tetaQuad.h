@@ -2,9 +2,36 @@
     #define _USE_MATH_DEFINES
 #endif
 
+#ifndef TETA_QUAD_H
+#define TETA_QUAD_H
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+#include "perf_counters.h"
+
+/* number of (b, E) points integrated together by the batch API */
+#define BATCH_LANES 8
+
+/**
+ * Define TETA_COUNT_EVALUATIONS before the include to count the integrand
+ * evaluations in teta_evaluations, otherwise the counting costs nothing.
+ * With PERF_COUNTERS the calls of integral_to_infinite and of the batch
+ * integrators are counted per evaluation, see perf_counters.h.
+ */
+#ifdef TETA_COUNT_EVALUATIONS
+    unsigned long long teta_evaluations = 0;
+    #define COUNT_EVALUATIONS(n) do { _Pragma("omp atomic") teta_evaluations += (n); } while(0)
+#else
+    #define COUNT_EVALUATIONS(n) do { } while(0)
+#endif
+
 const size_t MAX_DIVISIONS = 21;
 const size_t MAX_ITERATIONS = 21;
 const double PRECISION_DELTA = 0.00000001;
@@ -27,7 +54,8 @@ double finite_integral(double up, double to, double b, double E)
            prev_sum,
            partial_sum,
            f_x;
-    size_t i;
+    size_t i,
+           num_evals = 0;
 
     prev_sum = 0.0;
 
@@ -38,6 +66,7 @@ double finite_integral(double up, double to, double b, double E)
 
         for(cur_step = up + step; cur_step <= to; cur_step += step) {
             f_x = step * function(cur_step - (step/2.0), b, E);
+            ++num_evals;
             
             // when f_x is nan
             // if f_x is nan, f_x != f_x will be true
@@ -49,6 +78,9 @@ double finite_integral(double up, double to, double b, double E)
         if(prev_sum != 0.0 && fabs(prev_sum - partial_sum) < PRECISION_DELTA) break;
         prev_sum = partial_sum;
     }
+
+    COUNT_EVALUATIONS(num_evals);
+    PERF_UNITS(num_evals);
     
     return partial_sum;
 }
@@ -59,6 +91,7 @@ double integral_to_infinite(double a, double b, double E)
            prev_res,
            partial_res;
     size_t i;
+    PERF_BEGIN(perf);
 
     prev_res = 0.0;
     
@@ -79,9 +112,550 @@ double integral_to_infinite(double a, double b, double E)
         a = to;
     }
 
+    PERF_END(perf, PERF_KERNEL_INTEGRAND);
+
     return (2.0 * b) * prev_res;
 }
 
+/*----- Interaction potentials -----*/
+
+typedef enum potential_kind_e
+{
+    POTENTIAL_COULOMB = 0,       /* V = strength / r */
+    POTENTIAL_LENNARD_JONES = 1, /* V = 4 strength ((range/r)^12 - (range/r)^6) */
+    POTENTIAL_REPULSIVE = 2,     /* V = strength / r^exponent */
+    POTENTIAL_MORSE = 3          /* V = strength ((1 - e^(-exponent (r - range)))^2 - 1) */
+} potential_kind;
+
+typedef struct potential_params_s
+{
+    int kind;         /* one of potential_kind */
+    double strength;  /* k, epsilon, C or D */
+    double range;     /* sigma (Lennard-Jones) or r_e (Morse) */
+    double exponent;  /* n (repulsive) or alpha (Morse) */
+} potential_params;
+
+typedef double (*potential_fn)(double r, const potential_params *pot);
+
+#if defined(__GNUC__)
+    #define TETA_INLINE static inline __attribute__((always_inline))
+#else
+    #define TETA_INLINE static inline
+#endif
+
+TETA_INLINE double coulomb_potential(double r, const potential_params *pot)
+{
+    return pot->strength / r;
+}
+
+TETA_INLINE double coulomb_derivative(double r, const potential_params *pot)
+{
+    return -pot->strength / (r * r);
+}
+
+TETA_INLINE double lennard_jones_potential(double r, const potential_params *pot)
+{
+    const double s2 = (pot->range * pot->range) / (r * r);
+    const double s6 = s2 * s2 * s2;
+    return 4.0 * pot->strength * (s6 * s6 - s6);
+}
+
+TETA_INLINE double lennard_jones_derivative(double r, const potential_params *pot)
+{
+    const double s2 = (pot->range * pot->range) / (r * r);
+    const double s6 = s2 * s2 * s2;
+    return 4.0 * pot->strength * (6.0 * s6 - 12.0 * s6 * s6) / r;
+}
+
+TETA_INLINE double repulsive_potential(double r, const potential_params *pot)
+{
+    return pot->strength * pow(r, -pot->exponent);
+}
+
+TETA_INLINE double repulsive_derivative(double r, const potential_params *pot)
+{
+    return -pot->exponent * pot->strength * pow(r, -pot->exponent - 1.0);
+}
+
+TETA_INLINE double morse_potential(double r, const potential_params *pot)
+{
+    const double e = 1.0 - exp(-pot->exponent * (r - pot->range));
+    return pot->strength * (e * e - 1.0);
+}
+
+TETA_INLINE double morse_derivative(double r, const potential_params *pot)
+{
+    const double e = exp(-pot->exponent * (r - pot->range));
+    return 2.0 * pot->strength * pot->exponent * e * (1.0 - e);
+}
+
+/**
+ * Value of the potential selected at runtime, to use outside hot loops
+ * @param  r    distance
+ * @param  pot  potential and its parameters
+ * @return      V(r)
+ */
+double potential_value(double r, const potential_params *pot)
+{
+    switch(pot->kind) {
+        case POTENTIAL_LENNARD_JONES :
+            return lennard_jones_potential(r, pot);
+        case POTENTIAL_REPULSIVE :
+            return repulsive_potential(r, pot);
+        case POTENTIAL_MORSE :
+            return morse_potential(r, pot);
+        default :
+            return coulomb_potential(r, pot);
+    }
+}
+
+/**
+ * Derivative of the potential selected at runtime
+ * @param  r    distance
+ * @param  pot  potential and its parameters
+ * @return      dV/dr
+ */
+double potential_derivative(double r, const potential_params *pot)
+{
+    switch(pot->kind) {
+        case POTENTIAL_LENNARD_JONES :
+            return lennard_jones_derivative(r, pot);
+        case POTENTIAL_REPULSIVE :
+            return repulsive_derivative(r, pot);
+        case POTENTIAL_MORSE :
+            return morse_derivative(r, pot);
+        default :
+            return coulomb_derivative(r, pot);
+    }
+}
+
+/**
+ * Outermost classical turning point, the largest root of
+ * g(r) = 1 - b^2/r^2 - V(r)/E, found with a Newton step safeguarded
+ * by bisection (g'(r) = 2 b^2/r^3 - V'(r)/E).
+ * @param  pot  potential and its parameters
+ * @param  b    impact parameter
+ * @param  E    energy
+ * @return      the turning point, 0.0 if the particle reaches the center
+ */
+double turning_point(const potential_params *pot, double b, double E)
+{
+    double r_lo, r_hi, r, g, dg;
+    size_t i;
+
+    #define TURNING_G(x) (1.0 - (b * b) / ((x) * (x)) - potential_value((x), pot) / E)
+
+    r_hi = (b > 1.0) ? b : 1.0;
+    for(i = 0; i != 64 && TURNING_G(r_hi) <= 0.0; ++i) r_hi *= 2.0;
+
+    r_lo = r_hi;
+    for(i = 0; i != 256 && TURNING_G(r_lo) > 0.0; ++i) {
+        r_hi = r_lo;
+        r_lo *= 0.75;
+    }
+
+    if(TURNING_G(r_lo) > 0.0) return 0.0;
+
+    r = 0.5 * (r_lo + r_hi);
+    for(i = 0; i != 100; ++i)
+    {
+        double r_next;
+
+        g = TURNING_G(r);
+        dg = 2.0 * (b * b) / (r * r * r) - potential_derivative(r, pot) / E;
+
+        if(g > 0.0) r_hi = r;
+        else r_lo = r;
+
+        // newton step, bisection when it leaves the bracket
+        r_next = (dg != 0.0) ? r - g / dg : r_lo;
+        if(!(r_next > r_lo && r_next < r_hi)) r_next = 0.5 * (r_lo + r_hi);
+
+        if(fabs(r_next - r) < PRECISION_DELTA * r) {
+            r = r_next;
+            break;
+        }
+        r = r_next;
+    }
+
+    #undef TURNING_G
+
+    return r;
+}
+
+/*----- Batch integration -----*/
+
+/**
+ * Same midpoint sum of finite_integral evaluated for a block of points.
+ * All the lanes share the interval [up, to] and so the same abscissae,
+ * only b and E change, then the inner loop is vectorized across lanes.
+ * Each lane stops refining exactly where finite_integral would stop.
+ * V is a compile time constant in every caller, so it is inlined.
+ * @param  V       potential function
+ * @param  pot     potential parameters
+ * @param  up      lower bound of the interval
+ * @param  to      upper bound of the interval
+ * @param  b       impact parameters of the block
+ * @param  E       energies of the block
+ * @param  active  lanes that still need a result (0 = skip)
+ * @param  result  partial sums of the active lanes
+ * @param  lanes   number of valid lanes (<= BATCH_LANES)
+ */
+TETA_INLINE void finite_integral_lanes(potential_fn V, const potential_params *pot,
+                                       double up, double to, const double *b, const double *E,
+                                       const int *active, double *result, size_t lanes)
+{
+    double cur_step,
+           step,
+           prev_sum[BATCH_LANES],
+           sum[BATCH_LANES];
+    int converged[BATCH_LANES];
+    size_t i, l, remaining,
+           num_evals = 0;
+
+    remaining = 0;
+    for(l = 0; l != lanes; ++l) {
+        prev_sum[l] = 0.0;
+        converged[l] = !active[l];
+        if(active[l]) ++remaining;
+    }
+
+    for(i = 0; i != MAX_DIVISIONS && remaining != 0; ++i)
+    {
+        step = (to-up)/pow(2, i);
+
+        for(l = 0; l != BATCH_LANES; ++l) sum[l] = 0.0;
+
+        for(cur_step = up + step; cur_step <= to; cur_step += step) {
+            const double r = cur_step - (step/2.0);
+            const double v = V(r, pot);
+
+            #pragma omp simd
+            for(l = 0; l < lanes; ++l) {
+                double f_x = step * (1.0 / (pow(r, 2) * sqrt(1 - (pow(b[l], 2) / pow(r, 2)) - (v / E[l]))));
+                // skip nan values as finite_integral does
+                sum[l] += (f_x == f_x) ? f_x : 0.0;
+            }
+            num_evals += lanes;
+        }
+
+        for(l = 0; l != lanes; ++l) {
+            if(converged[l]) continue;
+
+            result[l] = sum[l];
+            if((prev_sum[l] != 0.0 && fabs(prev_sum[l] - sum[l]) < PRECISION_DELTA)
+               || i + 1 == MAX_DIVISIONS) {
+                converged[l] = 1;
+                --remaining;
+            }
+            prev_sum[l] = sum[l];
+        }
+    }
+
+    COUNT_EVALUATIONS(num_evals);
+    PERF_UNITS(num_evals);
+}
+
+/**
+ * integral_to_infinite for a block of points, see finite_integral_lanes.
+ * The intervals that lie entirely below the turning point of every lane
+ * only hold nan values and are skipped.
+ * @param  V      potential function
+ * @param  pot    potential parameters
+ * @param  a      lower bound of the integral (same for all the lanes)
+ * @param  b      impact parameters of the block
+ * @param  E      energies of the block
+ * @param  res    results, one per lane
+ * @param  lanes  number of valid lanes (<= BATCH_LANES)
+ */
+TETA_INLINE void integral_to_infinite_lanes(potential_fn V, const potential_params *pot,
+                                            double a, const double *b, const double *E,
+                                            double *res, size_t lanes)
+{
+    double to,
+           r_min,
+           prev_res[BATCH_LANES],
+           partial_res[BATCH_LANES];
+    int active[BATCH_LANES];
+    size_t i, l, remaining;
+
+    remaining = lanes;
+    r_min = HUGE_VAL;
+    for(l = 0; l != lanes; ++l) {
+        double r_turn = turning_point(pot, b[l], E[l]);
+        if(r_turn < r_min) r_min = r_turn;
+
+        prev_res[l] = 0.0;
+        active[l] = 1;
+    }
+
+    if(r_min > a + DELTA) a += floor((r_min - a) / DELTA) * DELTA;
+
+    for(i = 1; i != pow(2, MAX_ITERATIONS) && remaining != 0; ++i)
+    {
+        to = a + DELTA;
+        finite_integral_lanes(V, pot, a, to, b, E, active, partial_res, lanes);
+
+        for(l = 0; l != lanes; ++l) {
+            if(!active[l]) continue;
+
+            if(prev_res[l] != 0.0 && partial_res[l] != 0.0 && partial_res[l] < PRECISION_DELTA) {
+                active[l] = 0;
+                --remaining;
+            }
+            prev_res[l] += partial_res[l];
+        }
+
+        a = to;
+    }
+
+    for(l = 0; l != lanes; ++l) {
+        res[l] = (2.0 * b[l]) * prev_res[l];
+    }
+}
+
+/**
+ * Define integral_to_infinite_batch_<NAME>, the batch integrator with
+ * NAME##_potential inlined in the integrand. Points are grouped in
+ * blocks of BATCH_LANES, blocks are spread over the OpenMP threads with
+ * a dynamic schedule because the cost of a point depends strongly on b.
+ */
+#define DEFINE_POTENTIAL_BATCH(NAME) \
+    static void integral_to_infinite_batch_##NAME(const potential_params *pot, double a, \
+                                                  const double *b, const double *E, \
+                                                  double *res, size_t n) \
+    { \
+        long blk; \
+        const long num_blocks = (long) ((n + BATCH_LANES - 1) / BATCH_LANES); \
+        \
+        _Pragma("omp parallel for schedule(dynamic, 1)") \
+        for(blk = 0; blk < num_blocks; ++blk) \
+        { \
+            const size_t first = (size_t) blk * BATCH_LANES; \
+            const size_t lanes = (n - first < BATCH_LANES) ? n - first : BATCH_LANES; \
+            PERF_BEGIN(perf); \
+            \
+            integral_to_infinite_lanes(NAME##_potential, pot, a, b + first, E + first, \
+                                       res + first, lanes); \
+            PERF_END(perf, PERF_KERNEL_INTEGRAND); \
+        } \
+    }
+
+DEFINE_POTENTIAL_BATCH(coulomb)
+DEFINE_POTENTIAL_BATCH(lennard_jones)
+DEFINE_POTENTIAL_BATCH(repulsive)
+DEFINE_POTENTIAL_BATCH(morse)
+
+/**
+ * Evaluate the deflection integral on n (b, E) points for the potential
+ * selected by pot->kind. The integral starts from the outermost turning
+ * point (rounded down on the DELTA grid from a).
+ * @param  pot    potential and its parameters
+ * @param  a      lower bound of the integrals
+ * @param  b      impact parameters (n elements)
+ * @param  E      energies (n elements)
+ * @param  res    output array (n elements)
+ * @param  n      number of points
+ */
+void integral_to_infinite_batch_potential(const potential_params *pot, double a,
+                                          const double *b, const double *E,
+                                          double *res, size_t n)
+{
+    switch(pot->kind) {
+        case POTENTIAL_LENNARD_JONES :
+            integral_to_infinite_batch_lennard_jones(pot, a, b, E, res, n);
+            break;
+        case POTENTIAL_REPULSIVE :
+            integral_to_infinite_batch_repulsive(pot, a, b, E, res, n);
+            break;
+        case POTENTIAL_MORSE :
+            integral_to_infinite_batch_morse(pot, a, b, E, res, n);
+            break;
+        default :
+            integral_to_infinite_batch_coulomb(pot, a, b, E, res, n);
+    }
+}
+
+/**
+ * Single point version of integral_to_infinite_batch_potential
+ * @param  pot  potential and its parameters
+ * @param  a    lower bound of the integral
+ * @param  b    impact parameter
+ * @param  E    energy
+ * @return      same quantity of integral_to_infinite
+ */
+double integral_to_infinite_potential(const potential_params *pot, double a, double b, double E)
+{
+    double res = 0.0;
+    integral_to_infinite_batch_potential(pot, a, &b, &E, &res, 1);
+    return res;
+}
+
+/**
+ * Evaluate integral_to_infinite on n (b, E) points with the Coulomb
+ * potential of potential(), see integral_to_infinite_batch_potential.
+ * Without OpenMP it runs serially.
+ * @param  a      lower bound of the integrals
+ * @param  b      impact parameters (n elements)
+ * @param  E      energies (n elements)
+ * @param  res    output array (n elements), same values of integral_to_infinite
+ * @param  n      number of points
+ */
+void integral_to_infinite_batch(double a, const double *b, const double *E,
+                                double *res, size_t n)
+{
+    const potential_params coulomb = { POTENTIAL_COULOMB, 1.0, 0.0, 0.0 };
+    integral_to_infinite_batch_potential(&coulomb, a, b, E, res, n);
+}
+
+/*----- Adaptive sampling of the impact parameter -----*/
+
+/* uniform points the adaptive sampling starts from */
+#define ADAPTIVE_INITIAL_POINTS 17
+
+static int adaptive_compare_desc(const void *x, const void *y)
+{
+    const double dx = *(const double*) x,
+                 dy = *(const double*) y;
+
+    return (dx < dy) - (dx > dy);
+}
+
+/**
+ * Sample the deflection integral on [b_min, b_max] at energy E where it
+ * is not linear. Every round the flagged intervals are split in the
+ * middle and all the new points are integrated with a single batch
+ * (spread over the OpenMP threads). A half is flagged again when the
+ * midpoint is farther than tolerance from the chord (the error of the
+ * linear interpolation, about curvature * width^2 / 8) and it is wider
+ * than min_step, so a singularity (orbiting) stops at min_step. When the
+ * points would exceed max_points the largest errors are split first.
+ * @param  pot         potential and its parameters
+ * @param  a           lower bound of the integrals
+ * @param  E           energy
+ * @param  b_min       first impact parameter
+ * @param  b_max       last impact parameter
+ * @param  tolerance   largest error of the linear interpolation (radians)
+ * @param  min_step    narrowest interval
+ * @param  b           output, impact parameters in increasing order (max_points elements)
+ * @param  res         output, integrals (max_points elements)
+ * @param  max_points  size of b and res (at least 2)
+ * @return             number of points, each one is integrated once
+ */
+size_t integral_to_infinite_adaptive_potential(const potential_params *pot, double a, double E,
+                                               double b_min, double b_max,
+                                               double tolerance, double min_step,
+                                               double *b, double *res, size_t max_points)
+{
+    double *error, *energies, *mid_b, *mid_res, *new_b, *new_res, *new_error;
+    size_t n = (max_points < ADAPTIVE_INITIAL_POINTS) ? max_points : ADAPTIVE_INITIAL_POINTS,
+           i = 0;
+
+    if(max_points < 2) return 0;
+
+    /* error of the interval [b[i], b[i + 1]], 0 when it is not split */
+    error = (double*) malloc(sizeof(double) * max_points);
+    energies = (double*) malloc(sizeof(double) * max_points);
+    mid_b = (double*) malloc(sizeof(double) * max_points);
+    mid_res = (double*) malloc(sizeof(double) * max_points);
+    new_b = (double*) malloc(sizeof(double) * max_points);
+    new_res = (double*) malloc(sizeof(double) * max_points);
+    new_error = (double*) malloc(sizeof(double) * max_points);
+
+    for(i = 0; i != max_points; ++i) {
+        energies[i] = E;
+    }
+
+    /*----- Uniform start -----*/
+    for(i = 0; i != n; ++i) {
+        b[i] = b_min + (b_max - b_min) * (double) i / (double) (n - 1);
+        error[i] = (i + 1 < n) ? INFINITY : 0.0;
+    }
+    integral_to_infinite_batch_potential(pot, a, b, energies, res, n);
+
+    /*----- Refinement rounds -----*/
+    while(n < max_points)
+    {
+        size_t num_split = 0,
+               j = 0,
+               k = 0;
+        double threshold = 0.0;
+
+        for(i = 0; i + 1 < n; ++i) {
+            if(error[i] > 0.0) new_error[num_split++] = error[i];
+        }
+
+        if(num_split == 0) break;
+
+        // over budget, only the largest errors
+        if(n + num_split > max_points)
+        {
+            qsort(new_error, num_split, sizeof(double), adaptive_compare_desc);
+            num_split = max_points - n;
+            threshold = new_error[num_split - 1];
+        }
+
+        for(i = 0, k = 0; i + 1 < n && k != num_split; ++i) {
+            if(error[i] > 0.0 && error[i] >= threshold) mid_b[k++] = 0.5 * (b[i] + b[i + 1]);
+        }
+        num_split = k;
+
+        integral_to_infinite_batch_potential(pot, a, mid_b, energies, mid_res, num_split);
+
+        /*----- Merge the midpoints -----*/
+        for(i = 0, j = 0, k = 0; i != n; ++i)
+        {
+            new_b[j] = b[i];
+            new_res[j] = res[i];
+            new_error[j] = error[i];
+
+            if(i + 1 < n && k != num_split && error[i] > 0.0 && error[i] >= threshold)
+            {
+                const double chord = 0.5 * (res[i] + res[i + 1]),
+                             e = isfinite(mid_res[k]) ? fabs(mid_res[k] - chord) : INFINITY,
+                             half_error = (e > tolerance && 0.5 * (b[i + 1] - b[i]) > min_step) ? e : 0.0;
+
+                new_error[j++] = half_error;
+                new_b[j] = mid_b[k];
+                new_res[j] = mid_res[k];
+                new_error[j] = half_error;
+                ++k;
+            }
+            ++j;
+        }
+
+        n = j;
+        memcpy(b, new_b, sizeof(double) * n);
+        memcpy(res, new_res, sizeof(double) * n);
+        memcpy(error, new_error, sizeof(double) * n);
+    }
+
+    free(error);
+    free(energies);
+    free(mid_b);
+    free(mid_res);
+    free(new_b);
+    free(new_res);
+    free(new_error);
+
+    return n;
+}
+
+/**
+ * Coulomb version of integral_to_infinite_adaptive_potential, the same
+ * potential of integral_to_infinite_batch
+ */
+size_t integral_to_infinite_adaptive(double a, double E, double b_min, double b_max,
+                                     double tolerance, double min_step,
+                                     double *b, double *res, size_t max_points)
+{
+    const potential_params coulomb = { POTENTIAL_COULOMB, 1.0, 0.0, 0.0 };
+    return integral_to_infinite_adaptive_potential(&coulomb, a, E, b_min, b_max, tolerance, min_step,
+                                                   b, res, max_points);
+}
+
 double to_degrees(double radians) {
     return 180.0 - radians * (180.0 / M_PI);
-}
\ No newline at end of file
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,550 @@
+#ifndef TETA_TABLE_H
+#define TETA_TABLE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "tetaQuad.h"
+
+/* nodes of the first grid, before the refinement */
+#define TABLE_START_NODES_B 9
+#define TABLE_START_NODES_E 5
+
+/* intervals smaller than this fraction of the range are never split */
+const double TABLE_MIN_WIDTH = 0.000001;
+
+const char TABLE_MAGIC[8] = {'T', 'E', 'T', 'A', 'T', 'A', 'B', '1'};
+
+/**
+ * Deflection angle chi(b, E) tabulated on a (b, E) grid.
+ * Values are stored row by row: theta[ie * num_b + ib].
+ * The derivatives come from natural cubic splines along the axes and
+ * are used by the bicubic Hermite interpolation of the queries.
+ */
+typedef struct teta_table_s
+{
+    potential_params pot;
+    size_t num_b;
+    size_t num_e;
+    double *b;          /* b nodes, increasing */
+    double *E;          /* E nodes, increasing */
+    double *theta;      /* chi = pi - |integral_to_infinite| (radians) */
+    double *d_b;        /* d chi / db */
+    double *d_e;        /* d chi / dE */
+    double *d_be;       /* d2 chi / db dE */
+    double max_error;   /* largest error measured on the midpoints of the grid */
+} teta_table;
+
+/*----- Helpers -----*/
+
+/**
+ * Slopes of the natural cubic spline through (x[i], y[i * stride])
+ * @param  x       abscissae (n elements, increasing)
+ * @param  y       values
+ * @param  dy      output slopes, same layout of y
+ * @param  stride  distance between two values in y and dy
+ * @param  n       number of points
+ */
+void spline_slopes(const double *x, const double *y, double *dy, size_t stride, size_t n)
+{
+    double *c, *d, *m;
+    size_t i;
+
+    if(n < 2) {
+        if(n == 1) dy[0] = 0.0;
+        return;
+    }
+
+    c = (double*) malloc(sizeof(double) * n);
+    d = (double*) malloc(sizeof(double) * n);
+    m = (double*) malloc(sizeof(double) * n);
+
+    /*----- Tridiagonal system of the second derivatives (Thomas algorithm) -----*/
+    c[0] = 0.0;
+    d[0] = 0.0;
+    for(i = 1; i + 1 < n; ++i)
+    {
+        const double h0 = x[i] - x[i-1],
+                     h1 = x[i+1] - x[i],
+                     rhs = 6.0 * ((y[(i+1) * stride] - y[i * stride]) / h1
+                                - (y[i * stride] - y[(i-1) * stride]) / h0),
+                     diag = 2.0 * (h0 + h1) - h0 * c[i-1];
+
+        c[i] = h1 / diag;
+        d[i] = (rhs - h0 * d[i-1]) / diag;
+    }
+
+    m[n-1] = 0.0;
+    for(i = n - 1; i-- > 1;) {
+        m[i] = d[i] - c[i] * m[i+1];
+    }
+    m[0] = 0.0;
+
+    for(i = 0; i + 1 < n; ++i)
+    {
+        const double h = x[i+1] - x[i];
+        dy[i * stride] = (y[(i+1) * stride] - y[i * stride]) / h - h * (2.0 * m[i] + m[i+1]) / 6.0;
+    }
+    {
+        const double h = x[n-1] - x[n-2];
+        dy[(n-1) * stride] = (y[(n-1) * stride] - y[(n-2) * stride]) / h + h * (m[n-2] + 2.0 * m[n-1]) / 6.0;
+    }
+
+    /*----- CLEAN -----*/
+    free(c);
+    free(d);
+    free(m);
+}
+
+double hermite(double p0, double p1, double m0, double m1, double t)
+{
+    const double t2 = t * t,
+                 t3 = t2 * t;
+    return (2.0*t3 - 3.0*t2 + 1.0) * p0 + (t3 - 2.0*t2 + t) * m0
+         + (-2.0*t3 + 3.0*t2) * p1 + (t3 - t2) * m1;
+}
+
+double hermite_dt(double p0, double p1, double m0, double m1, double t)
+{
+    const double t2 = t * t;
+    return (6.0*t2 - 6.0*t) * p0 + (3.0*t2 - 4.0*t + 1.0) * m0
+         + (-6.0*t2 + 6.0*t) * p1 + (3.0*t2 - 2.0*t) * m1;
+}
+
+/**
+ * Index of the interval of nodes that contains value (clamped)
+ */
+size_t find_interval(const double *nodes, size_t n, double value)
+{
+    size_t lo = 0,
+           hi = n - 1;
+
+    if(n < 2 || value <= nodes[0]) return 0;
+    if(value >= nodes[n-1]) return n - 2;
+
+    while(hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if(nodes[mid] <= value) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Deflection angles of n points, evaluated in parallel
+ */
+void table_eval(const potential_params *pot, const double *b, const double *E, double *chi, size_t n)
+{
+    size_t i;
+
+    integral_to_infinite_batch_potential(pot, 0.0, b, E, chi, n);
+    for(i = 0; i != n; ++i) {
+        chi[i] = M_PI - fabs(chi[i]);
+    }
+}
+
+void teta_table_free(teta_table *table)
+{
+    free(table->b);
+    free(table->E);
+    free(table->theta);
+    free(table->d_b);
+    free(table->d_e);
+    free(table->d_be);
+    memset(table, 0, sizeof(teta_table));
+}
+
+/**
+ * (Re)compute the derivatives of the interpolation from the values
+ */
+void teta_table_update_slopes(teta_table *table)
+{
+    const size_t nb = table->num_b,
+                 ne = table->num_e;
+    size_t i, j;
+
+    table->d_b = (double*) realloc(table->d_b, sizeof(double) * nb * ne);
+    table->d_e = (double*) realloc(table->d_e, sizeof(double) * nb * ne);
+    table->d_be = (double*) realloc(table->d_be, sizeof(double) * nb * ne);
+
+    for(j = 0; j != ne; ++j) {
+        spline_slopes(table->b, table->theta + j * nb, table->d_b + j * nb, 1, nb);
+    }
+
+    for(i = 0; i != nb; ++i) {
+        spline_slopes(table->E, table->theta + i, table->d_e + i, nb, ne);
+        spline_slopes(table->E, table->d_b + i, table->d_be + i, nb, ne);
+    }
+}
+
+/*----- Query -----*/
+
+/**
+ * Interpolated deflection angle and its derivative with respect to b
+ * @param  table  the table
+ * @param  b      impact parameter (clamped to the table range)
+ * @param  E      energy (clamped to the table range)
+ * @param  d_chi  if not NULL, receives d chi / db
+ * @return        chi(b, E) in radians
+ */
+double teta_table_eval(const teta_table *table, double b, double E, double *d_chi)
+{
+    const size_t nb = table->num_b;
+    const size_t i = find_interval(table->b, nb, b),
+                 j = find_interval(table->E, table->num_e, E);
+    const double hb = table->b[i+1] - table->b[i];
+    double t = (b - table->b[i]) / hb;
+    double f[2] = {0.0, 0.0}, df[2] = {0.0, 0.0}, g[2] = {0.0, 0.0}, dg[2] = {0.0, 0.0};
+    size_t row;
+
+    if(t < 0.0) t = 0.0;
+    if(t > 1.0) t = 1.0;
+
+    for(row = 0; row != 2 && j + row < table->num_e; ++row)
+    {
+        const size_t k = (j + row) * nb + i;
+
+        f[row] = hermite(table->theta[k], table->theta[k+1], table->d_b[k] * hb, table->d_b[k+1] * hb, t);
+        df[row] = hermite_dt(table->theta[k], table->theta[k+1], table->d_b[k] * hb, table->d_b[k+1] * hb, t) / hb;
+        g[row] = hermite(table->d_e[k], table->d_e[k+1], table->d_be[k] * hb, table->d_be[k+1] * hb, t);
+        dg[row] = hermite_dt(table->d_e[k], table->d_e[k+1], table->d_be[k] * hb, table->d_be[k+1] * hb, t) / hb;
+    }
+
+    // a single energy: interpolation along b only
+    if(table->num_e == 1) {
+        if(d_chi != NULL) *d_chi = df[0];
+        return f[0];
+    }
+
+    {
+        const double he = table->E[j+1] - table->E[j];
+        double u = (E - table->E[j]) / he;
+
+        if(u < 0.0) u = 0.0;
+        if(u > 1.0) u = 1.0;
+
+        if(d_chi != NULL) *d_chi = hermite(df[0], df[1], dg[0] * he, dg[1] * he, u);
+        return hermite(f[0], f[1], g[0] * he, g[1] * he, u);
+    }
+}
+
+double teta_table_query(const teta_table *table, double b, double E)
+{
+    return teta_table_eval(table, b, E, NULL);
+}
+
+/**
+ * Classical differential cross section of the trajectory with impact parameter b
+ * sigma = b / (sin(chi) |d chi / db|), 0.0 at b == 0 (head-on collision,
+ * where the formula is 0 / 0)
+ */
+double teta_table_cross_section(const teta_table *table, double b, double E)
+{
+    double d_chi = 0.0;
+    double chi;
+
+    if(b == 0.0) return 0.0;
+
+    chi = teta_table_eval(table, b, E, &d_chi);
+    return b / fabs(sin(chi) * d_chi);
+}
+
+/**
+ * Differential cross section at the scattering angle chi, summed over
+ * every branch b_k of the deflection function with chi(b_k) = +/- chi
+ * (chi in [0, pi]). Branches are found on the interpolant by bisection.
+ * @param  table  the table
+ * @param  chi    scattering angle (radians)
+ * @param  E      energy
+ * @return        sigma(chi), 0.0 if no impact parameter gives chi
+ */
+double teta_table_cross_section_angle(const teta_table *table, double chi, double E)
+{
+    const size_t samples_per_node = 4;
+    const size_t n = (table->num_b - 1) * samples_per_node;
+    double sigma = 0.0,
+           b_prev = table->b[0],
+           f_prev = fabs(teta_table_query(table, b_prev, E)) - chi;
+    size_t s, it;
+
+    for(s = 1; s <= n; ++s)
+    {
+        const size_t node = (s - 1) / samples_per_node;
+        const double t = (double) ((s - 1) % samples_per_node + 1) / samples_per_node;
+        const double b_cur = table->b[node] + t * (table->b[node+1] - table->b[node]);
+        const double f_cur = fabs(teta_table_query(table, b_cur, E)) - chi;
+
+        if(f_prev == 0.0 || (f_prev < 0.0) != (f_cur < 0.0))
+        {
+            double lo = b_prev,
+                   hi = b_cur,
+                   f_lo = f_prev;
+
+            for(it = 0; it != 60; ++it) {
+                const double mid = 0.5 * (lo + hi);
+                const double f_mid = fabs(teta_table_query(table, mid, E)) - chi;
+                if((f_mid < 0.0) == (f_lo < 0.0)) {
+                    lo = mid;
+                    f_lo = f_mid;
+                }
+                else hi = mid;
+            }
+            sigma += teta_table_cross_section(table, 0.5 * (lo + hi), E);
+        }
+
+        b_prev = b_cur;
+        f_prev = f_cur;
+    }
+
+    return sigma;
+}
+
+/*----- Build -----*/
+
+/**
+ * Refine one axis of the table: every interval is checked on its
+ * midpoint against the interpolation, the midpoints with an error
+ * larger than tolerance become new nodes (their values are reused).
+ * @param  max_error  largest midpoint error (NaN included) of the
+ *                    grid before the insertion, updated
+ * @return            number of inserted nodes
+ */
+size_t teta_table_refine(teta_table *table, int axis_b, double tolerance, size_t max_nodes, double *max_error)
+{
+    const size_t nb = table->num_b,
+                 ne = table->num_e;
+    const size_t n_axis = axis_b ? nb : ne,
+                 n_other = axis_b ? ne : nb;
+    const double *axis = axis_b ? table->b : table->E;
+    const double min_width = TABLE_MIN_WIDTH * (axis[n_axis - 1] - axis[0]);
+    double *q_b, *q_e, *q_chi, *error;
+    char *split;
+    size_t i, k, num_split = 0;
+
+    if(n_axis < 2) return 0;
+
+    q_b = (double*) malloc(sizeof(double) * (n_axis - 1) * n_other);
+    q_e = (double*) malloc(sizeof(double) * (n_axis - 1) * n_other);
+    q_chi = (double*) malloc(sizeof(double) * (n_axis - 1) * n_other);
+    error = (double*) malloc(sizeof(double) * (n_axis - 1));
+    split = (char*) malloc(sizeof(char) * (n_axis - 1));
+
+    /*----- Midpoints of every interval, on every line of the other axis -----*/
+    for(i = 0; i + 1 != n_axis; ++i) {
+        const double mid = 0.5 * (axis[i] + axis[i+1]);
+        for(k = 0; k != n_other; ++k) {
+            q_b[i * n_other + k] = axis_b ? mid : table->b[k];
+            q_e[i * n_other + k] = axis_b ? table->E[k] : mid;
+        }
+    }
+
+    table_eval(&table->pot, q_b, q_e, q_chi, (n_axis - 1) * n_other);
+
+    for(i = 0; i + 1 != n_axis; ++i)
+    {
+        error[i] = 0.0;
+        for(k = 0; k != n_other; ++k) {
+            const double diff = fabs(q_chi[i * n_other + k]
+                                   - teta_table_query(table, q_b[i * n_other + k], q_e[i * n_other + k]));
+            if(diff > error[i] || diff != diff) error[i] = diff;
+        }
+
+        split[i] = (error[i] > tolerance || error[i] != error[i])
+                   && (axis[i+1] - axis[i]) > min_width
+                   && n_axis + num_split < max_nodes;
+        if(split[i]) ++num_split;
+        if(error[i] > *max_error || error[i] != error[i]) *max_error = error[i];
+    }
+
+    /*----- Insert the new nodes -----*/
+    if(num_split != 0)
+    {
+        const size_t new_axis = n_axis + num_split;
+        double *nodes = (double*) malloc(sizeof(double) * new_axis);
+        double *values = (double*) malloc(sizeof(double) * new_axis * n_other);
+        size_t pos = 0;
+
+        for(i = 0; i != n_axis; ++i)
+        {
+            nodes[pos] = axis[i];
+            for(k = 0; k != n_other; ++k) {
+                if(axis_b) values[k * new_axis + pos] = table->theta[k * nb + i];
+                else values[pos * n_other + k] = table->theta[i * nb + k];
+            }
+            ++pos;
+
+            if(i + 1 != n_axis && split[i])
+            {
+                nodes[pos] = 0.5 * (axis[i] + axis[i+1]);
+                for(k = 0; k != n_other; ++k) {
+                    if(axis_b) values[k * new_axis + pos] = q_chi[i * n_other + k];
+                    else values[pos * n_other + k] = q_chi[i * n_other + k];
+                }
+                ++pos;
+            }
+        }
+
+        if(axis_b) {
+            free(table->b);
+            table->b = nodes;
+            table->num_b = new_axis;
+        }
+        else {
+            free(table->E);
+            table->E = nodes;
+            table->num_e = new_axis;
+        }
+        free(table->theta);
+        table->theta = values;
+
+        teta_table_update_slopes(table);
+    }
+
+    /*----- CLEAN -----*/
+    free(q_b);
+    free(q_e);
+    free(q_chi);
+    free(error);
+    free(split);
+
+    return num_split;
+}
+
+/**
+ * Tabulate chi(b, E) on [b_min, b_max] x [e_min, e_max]. The grid is
+ * refined alternating the two axes until every midpoint is interpolated
+ * within tolerance (or max_nodes per axis is reached). max_error is
+ * the one of the last round, which inserts nothing and so checks every
+ * midpoint of the final grid. With e_min == e_max the table has a
+ * single energy.
+ * @param  table      output table (free it with teta_table_free)
+ * @param  pot        potential and its parameters
+ * @param  tolerance  max absolute error on chi (radians)
+ * @param  max_nodes  max number of nodes per axis
+ * @return            0 on success, -1 on bad arguments
+ */
+int teta_table_build(teta_table *table, const potential_params *pot,
+                     double b_min, double b_max, double e_min, double e_max,
+                     double tolerance, size_t max_nodes)
+{
+    double *q_b, *q_e;
+    size_t i, j, nb, ne, inserted;
+
+    memset(table, 0, sizeof(teta_table));
+
+    if(!(b_max > b_min) || e_max < e_min || e_min <= 0.0 || max_nodes < TABLE_START_NODES_B)
+        return -1;
+
+    nb = TABLE_START_NODES_B;
+    ne = (e_max > e_min) ? TABLE_START_NODES_E : 1;
+
+    table->pot = *pot;
+    table->num_b = nb;
+    table->num_e = ne;
+    table->b = (double*) malloc(sizeof(double) * nb);
+    table->E = (double*) malloc(sizeof(double) * ne);
+    table->theta = (double*) malloc(sizeof(double) * nb * ne);
+
+    for(i = 0; i != nb; ++i) table->b[i] = b_min + (b_max - b_min) * i / (nb - 1);
+    for(j = 0; j != ne; ++j) table->E[j] = (ne == 1) ? e_min : e_min + (e_max - e_min) * j / (ne - 1);
+
+    q_b = (double*) malloc(sizeof(double) * nb * ne);
+    q_e = (double*) malloc(sizeof(double) * nb * ne);
+    for(j = 0; j != ne; ++j) {
+        for(i = 0; i != nb; ++i) {
+            q_b[j * nb + i] = table->b[i];
+            q_e[j * nb + i] = table->E[j];
+        }
+    }
+    table_eval(pot, q_b, q_e, table->theta, nb * ne);
+    free(q_b);
+    free(q_e);
+
+    teta_table_update_slopes(table);
+
+    do {
+        table->max_error = 0.0;
+        inserted = teta_table_refine(table, 1, tolerance, max_nodes, &table->max_error);
+        inserted += teta_table_refine(table, 0, tolerance, max_nodes, &table->max_error);
+    } while(inserted != 0);
+
+    return 0;
+}
+
+/*----- File I/O -----*/
+
+/**
+ * Save the table: magic, sizes, potential, error, nodes and values.
+ * The derivatives are not stored, they are rebuilt by teta_table_load.
+ * @return  0 on success, -1 on error
+ */
+int teta_table_save(const teta_table *table, const char *path)
+{
+    FILE *out = fopen(path, "wb");
+    unsigned long long sizes[2];
+    size_t ok = 1;
+
+    if(out == NULL) return -1;
+
+    sizes[0] = table->num_b;
+    sizes[1] = table->num_e;
+
+    ok = ok && fwrite(TABLE_MAGIC, sizeof(TABLE_MAGIC), 1, out) == 1;
+    ok = ok && fwrite(sizes, sizeof(sizes), 1, out) == 1;
+    ok = ok && fwrite(&table->pot, sizeof(potential_params), 1, out) == 1;
+    ok = ok && fwrite(&table->max_error, sizeof(double), 1, out) == 1;
+    ok = ok && fwrite(table->b, sizeof(double), table->num_b, out) == table->num_b;
+    ok = ok && fwrite(table->E, sizeof(double), table->num_e, out) == table->num_e;
+    ok = ok && fwrite(table->theta, sizeof(double), table->num_b * table->num_e, out) == table->num_b * table->num_e;
+
+    if(fclose(out) != 0) ok = 0;
+
+    return ok ? 0 : -1;
+}
+
+/**
+ * Load a table written by teta_table_save
+ * @return  0 on success, -1 on error
+ */
+int teta_table_load(teta_table *table, const char *path)
+{
+    FILE *in = fopen(path, "rb");
+    char magic[sizeof(TABLE_MAGIC)];
+    unsigned long long sizes[2];
+    size_t ok = 1;
+
+    memset(table, 0, sizeof(teta_table));
+    if(in == NULL) return -1;
+
+    ok = ok && fread(magic, sizeof(magic), 1, in) == 1 && memcmp(magic, TABLE_MAGIC, sizeof(magic)) == 0;
+    ok = ok && fread(sizes, sizeof(sizes), 1, in) == 1 && sizes[0] >= 2 && sizes[1] >= 1;
+    // the sizes come from the file, their product must fit the allocation
+    ok = ok && sizes[0] <= (size_t) -1 / sizeof(double) / sizes[1];
+
+    if(ok)
+    {
+        table->num_b = sizes[0];
+        table->num_e = sizes[1];
+        table->b = (double*) malloc(sizeof(double) * table->num_b);
+        table->E = (double*) malloc(sizeof(double) * table->num_e);
+        table->theta = (double*) malloc(sizeof(double) * table->num_b * table->num_e);
+
+        ok = table->b != NULL && table->E != NULL && table->theta != NULL;
+        ok = ok && fread(&table->pot, sizeof(potential_params), 1, in) == 1;
+        ok = ok && fread(&table->max_error, sizeof(double), 1, in) == 1;
+        ok = ok && fread(table->b, sizeof(double), table->num_b, in) == table->num_b;
+        ok = ok && fread(table->E, sizeof(double), table->num_e, in) == table->num_e;
+        ok = ok && fread(table->theta, sizeof(double), table->num_b * table->num_e, in) == table->num_b * table->num_e;
+    }
+
+    fclose(in);
+
+    if(!ok) {
+        teta_table_free(table);
+        return -1;
+    }
+
+    teta_table_update_slopes(table);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,95 @@
+from cffi import FFI
+import numpy as np
+from matplotlib import pyplot as plt
+from matplotlib import patches as mpatches
+from math import asin, sqrt, degrees
+import os
+import sys
+
+TABLE_FILE = "coulomb_table.bin"
+
+
+def analytic_evaluation(var_b, var_e):
+    """Analytic function of theta integral."""
+    return 2.0 * asin(1 / (sqrt(1 + 4 * float(var_b) ** 2 * float(var_e) ** 2)))
+
+
+def main():
+    """Build (or load) a Coulomb table and sweep it."""
+    ffi = FFI()
+    ffi.cdef("""
+typedef struct potential_params_s
+{
+    int kind;
+    double strength;
+    double range;
+    double exponent;
+} potential_params;
+
+typedef struct teta_table_s
+{
+    potential_params pot;
+    size_t num_b;
+    size_t num_e;
+    double *b;
+    double *E;
+    double *theta;
+    double *d_b;
+    double *d_e;
+    double *d_be;
+    double max_error;
+} teta_table;
+
+int teta_table_build(teta_table *table, const potential_params *pot,
+                     double b_min, double b_max, double e_min, double e_max,
+                     double tolerance, size_t max_nodes);
+int teta_table_save(const teta_table *table, const char *path);
+int teta_table_load(teta_table *table, const char *path);
+void teta_table_free(teta_table *table);
+double teta_table_query(const teta_table *table, double b, double E);
+double teta_table_cross_section(const teta_table *table, double b, double E);
+
+""")
+    lib = ffi.verify("""
+#include "tetaTable.h"
+""", include_dirs=["."],
+                     extra_compile_args=["-O3", "-fno-math-errno", "-fopenmp"],
+                     extra_link_args=["-fopenmp"])
+
+    table = ffi.new("teta_table *")
+
+    if os.path.exists(TABLE_FILE) and lib.teta_table_load(table, TABLE_FILE.encode()) == 0:
+        print("Table loaded from {}".format(TABLE_FILE))
+    else:
+        print("Building the table, it may take some time...")
+        pot = ffi.new("potential_params *", [0, 1.0, 0.0, 0.0])
+        if lib.teta_table_build(table, pot, 0.0, 100.0, 0.05, 0.2, 0.005, 200) != 0:
+            print("Something went wrong during the table build...")
+            sys.exit(1)
+        lib.teta_table_save(table, TABLE_FILE.encode())
+
+    print("Table {}x{} nodes, max error {} rad".format(
+        table.num_b, table.num_e, table.max_error))
+
+    var_e = 0.1
+    points_x = np.arange(0.0, 100.0, 0.01)
+    points_y = [degrees(lib.teta_table_query(table, var_b, var_e))
+                for var_b in points_x]
+    points_y_a = [degrees(analytic_evaluation(var_b, var_e))
+                  for var_b in points_x]
+
+    lib.teta_table_free(table)
+
+    plt.ylabel('teta')
+    plt.xlabel('b')
+    plt.plot(points_x, points_y, 'r-')
+    plt.plot(points_x, points_y_a, 'b--')
+    red_line = mpatches.Patch(color='red', label='table value')
+    blue_line = mpatches.Patch(color='blue', label='analytic value')
+    plt.legend(handles=[red_line, blue_line])
+    plt.grid(True)
+    plt.show()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,207 @@
+#ifndef TETA_TRAJECTORY_H
+#define TETA_TRAJECTORY_H
+
+#include <stdlib.h>
+#include "tetaQuad.h"
+
+/**
+ * Classical trajectories of a particle (reduced mass 1) scattered by a
+ * central potential, integrated with velocity Verlet on many impact
+ * parameters together. The result is the same quantity returned by
+ * integral_to_infinite (the polar angle swept by the particle, pi
+ * minus the deflection) so the two methods can be compared directly.
+ *
+ * The particle starts at distance TRAJECTORY_DISTANCE moving along x,
+ * with speed and offset chosen to have exactly energy E and angular
+ * momentum b sqrt(2E). The time step of every particle is
+ * eta * min(r/|v|, sqrt(r/|a|)), so it shrinks near the closest approach
+ * and grows in the asymptotic region.
+ */
+
+/* particles integrated together by a thread */
+#define TRAJECTORY_BLOCK 64
+
+const double TRAJECTORY_DISTANCE = 100000.0;
+const double TRAJECTORY_ETA = 0.001;
+const size_t TRAJECTORY_MAX_STEPS = 10000000;
+
+/**
+ * Particles stored structure of arrays, so the force loop is vectorized
+ */
+typedef struct trajectory_block_s
+{
+    double x[TRAJECTORY_BLOCK];
+    double y[TRAJECTORY_BLOCK];
+    double vx[TRAJECTORY_BLOCK];
+    double vy[TRAJECTORY_BLOCK];
+    double ax[TRAJECTORY_BLOCK];
+    double ay[TRAJECTORY_BLOCK];
+    double rotation[TRAJECTORY_BLOCK];  /* unwrapped rotation of the velocity */
+    double r_min[TRAJECTORY_BLOCK];     /* closest approach */
+    double active[TRAJECTORY_BLOCK];    /* 1.0 while the particle moves, 0.0 at the end */
+} trajectory_block;
+
+/**
+ * Acceleration -V'(r) r/|r| of every particle of the block, each one is
+ * a force evaluation for TETA_COUNT_EVALUATIONS
+ */
+TETA_INLINE void trajectory_forces(potential_fn dV, const potential_params *pot,
+                                   trajectory_block *blk, size_t count)
+{
+    size_t i;
+
+    #pragma omp simd
+    for (i = 0; i < count; ++i)
+    {
+        const double r = sqrt(blk->x[i] * blk->x[i] + blk->y[i] * blk->y[i]);
+        const double f = -dV(r, pot) / r;
+
+        blk->ax[i] = f * blk->x[i];
+        blk->ay[i] = f * blk->y[i];
+    }
+
+    COUNT_EVALUATIONS(count);
+}
+
+/**
+ * Integrate a block of particles until every one leaves the interaction
+ * region (or TRAJECTORY_MAX_STEPS steps are done)
+ */
+TETA_INLINE void trajectory_run(potential_fn V, potential_fn dV, const potential_params *pot,
+                                const double *b, const double *E, double *rad, double *r_min,
+                                size_t count)
+{
+    trajectory_block blk;
+    size_t i, step, remaining = count;
+
+    /*----- Initial conditions -----*/
+    for (i = 0; i != count; ++i)
+    {
+        const double v_inf = sqrt(2.0 * E[i]);
+        const double v0 = sqrt(2.0 * (E[i] - V(TRAJECTORY_DISTANCE, pot)));
+        const double y0 = b[i] * v_inf / v0;
+
+        blk.x[i] = -sqrt(TRAJECTORY_DISTANCE * TRAJECTORY_DISTANCE - y0 * y0);
+        blk.y[i] = y0;
+        blk.vx[i] = v0;
+        blk.vy[i] = 0.0;
+        blk.rotation[i] = 0.0;
+        blk.r_min[i] = TRAJECTORY_DISTANCE;
+        blk.active[i] = 1.0;
+    }
+
+    trajectory_forces(dV, pot, &blk, count);
+
+    /*----- Velocity Verlet with a time step per particle -----*/
+    for (step = 0; step != TRAJECTORY_MAX_STEPS && remaining != 0; ++step)
+    {
+        double dt[TRAJECTORY_BLOCK],
+               vx_old[TRAJECTORY_BLOCK],
+               vy_old[TRAJECTORY_BLOCK];
+
+        #pragma omp simd
+        for (i = 0; i < count; ++i)
+        {
+            const double r = sqrt(blk.x[i] * blk.x[i] + blk.y[i] * blk.y[i]);
+            const double v = sqrt(blk.vx[i] * blk.vx[i] + blk.vy[i] * blk.vy[i]);
+            const double a = sqrt(blk.ax[i] * blk.ax[i] + blk.ay[i] * blk.ay[i]) + 1e-300;
+            const double dt_v = r / v,
+                         dt_a = sqrt(r / a);
+
+            dt[i] = blk.active[i] * TRAJECTORY_ETA * (dt_v < dt_a ? dt_v : dt_a);
+            vx_old[i] = blk.vx[i];
+            vy_old[i] = blk.vy[i];
+
+            // kick and drift, the second kick follows the new forces
+            blk.vx[i] += 0.5 * dt[i] * blk.ax[i];
+            blk.vy[i] += 0.5 * dt[i] * blk.ay[i];
+            blk.x[i] += dt[i] * blk.vx[i];
+            blk.y[i] += dt[i] * blk.vy[i];
+        }
+
+        trajectory_forces(dV, pot, &blk, count);
+
+        #pragma omp simd
+        for (i = 0; i < count; ++i)
+        {
+            const double r = sqrt(blk.x[i] * blk.x[i] + blk.y[i] * blk.y[i]);
+
+            blk.vx[i] += 0.5 * dt[i] * blk.ax[i];
+            blk.vy[i] += 0.5 * dt[i] * blk.ay[i];
+
+            blk.rotation[i] += atan2(vx_old[i] * blk.vy[i] - vy_old[i] * blk.vx[i],
+                                     vx_old[i] * blk.vx[i] + vy_old[i] * blk.vy[i]);
+            if (r < blk.r_min[i]) blk.r_min[i] = r;
+        }
+
+        /*----- Particles that left the interaction region -----*/
+        for (i = 0; i != count; ++i)
+        {
+            if (blk.active[i] != 0.0
+                && blk.x[i] * blk.vx[i] + blk.y[i] * blk.vy[i] > 0.0
+                && blk.x[i] * blk.x[i] + blk.y[i] * blk.y[i] > TRAJECTORY_DISTANCE * TRAJECTORY_DISTANCE)
+            {
+                blk.active[i] = 0.0;
+                --remaining;
+            }
+        }
+    }
+
+    for (i = 0; i != count; ++i)
+    {
+        rad[i] = M_PI - blk.rotation[i];
+        if (r_min != NULL) r_min[i] = blk.r_min[i];
+    }
+}
+
+/**
+ * Run a block with the potential selected by pot->kind
+ */
+void trajectory_block_potential(const potential_params *pot, const double *b, const double *E,
+                                double *rad, double *r_min, size_t count)
+{
+    switch (pot->kind) {
+        case POTENTIAL_LENNARD_JONES :
+            trajectory_run(lennard_jones_potential, lennard_jones_derivative, pot, b, E, rad, r_min, count);
+            break;
+        case POTENTIAL_REPULSIVE :
+            trajectory_run(repulsive_potential, repulsive_derivative, pot, b, E, rad, r_min, count);
+            break;
+        case POTENTIAL_MORSE :
+            trajectory_run(morse_potential, morse_derivative, pot, b, E, rad, r_min, count);
+            break;
+        default :
+            trajectory_run(coulomb_potential, coulomb_derivative, pot, b, E, rad, r_min, count);
+    }
+}
+
+/**
+ * Scatter n particles and return the polar angle swept by each one,
+ * comparable with integral_to_infinite (to_degrees(fabs(rad)) is the
+ * deflection angle). Blocks of TRAJECTORY_BLOCK particles are spread
+ * over the OpenMP threads.
+ * @param  pot    potential and its parameters
+ * @param  b      impact parameters (n elements)
+ * @param  E      energies (n elements)
+ * @param  rad    output angles (n elements)
+ * @param  r_min  output closest approach (n elements), can be NULL
+ * @param  n      number of particles
+ */
+void trajectory_batch(const potential_params *pot, const double *b, const double *E,
+                      double *rad, double *r_min, size_t n)
+{
+    long blk;
+    const long num_blocks = (long) ((n + TRAJECTORY_BLOCK - 1) / TRAJECTORY_BLOCK);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (blk = 0; blk < num_blocks; ++blk)
+    {
+        const size_t first = (size_t) blk * TRAJECTORY_BLOCK;
+        const size_t count = (n - first < TRAJECTORY_BLOCK) ? n - first : TRAJECTORY_BLOCK;
+
+        trajectory_block_potential(pot, b + first, E + first, rad + first,
+                                   (r_min != NULL) ? r_min + first : NULL, count);
+    }
+}
+
+#endif